@@ -54,7 +54,7 @@ def demo_basic_operations(client: UbusClient):
         # 1. List available objects
         print("1. Listing ubus objects:")
         start_time = time.time()
-        objects = client.list()
+        objects = client.list(signatures=True)
         elapsed_ms = (time.time() - start_time) * 1000
         
         print(f"   Found {len(objects)} objects in {elapsed_ms:.3f}ms")
@@ -63,7 +63,7 @@ def demo_basic_operations(client: UbusClient):
         interesting_objects = ['system', 'network', 'wireless', 'firewall', 'service']
         for obj in interesting_objects:
             if obj in objects:
-                method_count = len(objects[obj]) if isinstance(objects[obj], dict) else 0
+                method_count = len(objects[obj]['methods'])
                 print(f"   - {obj}: {method_count} methods")
         
         # 2. Get system information
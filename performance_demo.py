@@ -23,6 +23,7 @@ from typing import Dict, Any
 # Import PyUbus
 try:
     from pyubus import UbusClient, UbusError
+    from pyubus.bench import measure
     from pyubus.exceptions import (
         UbusConnectionError, 
         UbusAuthError, 
@@ -70,18 +71,13 @@ def performance_test(client: UbusClient, num_calls: int = 50):
     print(f"Making {num_calls} calls to system.board...")
     
     try:
-        start_time = time.time()
-        
-        for i in range(num_calls):
-            result = client.call("system", "board")
-            
-        end_time = time.time()
-        elapsed_ms = (end_time - start_time) * 1000
-        avg_ms = elapsed_ms / num_calls
+        result = measure(lambda: client.call("system", "board"), num_calls, warmup=10)
+        avg_ms = result["mean_us"] / 1000
         
-        print(f"  Total time: {elapsed_ms:.2f}ms")
-        print(f"  Average per call: {avg_ms:.3f}ms")
-        print(f"  Calls per second: {num_calls / (elapsed_ms / 1000):.0f}")
+        print(f"  Median per call: {result['p50_us'] / 1000:.3f}ms")
+        print(f"  p99 per call: {result['p99_us'] / 1000:.3f}ms")
+        print(f"  Calls per second: {result['ops_per_sec']:.0f}")
+        print(f"  (run pyubus-bench for the full benchmark suite)")
         
         # Performance comparison
         print(f"\n  Performance comparison:")
@@ -38,6 +38,7 @@ from .exceptions import (
     UbusAuthError, 
     UbusPermissionError,
     UbusTimeoutError,
+    UbusReplyLimitError,
     UbusMethodError
 )
 
@@ -49,6 +50,7 @@ __all__ = [
     'UbusAuthError',
     'UbusPermissionError',
     'UbusTimeoutError',
+    'UbusReplyLimitError',
     'UbusMethodError',
 ]
 
@@ -59,9 +61,12 @@ def get_version():
 
 def get_info():
     """Get PyUbus runtime information"""
+    from .client import ubus_native
+    
     return {
         'version': __version__,
         'native_extension': NATIVE_AVAILABLE,
+        'features': list(getattr(ubus_native, 'FEATURES', ())),
         'architecture': 'C Extension → libubus → ubusd',
         'performance': 'Sub-millisecond response times'
     } 
\ No newline at end of file
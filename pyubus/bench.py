@@ -0,0 +1,625 @@
+#!/usr/bin/env python3
+"""
+PyUbus benchmark suite
+
+Measures call latency percentiles and throughput of the native client
+against a synthetic "pyubus.bench" object, so results do not depend on what
+the device happens to publish. The object is served by a child process; with
+--private that child talks to a throwaway ubusd started on a temporary
+socket, which lets the suite run off-device wherever ubusd is installed.
+
+Scenarios:
+- reply-N:   call returning a table of N entries (decode cost)
+- params-N:  call sending a table of N entries (encode cost)
+- batch-N:   call_many() of N calls
+- async-N:   N call_async() requests in flight at a time
+- threads-N: N threads sharing a pool of N connections
+
+--check runs regression checks against the same object instead: results,
+error types, the reply cache and reply limits, exiting with status 1 when
+one fails.
+
+Usage:
+    pyubus-bench --private
+    pyubus-bench --scenario reply-256 --scenario threads-4 --stats
+    pyubus-bench --private --json current.json --baseline main.json
+    pyubus-bench --private --check
+"""
+
+import argparse
+import asyncio
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from typing import Any, Callable, Dict, List, Optional
+
+try:
+    import ubus_native
+except ImportError:
+    ubus_native = None
+
+from .client import UbusClient
+from .exceptions import UbusError, UbusMethodError, UbusPermissionError, UbusReplyLimitError
+
+BENCH_OBJECT = "pyubus.bench"
+DEFAULT_SCENARIOS = [
+    "reply-1", "reply-16", "reply-256",
+    "params-1", "params-16", "params-256",
+    "batch-16", "async-16", "threads-4",
+]
+
+
+# Synthetic object, run in the child process
+
+def _reply_payload(size: int) -> Dict[str, Any]:
+    """Reply resembling an interface dump, with size entries"""
+    return {
+        "items": [
+            {"name": f"item{i}", "index": i, "up": i % 2 == 0, "rx_bytes": i * 1500}
+            for i in range(size)
+        ]
+    }
+
+
+def _nested_payload(depth: int) -> Dict[str, Any]:
+    """Reply nesting tables depth levels deep, the reply itself being 1"""
+    payload = {"leaf": depth}
+    for _ in range(depth - 1):
+        payload = {"table": payload}
+    return payload
+
+
+def publish(server) -> None:
+    """Add BENCH_OBJECT to a connected native client"""
+    payloads = {}
+    invocations = [0]
+
+    def reply(request, size=1):
+        if size not in payloads:
+            payloads[size] = _reply_payload(size)
+        return payloads[size]
+
+    def sink(request, **params):
+        return None
+
+    # Used by --check
+    def echo(request, **params):
+        return params
+
+    def status(request, status=0):
+        return status
+
+    def count(request, **params):
+        invocations[0] += 1
+        return {"count": invocations[0]}
+
+    def nest(request, depth=1):
+        return _nested_payload(depth)
+
+    int32 = ubus_native.BLOBMSG_TYPE_INT32
+    server.add_object(BENCH_OBJECT, {
+        "reply": (reply, {"size": int32}),
+        "sink": sink,
+        "echo": echo,
+        "status": (status, {"status": int32}),
+        "count": count,
+        "nest": (nest, {"depth": int32}),
+    })
+
+
+def serve(socket_path: Optional[str]) -> None:
+    """Publish BENCH_OBJECT and dispatch requests until terminated"""
+    server = ubus_native.UbusClient()
+    if socket_path:
+        server.connect(socket_path)
+    else:
+        server.connect()
+    publish(server)
+
+    print("ready", flush=True)
+    while True:
+        server.process_events(1.0)
+
+
+class BenchServer:
+    """Child process serving BENCH_OBJECT, optionally with its own ubusd"""
+
+    def __init__(self, socket_path: Optional[str], private: bool = False, ubusd: str = "ubusd"):
+        self.socket_path = socket_path
+        self.private = private
+        self.ubusd = ubusd
+        self._tmpdir = None
+        self._ubusd = None
+        self._server = None
+
+    def __enter__(self):
+        try:
+            if self.private:
+                self._start_ubusd()
+            self._start_server()
+        except Exception:
+            self.stop()
+            raise
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.stop()
+
+    def _start_ubusd(self) -> None:
+        binary = shutil.which(self.ubusd)
+        if not binary:
+            raise RuntimeError(f"{self.ubusd} not found, needed for --private")
+
+        self._tmpdir = tempfile.mkdtemp(prefix="pyubus-bench-")
+        self.socket_path = os.path.join(self._tmpdir, "ubus.sock")
+        self._ubusd = subprocess.Popen([binary, "-s", self.socket_path])
+
+        deadline = time.monotonic() + 5
+        while not os.path.exists(self.socket_path):
+            if self._ubusd.poll() is not None or time.monotonic() > deadline:
+                raise RuntimeError("private ubusd did not start")
+            time.sleep(0.01)
+
+    def _start_server(self) -> None:
+        cmd = [sys.executable, "-m", "pyubus.bench", "--serve"]
+        if self.socket_path:
+            cmd += ["--socket", self.socket_path]
+        self._server = subprocess.Popen(cmd, stdout=subprocess.PIPE, universal_newlines=True)
+
+        if self._server.stdout.readline().strip() != "ready":
+            raise RuntimeError("benchmark object could not be published")
+
+    def stop(self) -> None:
+        for proc in (self._server, self._ubusd):
+            if proc and proc.poll() is None:
+                proc.terminate()
+                proc.wait()
+        self._server = self._ubusd = None
+        if self._tmpdir:
+            shutil.rmtree(self._tmpdir, ignore_errors=True)
+            self._tmpdir = None
+
+
+# Measurement
+
+def percentile(sorted_ns: List[int], p: float) -> int:
+    """Nearest-rank percentile of sorted samples"""
+    if not sorted_ns:
+        return 0
+    rank = max(1, math.ceil(len(sorted_ns) * p / 100))
+    return sorted_ns[rank - 1]
+
+
+def summarize(samples_ns: List[int], elapsed_ns: int, ops: int) -> Dict[str, float]:
+    """Latency percentiles in microseconds and throughput of a run"""
+    samples_ns = sorted(samples_ns)
+    return {
+        "samples": len(samples_ns),
+        "mean_us": sum(samples_ns) / len(samples_ns) / 1000 if samples_ns else 0.0,
+        "p50_us": percentile(samples_ns, 50) / 1000,
+        "p99_us": percentile(samples_ns, 99) / 1000,
+        "p99.9_us": percentile(samples_ns, 99.9) / 1000,
+        "max_us": samples_ns[-1] / 1000 if samples_ns else 0.0,
+        "ops_per_sec": ops / (elapsed_ns / 1e9) if elapsed_ns else 0.0,
+    }
+
+
+def measure(fn: Callable[[], Any], iterations: int, warmup: int = 100, ops_per_call: int = 1) -> Dict[str, float]:
+    """Time iterations calls of fn with perf_counter_ns"""
+    clock = time.perf_counter_ns
+    for _ in range(warmup):
+        fn()
+
+    samples = [0] * iterations
+    start = clock()
+    for i in range(iterations):
+        t = clock()
+        fn()
+        samples[i] = clock() - t
+    elapsed = clock() - start
+
+    return summarize(samples, elapsed, iterations * ops_per_call)
+
+
+def bench_async(client: UbusClient, iterations: int, concurrency: int) -> Dict[str, float]:
+    """Keep concurrency call_async() requests in flight"""
+    native = client._native
+    clock = time.perf_counter_ns
+    samples = []
+
+    async def worker(count: int) -> None:
+        for _ in range(count):
+            t = clock()
+            await native.call_async(BENCH_OBJECT, "reply", {"size": 1})
+            samples.append(clock() - t)
+
+    async def run() -> int:
+        await asyncio.gather(*(worker(10) for _ in range(concurrency)))
+        samples.clear()
+        start = clock()
+        await asyncio.gather(*(worker(iterations // concurrency) for _ in range(concurrency)))
+        return clock() - start
+
+    elapsed = asyncio.run(run())
+    return summarize(samples, elapsed, len(samples))
+
+
+def bench_threads(socket_path: Optional[str], iterations: int, threads: int, stats: bool) -> Dict[str, float]:
+    """Run calls from threads sharing a pool of as many connections"""
+    clock = time.perf_counter_ns
+    client = UbusClient(socket_path=socket_path or "/var/run/ubus.sock", pool_size=threads, stats=stats)
+    client.connect()
+    per_thread = [[] for _ in range(threads)]
+    barrier = threading.Barrier(threads + 1)
+
+    def worker(samples: List[int]) -> None:
+        barrier.wait()
+        for _ in range(iterations // threads):
+            t = clock()
+            client.call(BENCH_OBJECT, "reply", {"size": 1})
+            samples.append(clock() - t)
+
+    workers = [threading.Thread(target=worker, args=(s,)) for s in per_thread]
+    for w in workers:
+        w.start()
+    barrier.wait()
+    start = clock()
+    for w in workers:
+        w.join()
+    elapsed = clock() - start
+
+    result = summarize([ns for s in per_thread for ns in s], elapsed, sum(map(len, per_thread)))
+    if stats:
+        result["phases"] = _phase_means(client, "reply")
+    client.disconnect()
+    return result
+
+
+def _phase_means(client: UbusClient, method: str) -> Dict[str, float]:
+    """Mean time per phase in microseconds from the client statistics"""
+    entry = client.stats().get((BENCH_OBJECT, method))
+    if not entry:
+        return {}
+    return {phase: entry[phase]["mean_us"] for phase in ("lookup", "encode", "ipc", "decode")}
+
+
+def run_scenario(name: str, client: UbusClient, args) -> Dict[str, Any]:
+    """Run one scenario, named kind-N"""
+    kind, _, arg = name.partition("-")
+    n = int(arg) if arg else 1
+
+    if kind == "threads":
+        return bench_threads(args.socket, args.iterations, n, args.stats)
+
+    client.reset_stats()
+    if kind == "reply":
+        params = {"size": n}
+        result = measure(lambda: client.call(BENCH_OBJECT, "reply", params), args.iterations, args.warmup)
+        method = "reply"
+    elif kind == "params":
+        params = _reply_payload(n)
+        result = measure(lambda: client.call(BENCH_OBJECT, "sink", params), args.iterations, args.warmup)
+        method = "sink"
+    elif kind == "batch":
+        calls = [(BENCH_OBJECT, "reply", {"size": 1})] * n
+        result = measure(lambda: client.call_many(calls), max(1, args.iterations // n), args.warmup, n)
+        method = None
+    elif kind == "async":
+        result = bench_async(client, args.iterations, n)
+        method = "reply"
+    else:
+        raise ValueError(f"unknown scenario {name}")
+
+    if args.stats and method:
+        result["phases"] = _phase_means(client, method)
+    return result
+
+
+# Regression checks, run instead of the scenarios with --check
+
+ECHO_PARAMS = {
+    "string": "pyubus",
+    "int": 42,
+    "negative": -7,
+    "int64": 1 << 40,
+    "bool": True,
+    "array": [1, "two", {"three": 3}],
+    "table": {"nested": {"deep": "value"}},
+}
+
+
+def _expect_error(call: Callable[[], Any], error: type, status: Optional[int]) -> UbusError:
+    """Run call, which must fail with error carrying status"""
+    try:
+        call()
+    except error as e:
+        if e.status != status:
+            raise AssertionError(f"{error.__name__} with status {e.status}, expected {status}")
+        return e
+    raise AssertionError(f"{error.__name__} not raised")
+
+
+def check_results(client: UbusClient) -> Optional[str]:
+    """Replies and params survive the round-trip unchanged"""
+    for size in (0, 1, 16, 256):
+        assert client.call(BENCH_OBJECT, "reply", {"size": size}) == _reply_payload(size), f"reply of {size} entries"
+    assert client.call(BENCH_OBJECT, "echo", ECHO_PARAMS) == ECHO_PARAMS, "echoed params"
+    assert client.call(BENCH_OBJECT, "sink", _reply_payload(16)) == {}, "empty reply"
+
+    view = client._native.call(BENCH_OBJECT, "reply", {"size": 16}, lazy=True)
+    assert view["items"][15]["name"] == "item15", "lazy reply"
+    return None
+
+
+def check_errors(client: UbusClient) -> Optional[str]:
+    """Failed calls raise the class matching their status"""
+    _expect_error(lambda: client.call(BENCH_OBJECT, "missing"),
+                  UbusMethodError, ubus_native.UBUS_STATUS_METHOD_NOT_FOUND)
+    _expect_error(lambda: client.call(BENCH_OBJECT + ".missing", "reply"),
+                  UbusMethodError, ubus_native.UBUS_STATUS_NOT_FOUND)
+
+    for status, error in ((ubus_native.UBUS_STATUS_INVALID_ARGUMENT, UbusMethodError),
+                          (ubus_native.UBUS_STATUS_PERMISSION_DENIED, UbusPermissionError),
+                          (ubus_native.UBUS_STATUS_NO_DATA, UbusError)):
+        _expect_error(lambda: client.call(BENCH_OBJECT, "status", {"status": status}), error, status)
+    return None
+
+
+def check_batch(client: UbusClient) -> Optional[str]:
+    """call_many() and call_async() return what call() does, errors included"""
+    denied = {"status": ubus_native.UBUS_STATUS_PERMISSION_DENIED}
+    results = client.call_many([
+        (BENCH_OBJECT, "reply", {"size": 1}),
+        (BENCH_OBJECT, "status", denied),
+        (BENCH_OBJECT, "echo", ECHO_PARAMS),
+    ])
+    assert results[0] == _reply_payload(1), "batched reply"
+    assert isinstance(results[1], UbusPermissionError), f"batched error {results[1]!r}"
+    assert results[2] == ECHO_PARAMS, "batched echo"
+
+    native = client._native
+
+    async def run() -> List[Any]:
+        replies = await asyncio.gather(*(native.call_async(BENCH_OBJECT, "reply", {"size": n}) for n in (1, 2, 3)))
+        try:
+            await native.call_async(BENCH_OBJECT, "status", denied)
+        except UbusPermissionError:
+            return replies
+        raise AssertionError("async error not raised")
+
+    assert asyncio.run(run()) == [_reply_payload(n) for n in (1, 2, 3)], "async replies"
+    return None
+
+
+def check_cache(client: UbusClient) -> Optional[str]:
+    """Cached replies are served while the TTL lasts, within the reply limits"""
+    native = client._native
+    if not hasattr(native, "set_cache_ttl"):
+        return "built without the cache"
+
+    client.set_cache_ttl(BENCH_OBJECT, "count", 60)
+    client.set_cache_ttl(BENCH_OBJECT, "reply", 60)
+    try:
+        hits = native.cache_hits
+        first = client.call(BENCH_OBJECT, "count")
+        assert client.call(BENCH_OBJECT, "count") == first, "cached reply not served"
+        assert native.cache_hits == hits + 1, "cache hit not counted"
+        assert client.call(BENCH_OBJECT, "count", {"key": 1}) != first, "params not part of the key"
+
+        client.clear_cache()
+        assert client.call(BENCH_OBJECT, "count") != first, "cleared reply served"
+
+        # A limit lowered after the reply was cached still applies
+        client.call(BENCH_OBJECT, "reply", {"size": 16})
+        client.max_reply_size = 64
+        _expect_error(lambda: client.call(BENCH_OBJECT, "reply", {"size": 16}), UbusReplyLimitError, None)
+    finally:
+        client.max_reply_size = 0
+        client.set_cache_ttl(BENCH_OBJECT, "count", None)
+        client.set_cache_ttl(BENCH_OBJECT, "reply", None)
+    return None
+
+
+def check_limits(client: UbusClient) -> Optional[str]:
+    """Replies over max_reply_size or max_reply_depth are refused"""
+    try:
+        client.max_reply_size = 1024
+        client.call(BENCH_OBJECT, "reply", {"size": 1})
+        _expect_error(lambda: client.call(BENCH_OBJECT, "reply", {"size": 256}), UbusReplyLimitError, None)
+        results = client.call_many([(BENCH_OBJECT, "reply", {"size": 256})])
+        assert isinstance(results[0], UbusReplyLimitError), f"batched reply over the limit {results[0]!r}"
+        client.max_reply_size = 0
+
+        client.max_reply_depth = 4
+        client.call(BENCH_OBJECT, "nest", {"depth": 4})
+        _expect_error(lambda: client.call(BENCH_OBJECT, "nest", {"depth": 5}), UbusReplyLimitError, None)
+    finally:
+        client.max_reply_size = 0
+        client.max_reply_depth = 0
+    return None
+
+
+def check_pool(client: UbusClient) -> Optional[str]:
+    """Threads sharing a coalescing pool each get their own reply and error"""
+    pool = UbusClient(socket_path=client.socket_path, pool_size=4, coalesce=True)
+    pool.connect()
+    denied = {"status": ubus_native.UBUS_STATUS_PERMISSION_DENIED}
+    failures = []
+    errors = []
+    barrier = threading.Barrier(8)
+
+    def worker(index: int) -> None:
+        barrier.wait()
+        for i in range(50):
+            size = (index + i) % 4
+            if pool.call(BENCH_OBJECT, "reply", {"size": size}) != _reply_payload(size):
+                failures.append(f"reply of {size} entries")
+        try:
+            pool.call(BENCH_OBJECT, "status", denied)
+        except UbusPermissionError as e:
+            errors.append(e)
+
+    workers = [threading.Thread(target=worker, args=(i,)) for i in range(8)]
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    pool.disconnect()
+
+    assert not failures, f"wrong replies: {', '.join(failures[:3])}"
+    assert len(errors) == 8, f"{8 - len(errors)} calls did not raise UbusPermissionError"
+    assert len({id(e) for e in errors}) == 8, "coalesced calls shared an exception instance"
+    return None
+
+
+CHECKS = [
+    ("results", check_results),
+    ("errors", check_errors),
+    ("batch", check_batch),
+    ("cache", check_cache),
+    ("limits", check_limits),
+    ("pool", check_pool),
+]
+
+
+def run_checks(socket_path: Optional[str]) -> List[str]:
+    """Run CHECKS against BENCH_OBJECT, printing a line each; returns the failures"""
+    client = UbusClient(socket_path=socket_path or "/var/run/ubus.sock")
+    client.connect()
+    failures = []
+
+    for name, check in CHECKS:
+        try:
+            skipped = check(client)
+        except Exception as e:
+            failures.append(name)
+            print(f"{name:<12} FAIL  {type(e).__name__}: {e}")
+        else:
+            print(f"{name:<12} {'skip  ' + skipped if skipped else 'ok'}")
+
+    client.disconnect()
+    return failures
+
+
+# Reporting
+
+def print_results(results: Dict[str, Dict[str, Any]], stats: bool) -> None:
+    """Print results as a table"""
+    header = f"{'scenario':<12} {'p50 us':>9} {'p99 us':>9} {'p99.9 us':>9} {'max us':>9} {'ops/s':>10}"
+    if stats:
+        header += f"  {'lookup':>7} {'encode':>7} {'ipc':>7} {'decode':>7}"
+    print(header)
+
+    for name, r in results.items():
+        line = (f"{name:<12} {r['p50_us']:>9.1f} {r['p99_us']:>9.1f} {r['p99.9_us']:>9.1f} "
+                f"{r['max_us']:>9.1f} {r['ops_per_sec']:>10.0f}")
+        phases = r.get("phases")
+        if phases:
+            line += "  " + " ".join(f"{phases.get(p, 0):>7.1f}" for p in ("lookup", "encode", "ipc", "decode"))
+        print(line)
+
+
+def compare(results: Dict[str, Dict[str, Any]], baseline: Dict[str, Dict[str, Any]],
+            max_regression: float) -> List[str]:
+    """Scenarios whose p50 or p99 got slower than the baseline by more than max_regression percent"""
+    regressions = []
+    for name, r in results.items():
+        old = baseline.get(name)
+        if not old:
+            continue
+        for key in ("p50_us", "p99_us"):
+            if old[key] and (r[key] - old[key]) / old[key] * 100 > max_regression:
+                regressions.append(f"{name} {key}: {old[key]:.1f} -> {r[key]:.1f}")
+    return regressions
+
+
+def main() -> None:
+    """Benchmark CLI entry point"""
+    parser = argparse.ArgumentParser(
+        description="PyUbus benchmark suite",
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="Scenarios: reply-N, params-N, batch-N, async-N, threads-N\n"
+               f"Default: {' '.join(DEFAULT_SCENARIOS)}",
+    )
+    parser.add_argument('-s', '--socket',
+                        help='ubus socket (default: /var/run/ubus.sock)')
+    parser.add_argument('--private', action='store_true',
+                        help='Start a throwaway ubusd on a temporary socket')
+    parser.add_argument('--ubusd', default='ubusd',
+                        help='ubusd binary for --private (default: ubusd)')
+    parser.add_argument('--scenario', action='append', dest='scenarios',
+                        help='Scenario to run, may be repeated')
+    parser.add_argument('-n', '--iterations', type=int, default=10000,
+                        help='Calls per scenario (default: 10000)')
+    parser.add_argument('--warmup', type=int, default=100,
+                        help='Untimed calls before each scenario (default: 100)')
+    parser.add_argument('--stats', action='store_true',
+                        help='Break the mean down into lookup/encode/ipc/decode')
+    parser.add_argument('--json', metavar='FILE',
+                        help='Write the results to FILE')
+    parser.add_argument('--baseline', metavar='FILE',
+                        help='Fail if p50 or p99 regressed against a --json FILE')
+    parser.add_argument('--max-regression', type=float, default=10.0,
+                        help='Regression allowed against --baseline in percent (default: 10)')
+    parser.add_argument('--check', action='store_true',
+                        help='Check results, error types, caching and reply limits instead of timing')
+    parser.add_argument('--serve', action='store_true', help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if ubus_native is None:
+        print("Error: the native C extension is not available", file=sys.stderr)
+        sys.exit(1)
+
+    if args.serve:
+        try:
+            serve(args.socket)
+        except KeyboardInterrupt:
+            pass
+        return
+
+    results = {}
+    failures = []
+    try:
+        with BenchServer(args.socket, args.private, args.ubusd) as server:
+            args.socket = server.socket_path
+            if args.check:
+                failures = run_checks(args.socket)
+            else:
+                client = UbusClient(socket_path=args.socket or "/var/run/ubus.sock", stats=args.stats)
+                client.connect()
+                for name in args.scenarios or DEFAULT_SCENARIOS:
+                    results[name] = run_scenario(name, client, args)
+                client.disconnect()
+    except (UbusError, RuntimeError, ValueError) as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if args.check:
+        if failures:
+            print(f"{len(failures)} of {len(CHECKS)} checks failed: {', '.join(failures)}", file=sys.stderr)
+            sys.exit(1)
+        return
+
+    print_results(results, args.stats)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.max_regression)
+        for line in regressions:
+            print(f"Regression: {line}", file=sys.stderr)
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -3,11 +3,26 @@
 Setup script for PyUbus native C extension
 
 This builds the C extension module that provides direct libubus bindings.
+PYUBUS_DISABLE and PYUBUS_OPTIMIZE are read from the environment as in the
+top-level setup.py.
 """
 
 from setuptools import setup, Extension
+import os
 import subprocess
 import shlex
+import sys
+
+# Optional parts of the C extension, see PYUBUS_WITH_* in ubus_module.c
+FEATURES = ('json', 'events', 'stats', 'cache')
+
+# (compile, link) flags of each PYUBUS_OPTIMIZE variant
+OPTIMIZE_FLAGS = {
+    'size': (['-Os', '-flto', '-ffunction-sections', '-fdata-sections'],
+             ['-Os', '-flto', '-Wl,--gc-sections']),
+    'speed': (['-O2'], []),
+    '': ([], []),
+}
 
 def get_pkg_config_flags(library):
     """Get compilation flags from pkg-config"""
@@ -45,24 +60,41 @@ def get_pkg_config_flags(library):
         print(f"Warning: {library} not found via pkg-config, using defaults")
         return {'libraries': [], 'include_dirs': [], 'library_dirs': []}
 
+disabled = {f.strip() for f in os.environ.get('PYUBUS_DISABLE', '').split(',') if f.strip()}
+optimize = os.environ.get('PYUBUS_OPTIMIZE', '').strip()
+if disabled - set(FEATURES) or optimize not in OPTIMIZE_FLAGS:
+    sys.exit(f"PYUBUS_DISABLE takes {', '.join(FEATURES)}; PYUBUS_OPTIMIZE takes size or speed")
+with_json = 'json' not in disabled
+
 # Get libubus and json-c flags
 libubus_flags = get_pkg_config_flags('libubus')
-json_flags = get_pkg_config_flags('json-c')
+json_flags = get_pkg_config_flags('json-c') if with_json else {
+    'libraries': [], 'include_dirs': [], 'library_dirs': []
+}
 
 # Combine flags
 libraries = libubus_flags['libraries'] + json_flags['libraries']
 include_dirs = libubus_flags['include_dirs'] + json_flags['include_dirs']
 library_dirs = libubus_flags['library_dirs'] + json_flags['library_dirs']
 
+if not libraries:
+    libraries = ['ubus', 'json-c'] if with_json else ['ubus']
+# blobmsg_format_json() for call_json() is not listed by pkg-config
+if with_json and 'blobmsg_json' not in libraries:
+    libraries.append('blobmsg_json')
+
+compile_flags, link_flags = OPTIMIZE_FLAGS[optimize]
+
 # Define the extension module
 ubus_native_extension = Extension(
     'ubus_native',
     sources=['ubus_module.c'],
-    libraries=libraries or ['ubus', 'json-c', 'blobmsg_json'],
+    libraries=libraries,
     include_dirs=include_dirs or ['/usr/include'],
     library_dirs=library_dirs,
-    extra_compile_args=['-std=c99', '-Wall'],
-    extra_link_args=[],
+    define_macros=[(f'PYUBUS_WITH_{feature.upper()}', '0') for feature in sorted(disabled)],
+    extra_compile_args=['-std=c99', '-Wall'] + compile_flags,
+    extra_link_args=link_flags,
 )
 
 setup(
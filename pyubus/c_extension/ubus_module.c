@@ -8,373 +8,8921 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <libubus.h>
-#include <json-c/json.h>
 #include <structmember.h>
+#include <pthread.h>
+#include <pythread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* Features that can be left out of small builds, see PYUBUS_DISABLE in
+ * setup.py. All of them are built by default. */
+#ifndef PYUBUS_WITH_JSON
+#define PYUBUS_WITH_JSON 1      /* call_json() with json-c, json module otherwise */
+#endif
+#ifndef PYUBUS_WITH_EVENTS
+#define PYUBUS_WITH_EVENTS 1    /* listen() and subscribe() */
+#endif
+#ifndef PYUBUS_WITH_STATS
+#define PYUBUS_WITH_STATS 1     /* Per-method latency statistics */
+#endif
+#ifndef PYUBUS_WITH_CACHE
+#define PYUBUS_WITH_CACHE 1     /* Reply cache, set_cache_ttl() */
+#endif
+
+#if PYUBUS_WITH_JSON
+#include <libubox/blobmsg_json.h>
+#endif
+
+/* Number of hash buckets in the per-context object ID cache */
+#define ID_CACHE_SIZE 64
+
+/* Number of hash buckets and default memory budget of the reply cache */
+#define REPLY_CACHE_SIZE 64
+#define DEFAULT_CACHE_LIMIT 262144
+
+/* Slots, probe length and longest key of the decoder's key cache */
+#define KEY_CACHE_SIZE 512
+#define KEY_CACHE_PROBES 4
+#define KEY_CACHE_MAX_LEN 31
+
+/* Default for UbusClient.buffer_limit */
+#define DEFAULT_BUFFER_LIMIT 16384
+
+/* Completed async requests kept for reuse per context */
+#define ASYNC_POOL_SIZE 16
+
+/* Number of events queued per context before new ones are dropped */
+#define EVENT_RING_SIZE 256
+
+/* How often an I/O thread waiting for a busy context checks for a stop,
+ * and the first and longest wait between its reconnect attempts */
+#define IO_LOCK_POLL_MS 50
+#define IO_BACKOFF_MIN_MS 100
+#define IO_BACKOFF_MAX_MS 5000
+
+/* Default and largest raw chunk size of write_file(), multiples of 3 so the
+ * base64 of a chunk carries no padding, and chunks in flight at a time */
+#define FILE_CHUNK_SIZE 49152
+#define FILE_CHUNK_MAX 524286
+#define FILE_WINDOW 4
+
+/* Shared cache segment layout, see attach_shared_cache(): a header, a table
+ * of resolved objects, then replies in the rest of the segment */
+#define SHM_MAGIC 0x50554253u   /* "PUBS" */
+#define SHM_VERSION 1
+#define SHM_HEADER_SIZE 64
+#define SHM_ID_SLOTS 256
+#define SHM_ID_SLOT_SIZE 1024
+#define SHM_REPLY_SLOT_SIZE 4096
+#define SHM_DEFAULT_SIZE 1048576
+#define SHM_READ_RETRIES 4
+
+/* Number of hash buckets in the per-context call statistics */
+#define STATS_TABLE_SIZE 64
+
+/* Latency histogram layout: one bucket per nanosecond below STATS_SUB_BUCKETS,
+ * then STATS_SUB_BUCKETS buckets per power of two up to 2^STATS_MAX_BITS ns
+ * (about 69 s), so every bucket is at most 25% wide */
+#define STATS_SUB_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 36
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+struct event_msg;
+struct call_stats;
+
+/* Reply cached by call() for a method with a TTL */
+struct reply_cache_entry {
+    struct list_head lru;       /* Most recently used first */
+    struct reply_cache_entry *next;
+    uint32_t hash;
+    uint32_t id;
+    int64_t expires;            /* On the monotonic_ms() clock */
+    size_t size;                /* Bytes held, counted against cache_limit */
+    struct blob_attr *reply;    /* Raw reply, NULL for an empty one */
+    size_t params_offset;
+    char key[];                 /* Method name, NUL, then the params blob */
+};
+
+/* TTL set with set_cache_ttl() for an (object, method), "*" matching every method */
+struct cache_rule {
+    struct cache_rule *next;
+    int ttl_ms;
+    size_t method_offset;
+    char key[];                 /* Object name and method, both NUL terminated */
+};
+
+/* A call other threads with the same key wait on instead of sending their own */
+struct flight {
+    struct flight *next;
+    uint32_t hash;
+    unsigned long leader;       /* Thread making the call */
+    int waiters;
+    int done;
+    struct blob_attr *reply;    /* Raw reply for the waiters, NULL for an empty one */
+    PyObject *error;            /* Exception the call failed with */
+    size_t key_len;
+    char key[];
+};
+
+/* Calls in flight of a client or pool, coalesce needs to be set */
+struct flight_table {
+    pthread_mutex_t lock;
+    pthread_cond_t landed;      /* Broadcast whenever a call completes */
+    struct flight *head;
+};
+
+/* Cached object ID and signature for one object path */
+struct id_cache_entry {
+    struct id_cache_entry *next;
+    uint32_t hash;
+    uint32_t id;
+    char suspect;               /* Got NOT_FOUND unwatched, checked on the next resolve */
+    struct blob_attr *signature;
+    char path[];
+};
+
+/* Header at the start of a shared cache segment */
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id_slots;
+    uint32_t id_slot_size;
+    uint32_t reply_slots;
+    uint32_t reply_slot_size;
+};
+
+/* Slot of a shared cache segment. Every slot is its own seqlock: seq is odd
+ * while a writer updates the slot, readers copy it out and retry if seq moved. */
+struct shm_slot {
+    uint32_t seq;
+    uint32_t hash;
+    uint32_t id;
+    uint32_t len;               /* Bytes used in data, 0 for an empty slot */
+    int64_t expires;            /* Replies only, on the monotonic_ms() clock */
+    char data[];                /* Path or method, NUL, padding, then blobs */
+};
+
+/* Shared cache segment mapped by a client */
+struct shm_segment {
+    char *base;
+    size_t size;
+    struct shm_header *header;
+    char replies;               /* Share cached replies, not only object IDs */
+    char path[];
+};
 
 /* UbusClient object structure */
 typedef struct {
     PyObject_HEAD
     struct ubus_context *ctx;
     int connected;
-    int timeout;
+    int timeout_ms;             /* 0 waits without limit */
+    pthread_mutex_t lock;
+    unsigned long lock_owner;   /* Thread holding lock, 0 for none, atomic */
+    int lock_depth;
+    struct ubus_event_handler object_event;
+    struct id_cache_entry *id_cache[ID_CACHE_SIZE];
+    struct cache_rule *cache_rules;
+    struct reply_cache_entry *reply_cache[REPLY_CACHE_SIZE];
+    struct list_head cache_lru;
+    Py_ssize_t cache_bytes;
+    Py_ssize_t cache_limit;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    struct list_head async_requests;
+    struct list_head iterators;
+    PyObject *loop;
+    unsigned long loop_thread;
+    struct list_head listeners;
+    uint64_t next_listener_id;
+    /* Single producer (whoever holds the lock and dispatches the socket),
+     * single consumer (client_drain_events() under the GIL) */
+    struct event_msg *event_ring[EVENT_RING_SIZE];
+    unsigned int event_head;
+    unsigned int event_tail;
+    int draining;
+    unsigned long events_dropped;
+    struct list_head objects;
+    unsigned int connection;
+    char *socket_path;
+    unsigned long reconnects;
+    /* Encode buffer reused between calls, freed when it grows past buffer_limit */
+    struct blob_buf buf;
+    int buf_busy;
+    int buffer_limit;
+    struct list_head async_pool;
+    int async_pool_size;
+    /* Per (object, method) timings, only collected while stats_enabled */
+    char stats_enabled;
+    struct call_stats *stats[STATS_TABLE_SIZE];
+    /* Identical calls in flight at the same time share one request */
+    char coalesce;
+    unsigned long coalesced;
+    struct flight_table flights;
+    /* Background thread dispatching the socket, see start_io_thread() */
+    pthread_t io_thread;
+    char io_state;              /* IO_IDLE, IO_RUNNING or IO_EXITED */
+    char io_stop;
+    char io_main;               /* Hand events to the main thread */
+    char io_pending;            /* Pending call scheduled, atomic */
+    char io_orphaned;           /* Pending call owns the thread's reference */
+    char io_joining;
+    int io_wakeup[2];           /* Pipe waking the thread up */
+    struct list_head io_list;
+    /* Replies over either limit are refused before decoding, 0 for no limit */
+    Py_ssize_t max_reply_size;
+    int max_reply_depth;
+    unsigned long long bytes_received;
+    unsigned long long bytes_decoded;
+    unsigned long long decode_peak;     /* estimated allocation of the largest decode */
+    /* Segment shared with other processes, see attach_shared_cache() */
+    struct shm_segment *shm;
+    unsigned long shared_hits;
+    char watch_objects;         /* Follow object events, cleared with watch=False */
+    char objects_watched;       /* The object events are registered */
 } UbusClientObject;
 
+/* UbusClientObject.io_state */
+enum {
+    IO_IDLE,
+    IO_RUNNING,
+    IO_EXITED,                  /* Thread gone, not joined yet */
+};
+
 /* Forward declarations */
 static PyTypeObject UbusClientType;
 
-/* Convert JSON object to Python object */
-static PyObject *json_to_python(json_object *obj) {
-    if (!obj) {
-        Py_RETURN_NONE;
+static PyObject *blob_to_python(struct blob_attr *attr);
+
+/* Interned key string, shared by every reply that uses the key */
+struct key_cache_entry {
+    uint32_t hash;
+    uint32_t len;
+    PyObject *str;
+    char key[KEY_CACHE_MAX_LEN + 1];
+};
+
+/* Replies reuse a small vocabulary of keys ("up", "l3_device", ...), so the
+ * decoder keeps one interned string per key instead of allocating a new one
+ * per entry. Only touched with the GIL held. */
+static struct key_cache_entry key_cache[KEY_CACHE_SIZE];
+
+/* Get the Python string for a blobmsg entry name */
+static PyObject *blob_key_to_python(const char *name) {
+    uint32_t hash = 2166136261u;
+    size_t len = 0;
+    
+    for (; name[len] && len <= KEY_CACHE_MAX_LEN; len++) {
+        hash = (hash ^ (uint8_t)name[len]) * 16777619u;
+    }
+    
+    /* Long keys are usually unique (e.g. MAC addresses used as keys) */
+    if (len > KEY_CACHE_MAX_LEN) {
+        return PyUnicode_FromString(name);
+    }
+    
+    struct key_cache_entry *slot = NULL;
+    for (int i = 0; i < KEY_CACHE_PROBES; i++) {
+        struct key_cache_entry *entry = &key_cache[(hash + i) % KEY_CACHE_SIZE];
+        
+        if (!entry->str) {
+            slot = entry;
+            break;
+        }
+        
+        if (entry->hash == hash && entry->len == len && !memcmp(entry->key, name, len)) {
+            Py_INCREF(entry->str);
+            return entry->str;
+        }
     }
     
-    enum json_type type = json_object_get_type(obj);
+    PyObject *str = PyUnicode_FromStringAndSize(name, len);
+    if (!str) return NULL;
+    PyUnicode_InternInPlace(&str);
     
-    switch (type) {
-        case json_type_boolean:
-            return PyBool_FromLong(json_object_get_boolean(obj));
+    /* With all probed slots taken, evict the first one; keys that keep
+     * showing up win their slot back */
+    if (!slot) {
+        slot = &key_cache[hash % KEY_CACHE_SIZE];
+        Py_DECREF(slot->str);
+    }
+    
+    slot->hash = hash;
+    slot->len = (uint32_t)len;
+    memcpy(slot->key, name, len + 1);
+    slot->str = str;
+    Py_INCREF(str);
+    return str;
+}
+
+/* Create a dict sized for n entries */
+static PyObject *dict_new_presized(Py_ssize_t n) {
+#if PY_VERSION_HEX < 0x030D0000
+    return _PyDict_NewPresized(n);
+#else
+    (void)n;
+    return PyDict_New();
+#endif
+}
+
+/* Convert the blobmsg attributes of a table payload to a Python dict */
+static PyObject *blob_table_to_python(void *data, size_t len) {
+    struct blob_attr *pos;
+    size_t rem = len;
+    Py_ssize_t count = 0;
+    
+    /* Count the entries first so the dict does not have to grow */
+    __blob_for_each_attr(pos, data, rem) {
+        count++;
+    }
+    
+    PyObject *dict = dict_new_presized(count);
+    if (!dict) return NULL;
+    
+    rem = len;
+    __blob_for_each_attr(pos, data, rem) {
+        if (!blobmsg_check_attr(pos, true)) {
+            continue;
+        }
+        
+        PyObject *py_key = blob_key_to_python(blobmsg_name(pos));
+        PyObject *py_val = blob_to_python(pos);
+        
+        if (!py_key || !py_val || PyDict_SetItem(dict, py_key, py_val) < 0) {
+            Py_XDECREF(py_key);
+            Py_XDECREF(py_val);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        
+        Py_DECREF(py_key);
+        Py_DECREF(py_val);
+    }
+    return dict;
+}
+
+/* Convert the blobmsg attributes of an array payload to a Python list */
+static PyObject *blob_array_to_python(void *data, size_t len) {
+    struct blob_attr *pos;
+    size_t rem = len;
+    Py_ssize_t count = 0;
+    
+    /* Count the elements first so the list can be allocated in one go;
+     * elements with a malformed header are skipped like table entries */
+    __blob_for_each_attr(pos, data, rem) {
+        if (blobmsg_check_attr(pos, false)) {
+            count++;
+        }
+    }
+    
+    PyObject *list = PyList_New(count);
+    if (!list) return NULL;
+    
+    Py_ssize_t i = 0;
+    rem = len;
+    __blob_for_each_attr(pos, data, rem) {
+        if (!blobmsg_check_attr(pos, false)) {
+            continue;
+        }
+        
+        PyObject *py_item = blob_to_python(pos);
+        if (!py_item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i++, py_item);
+    }
+    return list;
+}
+
+/* Convert a single blobmsg attribute to a Python object */
+static PyObject *blob_to_python(struct blob_attr *attr) {
+    void *data = blobmsg_data(attr);
+    size_t len = blobmsg_data_len(attr);
+    
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_TABLE:
+            return blob_table_to_python(data, len);
             
-        case json_type_int:
-            return PyLong_FromLongLong(json_object_get_int64(obj));
+        case BLOBMSG_TYPE_ARRAY:
+            return blob_array_to_python(data, len);
             
-        case json_type_double:
-            return PyFloat_FromDouble(json_object_get_double(obj));
+        case BLOBMSG_TYPE_STRING:
+            /* The payload includes the terminating NUL */
+            return PyUnicode_DecodeUTF8(data, len ? strnlen(data, len) : 0, "replace");
             
-        case json_type_string:
-            return PyUnicode_FromString(json_object_get_string(obj));
+        case BLOBMSG_TYPE_INT8:
+            /* blobmsg has no separate boolean type, INT8 is used for both */
+            if (len < sizeof(uint8_t)) break;
+            return PyBool_FromLong(blobmsg_get_u8(attr));
             
-        case json_type_array: {
-            int len = json_object_array_length(obj);
-            PyObject *list = PyList_New(len);
-            if (!list) return NULL;
+        case BLOBMSG_TYPE_INT16:
+            if (len < sizeof(uint16_t)) break;
+            return PyLong_FromLong((int16_t)blobmsg_get_u16(attr));
             
-            for (int i = 0; i < len; i++) {
-                json_object *item = json_object_array_get_idx(obj, i);
-                PyObject *py_item = json_to_python(item);
-                if (!py_item) {
-                    Py_DECREF(list);
-                    return NULL;
-                }
-                PyList_SetItem(list, i, py_item);
-            }
-            return list;
+        case BLOBMSG_TYPE_INT32:
+            if (len < sizeof(uint32_t)) break;
+            return PyLong_FromLong((int32_t)blobmsg_get_u32(attr));
+            
+        case BLOBMSG_TYPE_INT64:
+            if (len < sizeof(uint64_t)) break;
+            return PyLong_FromLongLong((int64_t)blobmsg_get_u64(attr));
+            
+        case BLOBMSG_TYPE_DOUBLE:
+            if (len < sizeof(double)) break;
+            return PyFloat_FromDouble(blobmsg_get_double(attr));
+            
+        default:
+            break;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* Bytes PyLong_FromLongLong() allocates for value, small ints are shared */
+static size_t long_alloc(int64_t value) {
+    if (value >= -5 && value <= 256) {
+        return 0;
+    }
+    return PyLong_Type.tp_basicsize + 2 * PyLong_Type.tp_itemsize;
+}
+
+/* Walk a table or array payload like blob_to_python() would, without
+ * allocating anything. Returns the nesting depth below it (the payload itself
+ * being at depth) and adds an estimate of the bytes the decoder would
+ * allocate to *alloc. Stops descending once max_depth is exceeded, 0 for no
+ * limit. Does not touch Python objects, so it runs without the GIL. */
+static int blob_scan(void *data, size_t len, int table, int depth, int max_depth, size_t *alloc) {
+    struct blob_attr *pos;
+    size_t rem = len, count = 0;
+    int deepest = depth;
+    
+    if (max_depth && depth > max_depth) {
+        return depth;
+    }
+    
+    __blob_for_each_attr(pos, data, rem) {
+        if (!blobmsg_check_attr(pos, table)) {
+            continue;
         }
+        count++;
         
-        case json_type_object: {
-            PyObject *dict = PyDict_New();
-            if (!dict) return NULL;
-            
-            json_object_object_foreach(obj, key, val) {
-                PyObject *py_key = PyUnicode_FromString(key);
-                PyObject *py_val = json_to_python(val);
-                
-                if (!py_key || !py_val) {
-                    Py_XDECREF(py_key);
-                    Py_XDECREF(py_val);
-                    Py_DECREF(dict);
-                    return NULL;
+        if (table && strlen(blobmsg_name(pos)) > KEY_CACHE_MAX_LEN) {
+            *alloc += sizeof(PyASCIIObject) + strlen(blobmsg_name(pos)) + 1;
+        }
+        
+        void *child = blobmsg_data(pos);
+        size_t child_len = blobmsg_data_len(pos);
+        
+        switch (blobmsg_type(pos)) {
+            case BLOBMSG_TYPE_TABLE:
+            case BLOBMSG_TYPE_ARRAY: {
+                int d = blob_scan(child, child_len, blobmsg_type(pos) == BLOBMSG_TYPE_TABLE,
+                                  depth + 1, max_depth, alloc);
+                if (d > deepest) {
+                    deepest = d;
                 }
-                
-                PyDict_SetItem(dict, py_key, py_val);
-                Py_DECREF(py_key);
-                Py_DECREF(py_val);
+                if (max_depth && deepest > max_depth) {
+                    return deepest;
+                }
+                break;
             }
-            return dict;
+                
+            case BLOBMSG_TYPE_STRING:
+                *alloc += sizeof(PyASCIIObject) + (child_len ? strnlen(child, child_len) : 0) + 1;
+                break;
+                
+            case BLOBMSG_TYPE_INT16:
+                if (child_len < sizeof(uint16_t)) break;
+                *alloc += long_alloc((int16_t)blobmsg_get_u16(pos));
+                break;
+                
+            case BLOBMSG_TYPE_INT32:
+                if (child_len < sizeof(uint32_t)) break;
+                *alloc += long_alloc((int32_t)blobmsg_get_u32(pos));
+                break;
+                
+            case BLOBMSG_TYPE_INT64:
+                if (child_len < sizeof(uint64_t)) break;
+                *alloc += long_alloc((int64_t)blobmsg_get_u64(pos));
+                break;
+                
+            case BLOBMSG_TYPE_DOUBLE:
+                *alloc += PyFloat_Type.tp_basicsize;
+                break;
+                
+            default:
+                /* Booleans and None are shared */
+                break;
         }
-        
+    }
+    
+    /* The container with its GC header, a list holds one pointer per item,
+     * a dict about three per entry at two thirds load */
+    *alloc += 2 * sizeof(void *) + (table ? PyDict_Type.tp_basicsize + count * 9 * sizeof(void *) / 2 :
+                                           PyList_Type.tp_basicsize + count * sizeof(void *));
+    return deepest;
+}
+
+
+/* Read-only view of a blobmsg table or array that decodes children on access */
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;            /* root view holding buf, NULL for the root */
+    struct blob_attr *buf;      /* copy of the reply, root only */
+    void *data;
+    size_t len;
+    Py_ssize_t count;           /* number of children, -1 until counted */
+} BlobViewObject;
+
+static PyTypeObject BlobViewType;
+static PyTypeObject BlobListViewType;
+
+#define blob_view_for_each(self, pos, rem) \
+    __blob_for_each_attr(pos, (self)->data, rem) \
+        if (blobmsg_check_attr(pos, Py_TYPE(self) == &BlobViewType))
+
+/* Create a view of the given payload, sharing the buffer of owner */
+static PyObject *blob_view_new(PyTypeObject *type, PyObject *owner, void *data, size_t len) {
+    BlobViewObject *view = PyObject_New(BlobViewObject, type);
+    if (!view) return NULL;
+    
+    view->owner = owner;
+    Py_XINCREF(owner);
+    view->buf = NULL;
+    view->data = data;
+    view->len = len;
+    view->count = -1;
+    return (PyObject *)view;
+}
+
+/* Create a root view over a copy of a reply message */
+static PyObject *blob_view_from_msg(struct blob_attr *msg) {
+    struct blob_attr *buf = blob_memdup(msg);
+    if (!buf) {
+        return PyErr_NoMemory();
+    }
+    
+    BlobViewObject *view = (BlobViewObject *)blob_view_new(&BlobViewType, NULL, blob_data(buf), blob_len(buf));
+    if (!view) {
+        free(buf);
+        return NULL;
+    }
+    
+    view->buf = buf;
+    return (PyObject *)view;
+}
+
+/* Nested containers become views, everything else is decoded */
+static PyObject *blob_view_child(BlobViewObject *self, struct blob_attr *attr) {
+    PyObject *root = self->owner ? self->owner : (PyObject *)self;
+    
+    switch (blobmsg_type(attr)) {
+        case BLOBMSG_TYPE_TABLE:
+            return blob_view_new(&BlobViewType, root, blobmsg_data(attr), blobmsg_data_len(attr));
+            
+        case BLOBMSG_TYPE_ARRAY:
+            return blob_view_new(&BlobListViewType, root, blobmsg_data(attr), blobmsg_data_len(attr));
+            
         default:
-            Py_RETURN_NONE;
+            return blob_to_python(attr);
+    }
+}
+
+/* Find a table entry by name */
+static struct blob_attr *blob_view_find(BlobViewObject *self, PyObject *key) {
+    struct blob_attr *pos;
+    size_t rem = self->len;
+    
+    if (!PyUnicode_Check(key)) {
+        return NULL;
+    }
+    
+    Py_ssize_t key_len;
+    const char *name = PyUnicode_AsUTF8AndSize(key, &key_len);
+    if (!name) {
+        PyErr_Clear();
+        return NULL;
+    }
+    
+    blob_view_for_each(self, pos, rem) {
+        const char *pos_name = blobmsg_name(pos);
+        if (!strncmp(pos_name, name, key_len) && pos_name[key_len] == '\0') {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* BlobView.__len__ */
+static Py_ssize_t BlobView_length(BlobViewObject *self) {
+    if (self->count < 0) {
+        struct blob_attr *pos;
+        size_t rem = self->len;
+        
+        self->count = 0;
+        blob_view_for_each(self, pos, rem) {
+            self->count++;
+        }
+    }
+    return self->count;
+}
+
+/* BlobView.__getitem__ */
+static PyObject *BlobView_subscript(BlobViewObject *self, PyObject *key) {
+    struct blob_attr *attr = blob_view_find(self, key);
+    
+    if (!attr) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+    return blob_view_child(self, attr);
+}
+
+/* BlobView.__contains__ */
+static int BlobView_contains(BlobViewObject *self, PyObject *key) {
+    return blob_view_find(self, key) != NULL;
+}
+
+/* Collect the keys, values or (key, value) pairs of a table view */
+static PyObject *blob_view_collect(BlobViewObject *self, int keys, int values) {
+    struct blob_attr *pos;
+    size_t rem = self->len;
+    Py_ssize_t i = 0;
+    
+    PyObject *list = PyList_New(BlobView_length(self));
+    if (!list) return NULL;
+    
+    blob_view_for_each(self, pos, rem) {
+        PyObject *key = keys ? blob_key_to_python(blobmsg_name(pos)) : NULL;
+        PyObject *value = values ? blob_view_child(self, pos) : NULL;
+        PyObject *item;
+        
+        if ((keys && !key) || (values && !value)) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(list);
+            return NULL;
+        }
+        
+        if (keys && values) {
+            item = PyTuple_Pack(2, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (!item) {
+                Py_DECREF(list);
+                return NULL;
+            }
+        }
+        else {
+            item = keys ? key : value;
+        }
+        PyList_SET_ITEM(list, i++, item);
+    }
+    return list;
+}
+
+/* BlobView.__iter__ */
+static PyObject *BlobView_iter(BlobViewObject *self) {
+    PyObject *keys = blob_view_collect(self, 1, 0);
+    if (!keys) return NULL;
+    
+    PyObject *iter = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return iter;
+}
+
+/* BlobView.keys() */
+static PyObject *BlobView_keys(BlobViewObject *self, PyObject *args) {
+    (void)args;
+    return blob_view_collect(self, 1, 0);
+}
+
+/* BlobView.values() */
+static PyObject *BlobView_values(BlobViewObject *self, PyObject *args) {
+    (void)args;
+    return blob_view_collect(self, 0, 1);
+}
+
+/* BlobView.items() */
+static PyObject *BlobView_items(BlobViewObject *self, PyObject *args) {
+    (void)args;
+    return blob_view_collect(self, 1, 1);
+}
+
+/* BlobView.get() */
+static PyObject *BlobView_get(BlobViewObject *self, PyObject *args) {
+    PyObject *key, *default_value = Py_None;
+    
+    if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+        return NULL;
+    }
+    
+    struct blob_attr *attr = blob_view_find(self, key);
+    if (!attr) {
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return blob_view_child(self, attr);
+}
+
+/* BlobView.to_python() / BlobListView.to_python() */
+static PyObject *BlobView_to_python(BlobViewObject *self, PyObject *args) {
+    (void)args;
+    
+    if (Py_TYPE(self) == &BlobViewType) {
+        return blob_table_to_python(self->data, self->len);
+    }
+    return blob_array_to_python(self->data, self->len);
+}
+
+/* Views compare equal to their materialised value */
+static PyObject *BlobView_richcompare(BlobViewObject *self, PyObject *other, int op) {
+    if (op != Py_EQ && op != Py_NE) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    
+    PyObject *value = BlobView_to_python(self, NULL);
+    if (!value) return NULL;
+    
+    PyObject *other_value;
+    if (Py_TYPE(other) == &BlobViewType || Py_TYPE(other) == &BlobListViewType) {
+        other_value = BlobView_to_python((BlobViewObject *)other, NULL);
+        if (!other_value) {
+            Py_DECREF(value);
+            return NULL;
+        }
+    }
+    else {
+        other_value = other;
+        Py_INCREF(other_value);
+    }
+    
+    PyObject *result = PyObject_RichCompare(value, other_value, op);
+    Py_DECREF(value);
+    Py_DECREF(other_value);
+    return result;
+}
+
+/* BlobView.__repr__ */
+static PyObject *BlobView_repr(BlobViewObject *self) {
+    PyObject *value = BlobView_to_python(self, NULL);
+    if (!value) return NULL;
+    
+    PyObject *repr = PyUnicode_FromFormat("%s(%R)",
+                                          Py_TYPE(self) == &BlobViewType ? "BlobView" : "BlobListView", value);
+    Py_DECREF(value);
+    return repr;
+}
+
+/* BlobListView.__getitem__ */
+static PyObject *BlobListView_item(BlobViewObject *self, Py_ssize_t index) {
+    struct blob_attr *pos;
+    size_t rem = self->len;
+    
+    if (index >= 0) {
+        blob_view_for_each(self, pos, rem) {
+            if (index-- == 0) {
+                return blob_view_child(self, pos);
+            }
+        }
+    }
+    
+    PyErr_SetString(PyExc_IndexError, "BlobListView index out of range");
+    return NULL;
+}
+
+/* BlobListView.__iter__ */
+static PyObject *BlobListView_iter(BlobViewObject *self) {
+    struct blob_attr *pos;
+    size_t rem = self->len;
+    Py_ssize_t i = 0;
+    
+    /* Walking the array once beats an O(n) lookup per index */
+    PyObject *items = PyList_New(BlobView_length(self));
+    if (!items) return NULL;
+    
+    blob_view_for_each(self, pos, rem) {
+        PyObject *item = blob_view_child(self, pos);
+        if (!item) {
+            Py_DECREF(items);
+            return NULL;
+        }
+        PyList_SET_ITEM(items, i++, item);
+    }
+    
+    PyObject *iter = PyObject_GetIter(items);
+    Py_DECREF(items);
+    return iter;
+}
+
+/* BlobView.__dealloc__ */
+static void BlobView_dealloc(BlobViewObject *self) {
+    Py_XDECREF(self->owner);
+    free(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* BlobView methods table */
+static PyMethodDef BlobView_methods[] = {
+    {"keys", (PyCFunction)BlobView_keys, METH_NOARGS, "List of keys"},
+    {"values", (PyCFunction)BlobView_values, METH_NOARGS, "List of values"},
+    {"items", (PyCFunction)BlobView_items, METH_NOARGS, "List of (key, value) pairs"},
+    {"get", (PyCFunction)BlobView_get, METH_VARARGS, "Value for key, or default"},
+    {"to_python", (PyCFunction)BlobView_to_python, METH_NOARGS, "Decode the whole table into a dict"},
+    {NULL}  /* Sentinel */
+};
+
+/* BlobListView methods table */
+static PyMethodDef BlobListView_methods[] = {
+    {"to_python", (PyCFunction)BlobView_to_python, METH_NOARGS, "Decode the whole array into a list"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMappingMethods BlobView_as_mapping = {
+    .mp_length = (lenfunc)BlobView_length,
+    .mp_subscript = (binaryfunc)BlobView_subscript,
+};
+
+static PySequenceMethods BlobView_as_sequence = {
+    .sq_contains = (objobjproc)BlobView_contains,
+};
+
+static PySequenceMethods BlobListView_as_sequence = {
+    .sq_length = (lenfunc)BlobView_length,
+    .sq_item = (ssizeargfunc)BlobListView_item,
+};
+
+/* BlobView type definition */
+static PyTypeObject BlobViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.BlobView",
+    .tp_doc = "Read-only mapping over a blobmsg table, decoded on access",
+    .tp_basicsize = sizeof(BlobViewObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)BlobView_dealloc,
+    .tp_repr = (reprfunc)BlobView_repr,
+    .tp_as_mapping = &BlobView_as_mapping,
+    .tp_as_sequence = &BlobView_as_sequence,
+    .tp_richcompare = (richcmpfunc)BlobView_richcompare,
+    .tp_iter = (getiterfunc)BlobView_iter,
+    .tp_methods = BlobView_methods,
+};
+
+/* BlobListView type definition */
+static PyTypeObject BlobListViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.BlobListView",
+    .tp_doc = "Read-only sequence over a blobmsg array, decoded on access",
+    .tp_basicsize = sizeof(BlobViewObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)BlobView_dealloc,
+    .tp_repr = (reprfunc)BlobView_repr,
+    .tp_as_sequence = &BlobListView_as_sequence,
+    .tp_richcompare = (richcmpfunc)BlobView_richcompare,
+    .tp_iter = (getiterfunc)BlobListView_iter,
+    .tp_methods = BlobListView_methods,
+};
+
+/* Field layout of the records a prepared handle decodes replies into */
+struct record_layout {
+    PyObject *fields;           /* Tuple of interned field names */
+    Py_ssize_t count;
+    const char *names[];        /* UTF-8 of the names, owned by fields */
+};
+
+/* Reply decoded into a fixed set of fields, lighter than a dict */
+typedef struct {
+    PyObject_VAR_HEAD
+    PyObject *fields;           /* Tuple of the field names, shared by the records of a handle */
+    PyObject *items[1];
+} RecordObject;
+
+static PyTypeObject RecordType;
+
+/* Build a record layout from a sequence of field names */
+static struct record_layout *record_layout_new(PyObject *names) {
+    PyObject *seq = PySequence_Fast(names, "record must be a sequence of field names");
+    if (!seq) return NULL;
+    
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    if (count == 0) {
+        PyErr_SetString(PyExc_ValueError, "record needs at least one field");
+        Py_DECREF(seq);
+        return NULL;
+    }
+    
+    struct record_layout *layout = calloc(1, sizeof(*layout) + count * sizeof(const char *));
+    PyObject *fields = PyTuple_New(count);
+    if (!layout || !fields) {
+        free(layout);
+        Py_XDECREF(fields);
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *name = PySequence_Fast_GET_ITEM(seq, i);
+        const char *utf8 = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+        
+        if (!utf8) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError, "record field names must be str");
+            }
+            goto fail;
+        }
+        
+        for (Py_ssize_t j = 0; j < i; j++) {
+            if (!strcmp(layout->names[j], utf8)) {
+                PyErr_Format(PyExc_ValueError, "duplicate record field '%s'", utf8);
+                goto fail;
+            }
+        }
+        
+        Py_INCREF(name);
+        PyUnicode_InternInPlace(&name);
+        PyTuple_SET_ITEM(fields, i, name);
+        layout->names[i] = PyUnicode_AsUTF8(name);
+    }
+    
+    Py_DECREF(seq);
+    layout->fields = fields;
+    layout->count = count;
+    return layout;
+    
+fail:
+    Py_DECREF(fields);
+    Py_DECREF(seq);
+    free(layout);
+    return NULL;
+}
+
+/* Free a record layout */
+static void record_layout_free(struct record_layout *layout) {
+    if (layout) {
+        Py_DECREF(layout->fields);
+        free(layout);
+    }
+}
+
+/* Decode the fields of a layout out of a reply table into a record: other
+ * entries are skipped without being decoded, missing fields are None */
+static PyObject *blob_table_to_record(const struct record_layout *layout, void *data, size_t len) {
+    struct blob_attr *pos;
+    size_t rem = len;
+    Py_ssize_t found = 0, next = 0;
+    
+    RecordObject *rec = PyObject_GC_NewVar(RecordObject, &RecordType, layout->count);
+    if (!rec) return NULL;
+    
+    rec->fields = layout->fields;
+    Py_INCREF(rec->fields);
+    memset(rec->items, 0, layout->count * sizeof(PyObject *));
+    
+    __blob_for_each_attr(pos, data, rem) {
+        if (found == layout->count) {
+            break;
+        }
+        if (!blobmsg_check_attr(pos, true)) {
+            continue;
+        }
+        
+        /* Replies list their fields in the same order every time, so the
+         * field after the last match is tried first */
+        const char *name = blobmsg_name(pos);
+        Py_ssize_t i = next;
+        for (Py_ssize_t k = 0; k < layout->count; k++, i = (i + 1) % layout->count) {
+            if (!rec->items[i] && !strcmp(layout->names[i], name)) {
+                break;
+            }
+        }
+        if (rec->items[i] || strcmp(layout->names[i], name)) {
+            continue;
+        }
+        
+        if (!(rec->items[i] = blob_to_python(pos))) {
+            Py_DECREF(rec);
+            return NULL;
+        }
+        found++;
+        next = (i + 1) % layout->count;
+    }
+    
+    for (Py_ssize_t i = 0; i < layout->count; i++) {
+        if (!rec->items[i]) {
+            Py_INCREF(Py_None);
+            rec->items[i] = Py_None;
+        }
+    }
+    
+    PyObject_GC_Track(rec);
+    return (PyObject *)rec;
+}
+
+/* Record.__len__ */
+static Py_ssize_t Record_length(RecordObject *self) {
+    return Py_SIZE(self);
+}
+
+/* Record.__getitem__ */
+static PyObject *Record_item(RecordObject *self, Py_ssize_t index) {
+    if (index < 0 || index >= Py_SIZE(self)) {
+        PyErr_SetString(PyExc_IndexError, "Record index out of range");
+        return NULL;
+    }
+    Py_INCREF(self->items[index]);
+    return self->items[index];
+}
+
+/* Record.__getattr__, fields first */
+static PyObject *Record_getattro(RecordObject *self, PyObject *name) {
+    Py_ssize_t count = Py_SIZE(self);
+    
+    /* Attribute names are interned like the fields, so identity mostly hits */
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (PyTuple_GET_ITEM(self->fields, i) == name) {
+            return Record_item(self, i);
+        }
+    }
+    
+    if (PyUnicode_Check(name)) {
+        for (Py_ssize_t i = 0; i < count; i++) {
+            if (PyUnicode_Compare(PyTuple_GET_ITEM(self->fields, i), name) == 0) {
+                return Record_item(self, i);
+            }
+        }
+    }
+    return PyObject_GenericGetAttr((PyObject *)self, name);
+}
+
+/* Record._asdict() */
+static PyObject *Record_asdict(RecordObject *self, PyObject *unused) {
+    (void)unused;
+    
+    PyObject *dict = dict_new_presized(Py_SIZE(self));
+    if (!dict) return NULL;
+    
+    for (Py_ssize_t i = 0; i < Py_SIZE(self); i++) {
+        if (PyDict_SetItem(dict, PyTuple_GET_ITEM(self->fields, i), self->items[i]) < 0) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+    return dict;
+}
+
+/* Record._fields getter */
+static PyObject *Record_get_fields(RecordObject *self, void *closure) {
+    (void)closure;
+    Py_INCREF(self->fields);
+    return self->fields;
+}
+
+/* Record.__eq__ and __ne__, against records with the same fields */
+static PyObject *Record_richcompare(RecordObject *self, PyObject *other, int op) {
+    if (Py_TYPE(other) != &RecordType || (op != Py_EQ && op != Py_NE)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    
+    RecordObject *rec = (RecordObject *)other;
+    int equal = PyObject_RichCompareBool(self->fields, rec->fields, Py_EQ);
+    
+    for (Py_ssize_t i = 0; equal > 0 && i < Py_SIZE(self); i++) {
+        equal = PyObject_RichCompareBool(self->items[i], rec->items[i], Py_EQ);
+    }
+    if (equal < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+}
+
+/* Record.__repr__ */
+static PyObject *Record_repr(RecordObject *self) {
+    if (Py_ReprEnter((PyObject *)self) != 0) {
+        return PyUnicode_FromString("Record(...)");
+    }
+    
+    PyObject *parts = PyList_New(Py_SIZE(self));
+    PyObject *repr = NULL;
+    
+    for (Py_ssize_t i = 0; parts && i < Py_SIZE(self); i++) {
+        PyObject *part = PyUnicode_FromFormat("%U=%R", PyTuple_GET_ITEM(self->fields, i), self->items[i]);
+        if (!part) {
+            Py_CLEAR(parts);
+            break;
+        }
+        PyList_SET_ITEM(parts, i, part);
+    }
+    
+    if (parts) {
+        PyObject *sep = PyUnicode_FromString(", ");
+        PyObject *joined = sep ? PyUnicode_Join(sep, parts) : NULL;
+        repr = joined ? PyUnicode_FromFormat("Record(%U)", joined) : NULL;
+        Py_XDECREF(joined);
+        Py_XDECREF(sep);
+        Py_DECREF(parts);
+    }
+    
+    Py_ReprLeave((PyObject *)self);
+    return repr;
+}
+
+/* Record GC traversal */
+static int Record_traverse(RecordObject *self, visitproc visit, void *arg) {
+    for (Py_ssize_t i = 0; i < Py_SIZE(self); i++) {
+        Py_VISIT(self->items[i]);
+    }
+    return 0;
+}
+
+/* Record GC clear */
+static int Record_clear(RecordObject *self) {
+    for (Py_ssize_t i = 0; i < Py_SIZE(self); i++) {
+        Py_CLEAR(self->items[i]);
+    }
+    return 0;
+}
+
+/* Record.__dealloc__ */
+static void Record_dealloc(RecordObject *self) {
+    PyObject_GC_UnTrack(self);
+    Record_clear(self);
+    Py_XDECREF(self->fields);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Record methods table */
+static PyMethodDef Record_methods[] = {
+    {"_asdict", (PyCFunction)Record_asdict, METH_NOARGS, "Fields and values as a dict"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Record_getset[] = {
+    {"_fields", (getter)Record_get_fields, NULL, "Tuple of the field names", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods Record_as_sequence = {
+    .sq_length = (lenfunc)Record_length,
+    .sq_item = (ssizeargfunc)Record_item,
+};
+
+/* Record type definition */
+static PyTypeObject RecordType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.Record",
+    .tp_doc = "Reply of a prepared call decoded into fixed fields, by attribute or position",
+    .tp_basicsize = offsetof(RecordObject, items),
+    .tp_itemsize = sizeof(PyObject *),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_dealloc = (destructor)Record_dealloc,
+    .tp_repr = (reprfunc)Record_repr,
+    .tp_as_sequence = &Record_as_sequence,
+    .tp_hash = PyObject_HashNotImplemented,
+    .tp_getattro = (getattrofunc)Record_getattro,
+    .tp_traverse = (traverseproc)Record_traverse,
+    .tp_clear = (inquiry)Record_clear,
+    .tp_richcompare = (richcmpfunc)Record_richcompare,
+    .tp_methods = Record_methods,
+    .tp_getset = Record_getset,
+};
+
+/* Look up the blobmsg type a method signature declares for a parameter */
+static int signature_param_type(struct blob_attr *signature, const char *name) {
+    struct blob_attr *pos;
+    size_t rem;
+    
+    if (!signature || !name) {
+        return BLOBMSG_TYPE_UNSPEC;
+    }
+    
+    blobmsg_for_each_attr(pos, signature, rem) {
+        if (blobmsg_type(pos) == BLOBMSG_TYPE_INT32 && !strcmp(blobmsg_name(pos), name)) {
+            return blobmsg_get_u32(pos);
+        }
+    }
+    return BLOBMSG_TYPE_UNSPEC;
+}
+
+/* Add a Python int to the buffer using the integer type the callee expects */
+static int python_int_to_blob(struct blob_buf *b, const char *name, PyObject *obj, int type) {
+    int overflow;
+    long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    
+    if (value == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    
+    /* Callees parse with blobmsg_parse, which only matches the exact type
+     * from their policy, so honour the declared width when there is one.
+     * Otherwise use the same INT32/INT64 split as blobmsg_add_json_from_string. */
+    if (type == BLOBMSG_TYPE_UNSPEC || type == BLOBMSG_TYPE_STRING) {
+        type = (!overflow && value >= INT32_MIN && value <= INT32_MAX) ?
+            BLOBMSG_TYPE_INT32 : BLOBMSG_TYPE_INT64;
+    }
+    
+    if (overflow) {
+        /* Only unsigned 64-bit values above INT64_MAX can still be represented */
+        unsigned long long uvalue = PyLong_AsUnsignedLongLong(obj);
+        if (type == BLOBMSG_TYPE_DOUBLE) {
+            PyErr_Clear();
+            return blobmsg_add_double(b, name, PyLong_AsDouble(obj));
+        }
+        if (type != BLOBMSG_TYPE_INT64 || (uvalue == (unsigned long long)-1 && PyErr_Occurred())) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_OverflowError, "value out of range for parameter '%s'", name ? name : "");
+            return -1;
+        }
+        return blobmsg_add_u64(b, name, uvalue);
+    }
+    
+    switch (type) {
+        case BLOBMSG_TYPE_INT8:
+            if (value < INT8_MIN || value > UINT8_MAX) break;
+            return blobmsg_add_u8(b, name, (uint8_t)value);
+            
+        case BLOBMSG_TYPE_INT16:
+            if (value < INT16_MIN || value > UINT16_MAX) break;
+            return blobmsg_add_u16(b, name, (uint16_t)value);
+            
+        case BLOBMSG_TYPE_INT32:
+            if (value < INT32_MIN || value > UINT32_MAX) break;
+            return blobmsg_add_u32(b, name, (uint32_t)value);
+            
+        case BLOBMSG_TYPE_DOUBLE:
+            return blobmsg_add_double(b, name, (double)value);
+            
+        default:
+            return blobmsg_add_u64(b, name, (uint64_t)value);
+    }
+    
+    PyErr_Format(PyExc_OverflowError, "value out of range for parameter '%s'", name ? name : "");
+    return -1;
+}
+
+static int python_to_blob(struct blob_buf *b, const char *name, PyObject *obj, int type);
+
+/* Add the items of a Python dict to the buffer as table entries */
+static int python_dict_to_blob(struct blob_buf *b, PyObject *dict, struct blob_attr *signature) {
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "ubus parameter names must be strings");
+            return -1;
+        }
+        
+        const char *key_str = PyUnicode_AsUTF8(key);
+        if (!key_str) {
+            return -1;
+        }
+        
+        if (python_to_blob(b, key_str, value, signature_param_type(signature, key_str)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Add a Python object to the buffer as a blobmsg attribute */
+static int python_to_blob(struct blob_buf *b, const char *name, PyObject *obj, int type) {
+    int ret;
+    
+    if (obj == Py_None) {
+        ret = blobmsg_add_field(b, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+    }
+    else if (PyBool_Check(obj)) {
+        ret = blobmsg_add_u8(b, name, obj == Py_True);
+    }
+    else if (PyLong_Check(obj)) {
+        if (python_int_to_blob(b, name, obj, type) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    else if (PyFloat_Check(obj)) {
+        ret = blobmsg_add_double(b, name, PyFloat_AS_DOUBLE(obj));
+    }
+    else if (PyUnicode_Check(obj)) {
+        Py_ssize_t len;
+        const char *str = PyUnicode_AsUTF8AndSize(obj, &len);
+        if (!str) {
+            return -1;
+        }
+        ret = blobmsg_add_field(b, BLOBMSG_TYPE_STRING, name, str, len + 1);
+    }
+    else if (PyDict_Check(obj) || PyList_Check(obj) || PyTuple_Check(obj)) {
+        int is_dict = PyDict_Check(obj);
+        void *cookie = is_dict ? blobmsg_open_table(b, name) : blobmsg_open_array(b, name);
+        if (!cookie) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        
+        if (Py_EnterRecursiveCall(" while encoding ubus parameters")) {
+            return -1;
+        }
+        
+        if (is_dict) {
+            ret = python_dict_to_blob(b, obj, NULL);
+        }
+        else {
+            ret = 0;
+            Py_ssize_t len = PySequence_Fast_GET_SIZE(obj);
+            PyObject **items = PySequence_Fast_ITEMS(obj);
+            for (Py_ssize_t i = 0; i < len && ret == 0; i++) {
+                ret = python_to_blob(b, NULL, items[i], BLOBMSG_TYPE_UNSPEC);
+            }
+        }
+        
+        Py_LeaveRecursiveCall();
+        if (ret < 0) {
+            return -1;
+        }
+        
+        if (is_dict) {
+            blobmsg_close_table(b, cookie);
+        }
+        else {
+            blobmsg_close_array(b, cookie);
+        }
+        return 0;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "cannot encode %.100s as a ubus parameter",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    
+    if (ret < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* Parameter of a method signature, compiled once by prepare(typed=True) */
+struct param_spec {
+    PyObject *name;             /* Interned, NULL terminates the table */
+    const char *utf8;
+    int type;                   /* BLOBMSG_TYPE_* */
+};
+
+/* Names of the blobmsg types for validation errors */
+static const char *const blobmsg_type_names[] = {
+    [BLOBMSG_TYPE_UNSPEC] = "unspec",
+    [BLOBMSG_TYPE_ARRAY] = "array",
+    [BLOBMSG_TYPE_TABLE] = "table",
+    [BLOBMSG_TYPE_STRING] = "string",
+    [BLOBMSG_TYPE_INT64] = "int64",
+    [BLOBMSG_TYPE_INT32] = "int32",
+    [BLOBMSG_TYPE_INT16] = "int16",
+    [BLOBMSG_TYPE_INT8] = "bool/int8",
+    [BLOBMSG_TYPE_DOUBLE] = "double",
+};
+
+/* Free a parameter spec table */
+static void param_specs_free(struct param_spec *specs) {
+    for (struct param_spec *spec = specs; spec && spec->name; spec++) {
+        Py_DECREF(spec->name);
+    }
+    free(specs);
+}
+
+/* Compile the signature of one method into a parameter spec table */
+static struct param_spec *param_specs_new(struct blob_attr *signature) {
+    struct blob_attr *pos;
+    size_t rem;
+    size_t count = 0;
+    
+    blobmsg_for_each_attr(pos, signature, rem) {
+        count++;
+    }
+    
+    struct param_spec *specs = calloc(count + 1, sizeof(*specs));
+    if (!specs) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    
+    struct param_spec *spec = specs;
+    blobmsg_for_each_attr(pos, signature, rem) {
+        if (blobmsg_type(pos) != BLOBMSG_TYPE_INT32) {
+            continue;
+        }
+        
+        spec->name = PyUnicode_InternFromString(blobmsg_name(pos));
+        if (!spec->name) {
+            param_specs_free(specs);
+            return NULL;
+        }
+        spec->utf8 = PyUnicode_AsUTF8(spec->name);
+        spec->type = (int)blobmsg_get_u32(pos);
+        spec++;
+    }
+    return specs;
+}
+
+/* Find the spec of a parameter, by identity first since dict keys written
+ * in the source are interned */
+static const struct param_spec *param_spec_find(const struct param_spec *specs, PyObject *name, const char *utf8) {
+    for (const struct param_spec *spec = specs; spec->name; spec++) {
+        if (spec->name == name) {
+            return spec;
+        }
+    }
+    for (const struct param_spec *spec = specs; spec->name; spec++) {
+        if (!strcmp(spec->utf8, utf8)) {
+            return spec;
+        }
+    }
+    return NULL;
+}
+
+/* Check a value against the type a signature declares for it */
+static int param_value_fits(PyObject *obj, int type) {
+    switch (type) {
+        case BLOBMSG_TYPE_STRING:
+            return PyUnicode_Check(obj);
+        case BLOBMSG_TYPE_INT8:
+        case BLOBMSG_TYPE_INT16:
+        case BLOBMSG_TYPE_INT32:
+        case BLOBMSG_TYPE_INT64:
+            return PyLong_Check(obj);
+        case BLOBMSG_TYPE_DOUBLE:
+            return PyFloat_Check(obj) || PyLong_Check(obj);
+        case BLOBMSG_TYPE_TABLE:
+            return PyDict_Check(obj);
+        case BLOBMSG_TYPE_ARRAY:
+            return PyList_Check(obj) || PyTuple_Check(obj);
+        default:
+            return 1;
+    }
+}
+
+/* Encode params against a compiled signature. With strict set, names it
+ * does not declare and values of another type are rejected instead of sent. */
+static int python_dict_to_blob_specs(struct blob_buf *b, PyObject *dict, const struct param_spec *specs,
+                                     const char *method, int strict) {
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "ubus parameter names must be strings");
+            return -1;
+        }
+        
+        const char *key_str = PyUnicode_AsUTF8(key);
+        if (!key_str) {
+            return -1;
+        }
+        
+        const struct param_spec *spec = param_spec_find(specs, key, key_str);
+        if (!spec && strict) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected parameter '%s'", method, key_str);
+            return -1;
+        }
+        
+        if (!spec) {
+            if (python_to_blob(b, key_str, value, BLOBMSG_TYPE_UNSPEC) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strict && !param_value_fits(value, spec->type)) {
+            PyErr_Format(PyExc_TypeError, "%s() parameter '%s' must be %s, not %.100s", method, key_str,
+                         spec->type >= 0 && spec->type <= BLOBMSG_TYPE_DOUBLE ?
+                         blobmsg_type_names[spec->type] : "unspec",
+                         Py_TYPE(value)->tp_name);
+            return -1;
+        }
+        
+        if (python_to_blob(b, key_str, value, spec->type) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Find the signature of one method in an object signature table */
+static struct blob_attr *signature_method(struct blob_attr *signature, const char *method) {
+    struct blob_attr *pos;
+    size_t rem;
+    
+    if (!signature) {
+        return NULL;
+    }
+    
+    blob_for_each_attr(pos, signature, rem) {
+        if (!strcmp(blobmsg_name(pos), method)) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* libubus encodes every outgoing message in one process-wide blob_buf, so
+ * sends of all contexts (a pool, several clients, their I/O threads) go
+ * through send_lock while waits for replies overlap. It is recursive for
+ * replies sent by handlers dispatched inside a lookup, and like the context
+ * lock it must never be waited for with the GIL held. */
+static pthread_mutex_t send_lock;
+static pthread_once_t send_lock_once = PTHREAD_ONCE_INIT;
+static unsigned long send_owner;    /* Thread holding send_lock, atomic */
+static int send_depth;
+
+static void send_lock_init(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&send_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void send_lock_acquire(void) {
+    pthread_mutex_lock(&send_lock);
+    if (send_depth++ == 0) {
+        __atomic_store_n(&send_owner, PyThread_get_thread_ident(), __ATOMIC_RELAXED);
+    }
+}
+
+static void send_lock_release(void) {
+    if (--send_depth == 0) {
+        __atomic_store_n(&send_owner, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&send_lock);
+}
+
+/* Let go of send_lock while a handler runs inside a lookup that holds it,
+ * the handler may wait for other contexts. A lookup no longer needs the
+ * buffer once its reply is being dispatched. Returns the depth to hand to
+ * send_lock_resume(). */
+static int send_lock_suspend(void) {
+    if (__atomic_load_n(&send_owner, __ATOMIC_RELAXED) != PyThread_get_thread_ident()) {
+        return 0;
+    }
+    
+    int depth = send_depth;
+    for (int i = 0; i < depth; i++) {
+        send_lock_release();
+    }
+    return depth;
+}
+
+static void send_lock_resume(int depth) {
+    for (int i = 0; i < depth; i++) {
+        send_lock_acquire();
+    }
+}
+
+/* ubus_invoke_async() through send_lock */
+static int bus_invoke_async(struct ubus_context *ctx, uint32_t obj, const char *method,
+                            struct blob_attr *msg, struct ubus_request *req) {
+    send_lock_acquire();
+    int ret = ubus_invoke_async(ctx, obj, method, msg, req);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_invoke() with only the send under send_lock, so calls of different
+ * contexts still wait for their replies at the same time */
+static int bus_invoke(struct ubus_context *ctx, uint32_t obj, const char *method, struct blob_attr *msg,
+                      ubus_data_handler_t cb, void *priv, int timeout) {
+    struct ubus_request req;
+    int ret = bus_invoke_async(ctx, obj, method, msg, &req);
+    if (ret != UBUS_STATUS_OK) {
+        return ret;
+    }
+    
+    req.data_cb = cb;
+    req.priv = priv;
+    return ubus_complete_request(ctx, &req, timeout);
+}
+
+/* ubus_lookup() through send_lock. libubus has no way to send a lookup
+ * without waiting for it, so the lock is held throughout. */
+static int bus_lookup(struct ubus_context *ctx, const char *path, ubus_lookup_handler_t cb, void *priv) {
+    send_lock_acquire();
+    int ret = ubus_lookup(ctx, path, cb, priv);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_send_reply() through send_lock */
+static int bus_send_reply(struct ubus_context *ctx, struct ubus_request_data *req, struct blob_attr *msg) {
+    send_lock_acquire();
+    int ret = ubus_send_reply(ctx, req, msg);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_complete_deferred_request() through send_lock */
+static void bus_complete_deferred(struct ubus_context *ctx, struct ubus_request_data *req, int status) {
+    send_lock_acquire();
+    ubus_complete_deferred_request(ctx, req, status);
+    send_lock_release();
+}
+
+/* ubus_add_object() through send_lock */
+static int bus_add_object(struct ubus_context *ctx, struct ubus_object *obj) {
+    send_lock_acquire();
+    int ret = ubus_add_object(ctx, obj);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_remove_object() through send_lock, which also unregisters event
+ * handlers and subscribers */
+static int bus_remove_object(struct ubus_context *ctx, struct ubus_object *obj) {
+    send_lock_acquire();
+    int ret = ubus_remove_object(ctx, obj);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_register_event_handler() through send_lock */
+static int bus_register_event_handler(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                                      const char *pattern) {
+    send_lock_acquire();
+    int ret = ubus_register_event_handler(ctx, ev, pattern);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_unregister_event_handler() through send_lock */
+static int bus_unregister_event_handler(struct ubus_context *ctx, struct ubus_event_handler *ev) {
+    return bus_remove_object(ctx, &ev->obj);
+}
+
+#if PYUBUS_WITH_EVENTS
+/* ubus_register_subscriber() through send_lock */
+static int bus_register_subscriber(struct ubus_context *ctx, struct ubus_subscriber *sub) {
+    send_lock_acquire();
+    int ret = ubus_register_subscriber(ctx, sub);
+    send_lock_release();
+    return ret;
+}
+
+/* ubus_unregister_subscriber() through send_lock */
+static int bus_unregister_subscriber(struct ubus_context *ctx, struct ubus_subscriber *sub) {
+    return bus_remove_object(ctx, &sub->obj);
+}
+#endif
+
+/* ubus_subscribe() through send_lock */
+static int bus_subscribe(struct ubus_context *ctx, struct ubus_subscriber *sub, uint32_t id) {
+    send_lock_acquire();
+    int ret = ubus_subscribe(ctx, sub, id);
+    send_lock_release();
+    return ret;
+}
+
+/* Object ID and signature collected by lookup_cb */
+struct lookup_result {
+    const char *path;
+    uint32_t id;
+    int found;
+    struct blob_attr *signature;
+};
+
+/* Lookup handler resolving a single object and its method signatures */
+static void lookup_cb(struct ubus_context *ctx, struct ubus_object_data *obj, void *priv) {
+    struct lookup_result *lookup = (struct lookup_result *)priv;
+    
+    (void)ctx;
+    
+    if (lookup->found || strcmp(obj->path, lookup->path) != 0) {
+        return;
+    }
+    
+    lookup->id = obj->id;
+    lookup->found = 1;
+    
+    /* The lookup reply buffer is reused, keep a private copy */
+    if (obj->signature) {
+        lookup->signature = blob_memdup(obj->signature);
+    }
+}
+
+/* FNV-1a hash of an object path */
+static uint32_t path_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Nanoseconds on the monotonic clock */
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Milliseconds on the monotonic clock */
+static int64_t monotonic_ms(void) {
+    return monotonic_ns() / 1000000;
+}
+
+/* Continue an FNV-1a hash over len bytes */
+static uint32_t bytes_hash(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Slot number index of the ID table, or with reply set of the reply table */
+static struct shm_slot *shm_slot(struct shm_segment *shm, int reply, uint32_t index) {
+    struct shm_header *header = shm->header;
+    char *table = shm->base + SHM_HEADER_SIZE;
+    
+    if (reply) {
+        return (struct shm_slot *)(table + (size_t)header->id_slots * header->id_slot_size +
+                                   (size_t)index * header->reply_slot_size);
+    }
+    return (struct shm_slot *)(table + (size_t)index * header->id_slot_size);
+}
+
+/* Room for data in a slot of the ID table or the reply table */
+static size_t shm_slot_room(struct shm_segment *shm, int reply) {
+    return (reply ? shm->header->reply_slot_size : shm->header->id_slot_size) - sizeof(struct shm_slot);
+}
+
+/* Take a slot for writing, returns -1 without waiting if another writer
+ * has it. A writer that died mid-update leaves its slot unused. */
+static int shm_write_begin(struct shm_slot *slot, uint32_t *seq) {
+    uint32_t old = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    
+    if ((old & 1) || !__atomic_compare_exchange_n(&slot->seq, &old, old + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    /* Readers must see the odd sequence before any of the new contents */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *seq = old;
+    return 0;
+}
+
+static void shm_write_end(struct shm_slot *slot, uint32_t seq) {
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Copy a slot out into copy, which has room for room bytes of data. Never
+ * waits on a writer: returns 0 if the slot stayed busy or is empty. */
+static int shm_read(struct shm_slot *slot, struct shm_slot *copy, size_t room) {
+    for (int i = 0; i < SHM_READ_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        
+        memcpy(copy, slot, sizeof(*copy));
+        if (copy->len > room) {
+            copy->len = 0;
+        }
+        memcpy(copy->data, slot->data, copy->len);
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return copy->len != 0;
+        }
+    }
+    return 0;
+}
+
+/* Offset of the first blob after a NUL terminated name, blobs are 4 byte aligned */
+static size_t shm_name_room(const char *name) {
+    return (strlen(name) + 1 + 3) & ~(size_t)3;
+}
+
+/* Blob at offset in a copied slot, NULL if it would not fit in len bytes */
+static struct blob_attr *shm_blob(struct shm_slot *copy, size_t offset) {
+    struct blob_attr *attr = (struct blob_attr *)(copy->data + offset);
+    
+    if (offset + sizeof(*attr) > copy->len || offset + blob_raw_len(attr) > copy->len ||
+        blob_raw_len(attr) < sizeof(*attr)) {
+        return NULL;
+    }
+    return attr;
+}
+
+/* Publish a resolved object, skipped if it does not fit in a slot */
+static void shm_id_publish(struct shm_segment *shm, const char *path, uint32_t hash,
+                           uint32_t id, struct blob_attr *signature) {
+    size_t offset = shm_name_room(path), len = offset + (signature ? blob_raw_len(signature) : 0);
+    struct shm_slot *slot = shm_slot(shm, 0, hash % shm->header->id_slots);
+    uint32_t seq;
+    
+    if (len > shm_slot_room(shm, 0) || shm_write_begin(slot, &seq)) {
+        return;
+    }
+    
+    memset(slot->data, 0, offset);
+    strcpy(slot->data, path);
+    if (signature) {
+        memcpy(slot->data + offset, signature, blob_raw_len(signature));
+    }
+    slot->hash = hash;
+    slot->id = id;
+    slot->len = len;
+    shm_write_end(slot, seq);
+}
+
+/* Look an object up in the shared table, signature is a private copy */
+static int shm_id_find(struct shm_segment *shm, const char *path, uint32_t hash,
+                       uint32_t *id, struct blob_attr **signature) {
+    uint64_t buf[SHM_ID_SLOT_SIZE / sizeof(uint64_t)];
+    struct shm_slot *copy = (struct shm_slot *)buf;
+    size_t offset = shm_name_room(path);
+    size_t room = shm_slot_room(shm, 0) < sizeof(buf) - sizeof(*copy) ?
+                  shm_slot_room(shm, 0) : sizeof(buf) - sizeof(*copy);
+    
+    if (!shm_read(shm_slot(shm, 0, hash % shm->header->id_slots), copy, room) ||
+        copy->hash != hash || offset > copy->len ||
+        strncmp(copy->data, path, offset) != 0) {
+        return 0;
+    }
+    
+    *signature = NULL;
+    if (copy->len > offset) {
+        struct blob_attr *attr = shm_blob(copy, offset);
+        if (!attr || !(*signature = blob_memdup(attr))) {
+            return 0;
+        }
+    }
+    *id = copy->id;
+    return 1;
+}
+
+/* Drop an object from the shared table, if present */
+static void shm_id_remove(struct shm_segment *shm, const char *path, uint32_t hash) {
+    struct shm_slot *slot = shm_slot(shm, 0, hash % shm->header->id_slots);
+    uint32_t seq;
+    
+    if (!__atomic_load_n(&slot->len, __ATOMIC_RELAXED) || shm_write_begin(slot, &seq)) {
+        return;
+    }
+    
+    if (slot->hash == hash && slot->len > strlen(path) && !strcmp(slot->data, path)) {
+        slot->len = 0;
+    }
+    shm_write_end(slot, seq);
+}
+
+/* Publish a reply cached until expires, skipped if it does not fit in a slot */
+static void shm_reply_publish(struct shm_segment *shm, uint32_t id, const char *method,
+                              struct blob_attr *params, struct blob_attr *reply,
+                              uint32_t hash, int64_t expires) {
+    size_t offset = shm_name_room(method), params_len = blob_pad_len(params);
+    size_t len = offset + params_len + (reply ? blob_raw_len(reply) : 0);
+    struct shm_slot *slot;
+    uint32_t seq;
+    
+    if (!shm->header->reply_slots || len > shm_slot_room(shm, 1)) {
+        return;
+    }
+    
+    slot = shm_slot(shm, 1, hash % shm->header->reply_slots);
+    if (shm_write_begin(slot, &seq)) {
+        return;
+    }
+    
+    memset(slot->data, 0, offset + params_len);
+    strcpy(slot->data, method);
+    memcpy(slot->data + offset, params, blob_raw_len(params));
+    if (reply) {
+        memcpy(slot->data + offset + params_len, reply, blob_raw_len(reply));
+    }
+    slot->hash = hash;
+    slot->id = id;
+    slot->expires = expires;
+    slot->len = len;
+    shm_write_end(slot, seq);
+}
+
+/* Look a reply up in the shared table. On a hit reply is a private copy, or
+ * NULL for an empty reply, and expires tells how long it stays valid. */
+static int shm_reply_find(struct shm_segment *shm, uint32_t id, const char *method,
+                          struct blob_attr *params, uint32_t hash, int64_t now,
+                          struct blob_attr **reply, int64_t *expires) {
+    uint64_t buf[SHM_REPLY_SLOT_SIZE / sizeof(uint64_t)];
+    struct shm_slot *copy = (struct shm_slot *)buf;
+    size_t offset = shm_name_room(method), params_len = blob_pad_len(params);
+    size_t room = shm_slot_room(shm, 1) < sizeof(buf) - sizeof(*copy) ?
+                  shm_slot_room(shm, 1) : sizeof(buf) - sizeof(*copy);
+    
+    if (!shm->header->reply_slots ||
+        !shm_read(shm_slot(shm, 1, hash % shm->header->reply_slots), copy, room) ||
+        copy->hash != hash || copy->id != id || copy->expires <= now ||
+        offset + params_len > copy->len || strncmp(copy->data, method, offset) != 0 ||
+        memcmp(copy->data + offset, params, blob_raw_len(params)) != 0) {
+        return 0;
+    }
+    
+    *reply = NULL;
+    if (copy->len > offset + params_len) {
+        struct blob_attr *attr = shm_blob(copy, offset + params_len);
+        if (!attr || !(*reply = blob_memdup(attr))) {
+            return 0;
+        }
+    }
+    *expires = copy->expires;
+    return 1;
+}
+
+/* Drop the shared replies of an object */
+static void shm_reply_remove_id(struct shm_segment *shm, uint32_t id) {
+    for (uint32_t i = 0; i < shm->header->reply_slots; i++) {
+        struct shm_slot *slot = shm_slot(shm, 1, i);
+        uint32_t seq;
+        
+        if (__atomic_load_n(&slot->id, __ATOMIC_RELAXED) != id ||
+            !__atomic_load_n(&slot->len, __ATOMIC_RELAXED) || shm_write_begin(slot, &seq)) {
+            continue;
+        }
+        if (slot->id == id) {
+            slot->len = 0;
+        }
+        shm_write_end(slot, seq);
+    }
+}
+
+/* Empty every slot, for when all object IDs changed (ubusd restarted) */
+static void shm_clear(struct shm_segment *shm) {
+    uint32_t slots = shm->header->id_slots + shm->header->reply_slots;
+    
+    for (uint32_t i = 0; i < slots; i++) {
+        struct shm_slot *slot = i < shm->header->id_slots ? shm_slot(shm, 0, i) :
+                                shm_slot(shm, 1, i - shm->header->id_slots);
+        uint32_t seq;
+        
+        if (__atomic_load_n(&slot->len, __ATOMIC_RELAXED) && !shm_write_begin(slot, &seq)) {
+            slot->len = 0;
+            shm_write_end(slot, seq);
+        }
+    }
+}
+
+/* Map the shared cache segment at path, creating it with size bytes if it
+ * does not exist. Returns NULL with errno set on failure. */
+static struct shm_segment *shm_attach(const char *path, size_t size) {
+    size_t path_len = strlen(path) + 1;
+    struct shm_segment *shm = calloc(1, sizeof(*shm) + path_len);
+    struct stat st;
+    int fd, err;
+    
+    if (!shm) {
+        return NULL;
+    }
+    memcpy(shm->path, path, path_len);
+    
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = errno;
+        free(shm);
+        errno = err;
+        return NULL;
+    }
+    
+    /* Serialize creation, the first process lays the segment out */
+    if (flock(fd, LOCK_EX) || fstat(fd, &st) ||
+        (!st.st_size && ftruncate(fd, (off_t)size))) {
+        goto fail;
+    }
+    shm->size = st.st_size ? (size_t)st.st_size : size;
+    
+    shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm->base == MAP_FAILED) {
+        shm->base = NULL;
+        goto fail;
+    }
+    shm->header = (struct shm_header *)shm->base;
+    
+    if (shm->size < SHM_HEADER_SIZE) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (!shm->header->magic) {
+        if (shm->size < SHM_HEADER_SIZE + SHM_ID_SLOTS * SHM_ID_SLOT_SIZE) {
+            errno = EINVAL;
+            goto fail;
+        }
+        shm->header->version = SHM_VERSION;
+        shm->header->id_slots = SHM_ID_SLOTS;
+        shm->header->id_slot_size = SHM_ID_SLOT_SIZE;
+        shm->header->reply_slot_size = SHM_REPLY_SLOT_SIZE;
+        shm->header->reply_slots = (shm->size - SHM_HEADER_SIZE - SHM_ID_SLOTS * SHM_ID_SLOT_SIZE) /
+                                   SHM_REPLY_SLOT_SIZE;
+        __atomic_store_n(&shm->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    
+    /* Geometry comes from the header, written by whichever build created it */
+    struct shm_header *header = shm->header;
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION || !header->id_slots ||
+        header->id_slot_size <= sizeof(struct shm_slot) || header->id_slot_size % 8 ||
+        header->reply_slot_size <= sizeof(struct shm_slot) || header->reply_slot_size % 8 ||
+        SHM_HEADER_SIZE + (uint64_t)header->id_slots * header->id_slot_size +
+        (uint64_t)header->reply_slots * header->reply_slot_size > shm->size) {
+        errno = EINVAL;
+        goto fail;
+    }
+    
+    flock(fd, LOCK_UN);
+    close(fd);
+    return shm;
+    
+fail:
+    err = errno;
+    if (shm->base) {
+        munmap(shm->base, shm->size);
+    }
+    close(fd);
+    free(shm);
+    errno = err;
+    return NULL;
+}
+
+/* Unmap a shared cache segment, the file stays for the other processes */
+static void shm_detach(struct shm_segment *shm) {
+    munmap(shm->base, shm->size);
+    free(shm);
+}
+
+#if PYUBUS_WITH_CACHE
+/* Hash of a reply cache key */
+static uint32_t reply_cache_hash(uint32_t id, const char *method, struct blob_attr *params) {
+    uint32_t hash = bytes_hash(2166136261u, &id, sizeof(id));
+    
+    hash = bytes_hash(hash, method, strlen(method) + 1);
+    return bytes_hash(hash, params, blob_raw_len(params));
+}
+
+/* Find a cached reply, expired or not */
+static struct reply_cache_entry *reply_cache_find(UbusClientObject *self, uint32_t id, const char *method,
+                                                  struct blob_attr *params, uint32_t hash) {
+    struct reply_cache_entry *entry;
+    size_t params_len = blob_raw_len(params);
+    
+    for (entry = self->reply_cache[hash % REPLY_CACHE_SIZE]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->id == id && !strcmp(entry->key, method) &&
+            blob_raw_len((struct blob_attr *)(entry->key + entry->params_offset)) == params_len &&
+            !memcmp(entry->key + entry->params_offset, params, params_len)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Drop one cached reply */
+static void reply_cache_remove(UbusClientObject *self, struct reply_cache_entry *entry) {
+    struct reply_cache_entry **prev = &self->reply_cache[entry->hash % REPLY_CACHE_SIZE];
+    
+    while (*prev != entry) {
+        prev = &(*prev)->next;
+    }
+    *prev = entry->next;
+    
+    list_del(&entry->lru);
+    self->cache_bytes -= entry->size;
+    free(entry->reply);
+    free(entry);
+}
+
+/* Drop the cached replies of an object */
+static void reply_cache_remove_id(UbusClientObject *self, uint32_t id) {
+    struct reply_cache_entry *entry, *tmp;
+    
+    list_for_each_entry_safe(entry, tmp, &self->cache_lru, lru) {
+        if (entry->id == id) {
+            reply_cache_remove(self, entry);
+        }
+    }
+}
+
+/* Drop all cached replies */
+static void reply_cache_clear(UbusClientObject *self) {
+    struct reply_cache_entry *entry, *tmp;
+    
+    list_for_each_entry_safe(entry, tmp, &self->cache_lru, lru) {
+        reply_cache_remove(self, entry);
+    }
+}
+
+/* Cache a reply, taking ownership of it, and evict the least recently used
+ * replies beyond cache_limit */
+static void reply_cache_insert(UbusClientObject *self, uint32_t id, const char *method,
+                               struct blob_attr *params, struct blob_attr *reply, int ttl_ms) {
+    size_t method_len = strlen(method) + 1, params_len = blob_raw_len(params);
+    size_t size = sizeof(struct reply_cache_entry) + method_len + params_len +
+                  (reply ? blob_raw_len(reply) : 0);
+    
+    if ((Py_ssize_t)size > self->cache_limit) {
+        free(reply);
+        return;
+    }
+    
+    struct reply_cache_entry *entry = malloc(sizeof(*entry) + method_len + params_len);
+    if (!entry) {
+        free(reply);
+        return;
+    }
+    
+    memcpy(entry->key, method, method_len);
+    memcpy(entry->key + method_len, params, params_len);
+    entry->params_offset = method_len;
+    entry->hash = reply_cache_hash(id, method, params);
+    entry->id = id;
+    entry->expires = monotonic_ms() + ttl_ms;
+    entry->size = size;
+    entry->reply = reply;
+    
+    entry->next = self->reply_cache[entry->hash % REPLY_CACHE_SIZE];
+    self->reply_cache[entry->hash % REPLY_CACHE_SIZE] = entry;
+    list_add(&entry->lru, &self->cache_lru);
+    self->cache_bytes += size;
+    
+    while (self->cache_bytes > self->cache_limit) {
+        reply_cache_remove(self, list_entry(self->cache_lru.prev, struct reply_cache_entry, lru));
+    }
+}
+
+/* TTL in milliseconds set for an (object, method), 0 if it is not cached */
+static int cache_rule_ttl(UbusClientObject *self, const char *object, const char *method) {
+    for (struct cache_rule *rule = self->cache_rules; rule; rule = rule->next) {
+        const char *rule_method = rule->key + rule->method_offset;
+        
+        if (!strcmp(rule->key, object) && (!strcmp(rule_method, method) || !strcmp(rule_method, "*"))) {
+            return rule->ttl_ms;
+        }
+    }
+    return 0;
+}
+
+/* Set, or with ttl_ms 0 remove, the TTL of an (object, method) */
+static int cache_rule_set(UbusClientObject *self, const char *object, const char *method, int ttl_ms) {
+    struct cache_rule **prev = &self->cache_rules;
+    
+    for (struct cache_rule *rule = *prev; rule; prev = &rule->next, rule = rule->next) {
+        if (!strcmp(rule->key, object) && !strcmp(rule->key + rule->method_offset, method)) {
+            *prev = rule->next;
+            free(rule);
+            break;
+        }
+    }
+    
+    if (!ttl_ms) {
+        return 0;
+    }
+    
+    size_t object_len = strlen(object) + 1, method_len = strlen(method) + 1;
+    struct cache_rule *rule = malloc(sizeof(*rule) + object_len + method_len);
+    if (!rule) {
+        return -1;
+    }
+    
+    memcpy(rule->key, object, object_len);
+    memcpy(rule->key + object_len, method, method_len);
+    rule->method_offset = object_len;
+    rule->ttl_ms = ttl_ms;
+    rule->next = self->cache_rules;
+    self->cache_rules = rule;
+    return 0;
+}
+
+/* Remove all TTLs */
+static void cache_rules_clear(UbusClientObject *self) {
+    while (self->cache_rules) {
+        struct cache_rule *next = self->cache_rules->next;
+        free(self->cache_rules);
+        self->cache_rules = next;
+    }
+}
+#else
+/* Reply cache left out of the build: no rule can be set, so nothing is cached */
+static uint32_t reply_cache_hash(uint32_t id, const char *method, struct blob_attr *params) {
+    (void)id;
+    (void)method;
+    (void)params;
+    return 0;
+}
+
+static struct reply_cache_entry *reply_cache_find(UbusClientObject *self, uint32_t id, const char *method,
+                                                  struct blob_attr *params, uint32_t hash) {
+    (void)self;
+    (void)id;
+    (void)method;
+    (void)params;
+    (void)hash;
+    return NULL;
+}
+
+static void reply_cache_remove(UbusClientObject *self, struct reply_cache_entry *entry) {
+    (void)self;
+    (void)entry;
+}
+
+static void reply_cache_remove_id(UbusClientObject *self, uint32_t id) {
+    (void)self;
+    (void)id;
+}
+
+static void reply_cache_clear(UbusClientObject *self) {
+    (void)self;
+}
+
+static void reply_cache_insert(UbusClientObject *self, uint32_t id, const char *method,
+                               struct blob_attr *params, struct blob_attr *reply, int ttl_ms) {
+    (void)self;
+    (void)id;
+    (void)method;
+    (void)params;
+    (void)ttl_ms;
+    free(reply);
+}
+
+static int cache_rule_ttl(UbusClientObject *self, const char *object, const char *method) {
+    (void)self;
+    (void)object;
+    (void)method;
+    return 0;
+}
+
+static void cache_rules_clear(UbusClientObject *self) {
+    (void)self;
+}
+#endif  /* PYUBUS_WITH_CACHE */
+
+/* Take a reply another process cached in the shared segment into the reply
+ * cache for the rest of its TTL, NULL if there is none */
+static struct reply_cache_entry *client_shared_reply(UbusClientObject *self, uint32_t id, const char *method,
+                                                     struct blob_attr *params, uint32_t hash, int64_t now) {
+    struct blob_attr *reply;
+    int64_t expires;
+    
+    if (!self->shm || !self->shm->replies ||
+        !shm_reply_find(self->shm, id, method, params, hash, now, &reply, &expires)) {
+        return NULL;
+    }
+    
+    reply_cache_insert(self, id, method, params, reply, (int)(expires - now));
+    
+    struct reply_cache_entry *entry = reply_cache_find(self, id, method, params, hash);
+    if (entry) {
+        self->shared_hits++;
+    }
+    return entry;
+}
+
+/* Find a cached object by path */
+static struct id_cache_entry *id_cache_find(UbusClientObject *self, const char *path, uint32_t hash) {
+    struct id_cache_entry *entry;
+    
+    for (entry = self->id_cache[hash % ID_CACHE_SIZE]; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->path, path)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Drop a cached object, if present */
+static void id_cache_remove(UbusClientObject *self, const char *path) {
+    uint32_t hash = path_hash(path);
+    struct id_cache_entry **prev = &self->id_cache[hash % ID_CACHE_SIZE];
+    
+    if (self->shm) {
+        shm_id_remove(self->shm, path, hash);
+    }
+    
+    for (struct id_cache_entry *entry = *prev; entry; prev = &entry->next, entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->path, path)) {
+            *prev = entry->next;
+            reply_cache_remove_id(self, entry->id);
+            free(entry->signature);
+            free(entry);
+            return;
+        }
+    }
+}
+
+/* Drop all cached objects */
+static void id_cache_clear(UbusClientObject *self) {
+    reply_cache_clear(self);
+    for (int i = 0; i < ID_CACHE_SIZE; i++) {
+        struct id_cache_entry *entry = self->id_cache[i];
+        while (entry) {
+            struct id_cache_entry *next = entry->next;
+            free(entry->signature);
+            free(entry);
+            entry = next;
+        }
+        self->id_cache[i] = NULL;
+    }
+}
+
+/* Add an object to the ID cache, taking ownership of signature */
+static struct id_cache_entry *id_cache_insert(UbusClientObject *self, const char *path, uint32_t hash,
+                                              uint32_t id, struct blob_attr *signature) {
+    size_t len = strlen(path) + 1;
+    struct id_cache_entry *entry = malloc(sizeof(*entry) + len);
+    if (!entry) {
+        free(signature);
+        return NULL;
+    }
+    
+    memcpy(entry->path, path, len);
+    entry->hash = hash;
+    entry->id = id;
+    entry->suspect = 0;
+    entry->signature = signature;
+    entry->next = self->id_cache[hash % ID_CACHE_SIZE];
+    self->id_cache[hash % ID_CACHE_SIZE] = entry;
+    return entry;
+}
+
+/* Ask ubusd whether a cached object still has the ID old_id. The entry is
+ * only replaced, dropping its cached replies, if the object moved or went
+ * away. Returns the current ID, 0 if the object is gone. */
+static uint32_t id_cache_verify(UbusClientObject *self, const char *path, uint32_t hash, uint32_t old_id) {
+    struct lookup_result lookup = { .path = path };
+    int ret;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_lookup(self->ctx, path, lookup_cb, &lookup);
+    Py_END_ALLOW_THREADS
+    
+    if (ret == UBUS_STATUS_OK && lookup.found && lookup.id == old_id) {
+        free(lookup.signature);
+        return old_id;
+    }
+    
+    id_cache_remove(self, path);
+    if (ret != UBUS_STATUS_OK || !lookup.found) {
+        free(lookup.signature);
+        return 0;
+    }
+    
+    if (self->shm) {
+        shm_id_publish(self->shm, path, hash, lookup.id, lookup.signature);
+    }
+    struct id_cache_entry *entry = id_cache_insert(self, path, hash, lookup.id, lookup.signature);
+    return entry ? entry->id : 0;
+}
+
+/* Resolve an object path through the ID cache, looking it up on a miss */
+static struct id_cache_entry *id_cache_resolve(UbusClientObject *self, const char *path, int *status) {
+    uint32_t hash = path_hash(path);
+    struct id_cache_entry *entry = id_cache_find(self, path, hash);
+    
+    if (entry && entry->suspect) {
+        entry->suspect = 0;
+        id_cache_verify(self, path, hash, entry->id);
+        entry = id_cache_find(self, path, hash);
+    }
+    
+    if (entry) {
+        *status = UBUS_STATUS_OK;
+        return entry;
+    }
+    
+    /* Another process may have resolved it already */
+    uint32_t shared_id;
+    struct blob_attr *signature;
+    if (self->shm && shm_id_find(self->shm, path, hash, &shared_id, &signature)) {
+        entry = id_cache_insert(self, path, hash, shared_id, signature);
+        if (entry) {
+            self->shared_hits++;
+            *status = UBUS_STATUS_OK;
+            return entry;
+        }
+    }
+    
+    struct lookup_result lookup = { .path = path };
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_lookup(self->ctx, path, lookup_cb, &lookup);
+    Py_END_ALLOW_THREADS
+    *status = ret;
+    if (*status == UBUS_STATUS_OK && !lookup.found) {
+        *status = UBUS_STATUS_NOT_FOUND;
+    }
+    if (*status != UBUS_STATUS_OK) {
+        free(lookup.signature);
+        return NULL;
+    }
+    
+    if (self->shm) {
+        shm_id_publish(self->shm, path, hash, lookup.id, lookup.signature);
+    }
+    entry = id_cache_insert(self, path, hash, lookup.id, lookup.signature);
+    if (!entry) {
+        *status = UBUS_STATUS_NO_MEMORY;
+    }
+    return entry;
+}
+
+/* Phases a call is split into by the statistics */
+enum call_phase {
+    PHASE_LOOKUP,
+    PHASE_ENCODE,
+    PHASE_IPC,
+    PHASE_DECODE,
+    PHASE_TOTAL,
+    __PHASE_LAST
+};
+
+#if PYUBUS_WITH_STATS
+static const char *const call_phase_names[__PHASE_LAST] = {
+    "lookup", "encode", "ipc", "decode", "total"
+};
+#endif
+
+/* Nanoseconds spent in each phase of one call */
+struct call_timing {
+    int64_t start;
+    int64_t ns[__PHASE_LAST];
+    uint64_t bytes_received;
+    uint64_t bytes_decoded;
+    uint64_t decode_alloc;      /* estimated Python allocation of the largest decode */
+};
+
+struct latency_histogram {
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+/* Counters and latency histograms of one (object, method) */
+struct call_stats {
+    struct call_stats *next;
+    uint32_t hash;
+    uint32_t id;                /* object ID of calls made by ID, the name is empty then */
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes_received;
+    uint64_t bytes_decoded;
+    uint64_t decode_peak;
+    struct latency_histogram phases[__PHASE_LAST];
+    size_t method_offset;
+    char key[];                 /* object name and method, both NUL terminated */
+};
+
+#if PYUBUS_WITH_STATS
+/* Histogram bucket of a latency */
+static int stats_bucket(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= STATS_MAX_BITS) {
+        return STATS_BUCKETS - 1;
+    }
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+           (int)((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* Smallest latency falling into a histogram bucket */
+static uint64_t stats_bucket_floor(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    
+    int msb = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (msb - STATS_SUB_BITS);
+}
+
+/* Find the statistics of an (object, method), adding them if create is set.
+ * Calls made by ID pass a NULL object. */
+static struct call_stats *stats_find(struct call_stats **table, const char *object, uint32_t id,
+                                     const char *method, int create) {
+    if (!object) {
+        object = "";
+    }
+    else {
+        id = 0;
+    }
+    
+    uint32_t hash = (*object ? path_hash(object) : id) * 31 + path_hash(method);
+    struct call_stats *entry;
+    
+    for (entry = table[hash % STATS_TABLE_SIZE]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->id == id && !strcmp(entry->key, object) &&
+            !strcmp(entry->key + entry->method_offset, method)) {
+            return entry;
+        }
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    size_t object_len = strlen(object) + 1, method_len = strlen(method) + 1;
+    entry = calloc(1, sizeof(*entry) + object_len + method_len);
+    if (!entry) {
+        return NULL;
+    }
+    
+    memcpy(entry->key, object, object_len);
+    memcpy(entry->key + object_len, method, method_len);
+    entry->method_offset = object_len;
+    entry->hash = hash;
+    entry->id = id;
+    entry->next = table[hash % STATS_TABLE_SIZE];
+    table[hash % STATS_TABLE_SIZE] = entry;
+    return entry;
+}
+
+/* Account one finished call, the IPC phase is whatever the other phases
+ * leave of the total (including retries after a reconnect) */
+static void stats_add(struct call_stats *entry, struct call_timing *timing, int failed) {
+    if (!entry) {
+        return;
+    }
+    
+    timing->ns[PHASE_TOTAL] = monotonic_ns() - timing->start;
+    timing->ns[PHASE_IPC] = timing->ns[PHASE_TOTAL] - timing->ns[PHASE_LOOKUP] -
+                            timing->ns[PHASE_ENCODE] - timing->ns[PHASE_DECODE];
+    
+    entry->calls++;
+    entry->errors += failed != 0;
+    entry->bytes_received += timing->bytes_received;
+    entry->bytes_decoded += timing->bytes_decoded;
+    if (timing->decode_alloc > entry->decode_peak) {
+        entry->decode_peak = timing->decode_alloc;
+    }
+    for (int i = 0; i < __PHASE_LAST; i++) {
+        uint64_t ns = timing->ns[i] > 0 ? (uint64_t)timing->ns[i] : 0;
+        struct latency_histogram *h = &entry->phases[i];
+        
+        h->sum_ns += ns;
+        if (ns > h->max_ns) {
+            h->max_ns = ns;
+        }
+        h->buckets[stats_bucket(ns)]++;
+    }
+}
+
+/* Add the counters of src into dst */
+static int stats_merge(struct call_stats **dst, struct call_stats **src) {
+    for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+        for (struct call_stats *entry = src[i]; entry; entry = entry->next) {
+            if (!entry->calls) {
+                continue;
+            }
+            
+            struct call_stats *into = stats_find(dst, *entry->key ? entry->key : NULL, entry->id,
+                                                 entry->key + entry->method_offset, 1);
+            if (!into) {
+                return -1;
+            }
+            
+            into->calls += entry->calls;
+            into->errors += entry->errors;
+            into->bytes_received += entry->bytes_received;
+            into->bytes_decoded += entry->bytes_decoded;
+            if (entry->decode_peak > into->decode_peak) {
+                into->decode_peak = entry->decode_peak;
+            }
+            for (int p = 0; p < __PHASE_LAST; p++) {
+                into->phases[p].sum_ns += entry->phases[p].sum_ns;
+                if (entry->phases[p].max_ns > into->phases[p].max_ns) {
+                    into->phases[p].max_ns = entry->phases[p].max_ns;
+                }
+                for (int b = 0; b < STATS_BUCKETS; b++) {
+                    into->phases[p].buckets[b] += entry->phases[p].buckets[b];
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* Zero all counters. Entries stay allocated, async requests in flight
+ * point at them. */
+static void stats_reset(struct call_stats **table) {
+    for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+        for (struct call_stats *entry = table[i]; entry; entry = entry->next) {
+            entry->calls = 0;
+            entry->errors = 0;
+            entry->bytes_received = 0;
+            entry->bytes_decoded = 0;
+            entry->decode_peak = 0;
+            memset(entry->phases, 0, sizeof(entry->phases));
+        }
+    }
+}
+
+/* Free all entries */
+static void stats_clear(struct call_stats **table) {
+    for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+        struct call_stats *entry = table[i];
+        while (entry) {
+            struct call_stats *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        table[i] = NULL;
+    }
+}
+
+/* Latency in nanoseconds below which a share p of the calls fall, reported
+ * as the upper end of its bucket */
+static uint64_t histogram_percentile(const struct latency_histogram *h, uint64_t calls, double p) {
+    uint64_t target = (uint64_t)ceil(calls * p), seen = 0;
+    
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= target && seen) {
+            uint64_t upper = stats_bucket_floor(b + 1) - 1;
+            return upper < h->max_ns ? upper : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/* Convert one phase histogram to {"sum_us", "mean_us", "max_us", "p50_us",
+ * "p90_us", "p99_us", "histogram": [(upper_us, count), ...]} */
+static PyObject *histogram_to_python(const struct latency_histogram *h, uint64_t calls) {
+    PyObject *buckets = PyList_New(0);
+    if (!buckets) {
+        return NULL;
+    }
+    
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (!h->buckets[b]) {
+            continue;
+        }
+        
+        double upper = b < STATS_BUCKETS - 1 ? (stats_bucket_floor(b + 1) - 1) / 1000.0 : INFINITY;
+        PyObject *item = Py_BuildValue("(dk)", upper, (unsigned long)h->buckets[b]);
+        if (!item || PyList_Append(buckets, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    
+    return Py_BuildValue("{s:d,s:d,s:d,s:d,s:d,s:d,s:N}",
+                         "sum_us", h->sum_ns / 1000.0,
+                         "mean_us", h->sum_ns / 1000.0 / calls,
+                         "max_us", h->max_ns / 1000.0,
+                         "p50_us", histogram_percentile(h, calls, 0.50) / 1000.0,
+                         "p90_us", histogram_percentile(h, calls, 0.90) / 1000.0,
+                         "p99_us", histogram_percentile(h, calls, 0.99) / 1000.0,
+                         "histogram", buckets);
+}
+
+/* Convert the statistics to {(object, method): {"calls", "errors", "bytes_received",
+ * "bytes_decoded", "decode_peak", phase: {...}}},
+ * object being the ID for calls made by ID */
+static PyObject *stats_to_python(struct call_stats **table) {
+    PyObject *result = PyDict_New();
+    if (!result) {
+        return NULL;
+    }
+    
+    for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+        for (struct call_stats *entry = table[i]; entry; entry = entry->next) {
+            if (!entry->calls) {
+                continue;
+            }
+            
+            PyObject *key = *entry->key ?
+                Py_BuildValue("(ss)", entry->key, entry->key + entry->method_offset) :
+                Py_BuildValue("(ks)", (unsigned long)entry->id, entry->key + entry->method_offset);
+            PyObject *value = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K}",
+                                            "calls", (unsigned long long)entry->calls,
+                                            "errors", (unsigned long long)entry->errors,
+                                            "bytes_received", (unsigned long long)entry->bytes_received,
+                                            "bytes_decoded", (unsigned long long)entry->bytes_decoded,
+                                            "decode_peak", (unsigned long long)entry->decode_peak);
+            int failed = !key || !value;
+            
+            for (int p = 0; p < __PHASE_LAST && !failed; p++) {
+                PyObject *phase = histogram_to_python(&entry->phases[p], entry->calls);
+                failed = !phase || PyDict_SetItemString(value, call_phase_names[p], phase) < 0;
+                Py_XDECREF(phase);
+            }
+            
+            if (failed || PyDict_SetItem(result, key, value) < 0) {
+                Py_XDECREF(key);
+                Py_XDECREF(value);
+                Py_DECREF(result);
+                return NULL;
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+    }
+    
+    return result;
+}
+#else
+/* Statistics left out of the build: nothing is recorded and stats() stays empty */
+static struct call_stats *stats_find(struct call_stats **table, const char *object, uint32_t id,
+                                     const char *method, int create) {
+    (void)table;
+    (void)object;
+    (void)id;
+    (void)method;
+    (void)create;
+    return NULL;
+}
+
+static void stats_add(struct call_stats *entry, struct call_timing *timing, int failed) {
+    (void)entry;
+    (void)timing;
+    (void)failed;
+}
+
+static int stats_merge(struct call_stats **dst, struct call_stats **src) {
+    (void)dst;
+    (void)src;
+    return 0;
+}
+
+static void stats_reset(struct call_stats **table) {
+    (void)table;
+}
+
+static void stats_clear(struct call_stats **table) {
+    (void)table;
+}
+
+static PyObject *stats_to_python(struct call_stats **table) {
+    (void)table;
+    return PyDict_New();
+}
+#endif  /* PYUBUS_WITH_STATS */
+
+/* Event handler invalidating cached IDs when objects come and go */
+static void object_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                            const char *type, struct blob_attr *msg) {
+    UbusClientObject *self = container_of(ev, UbusClientObject, object_event);
+    static const struct blobmsg_policy policy[] = {
+        { "path", BLOBMSG_TYPE_STRING },
+        { "id", BLOBMSG_TYPE_INT32 },
+    };
+    struct blob_attr *tb[2];
+    
+    (void)ctx;
+    (void)type;
+    
+    blobmsg_parse(policy, 2, tb, blob_data(msg), blob_len(msg));
+    if (tb[0]) {
+        id_cache_remove(self, blobmsg_get_string(tb[0]));
+    }
+    /* This process may be the only one watching for the shared segment */
+    if (tb[1] && self->shm) {
+        shm_reply_remove_id(self->shm, blobmsg_get_u32(tb[1]));
+    }
+}
+
+static int client_reconnect_locked(UbusClientObject *self);
+static void client_io_wake(UbusClientObject *self);
+static void client_io_close(UbusClientObject *self);
+static void client_stop_io_thread(UbusClientObject *self);
+
+/* Reconnect a socket that hung up and run handlers for messages libubus
+ * queued while a request was in progress */
+static void client_dispatch_pending(UbusClientObject *self) {
+    if (self->ctx->sock.eof) {
+        client_reconnect_locked(self);
+    }
+    
+    /* Handlers may reply, which takes send_lock */
+    if (!list_empty(&self->ctx->pending)) {
+        Py_BEGIN_ALLOW_THREADS
+        ubus_handle_event(self->ctx);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* A call to old_id, cached for path, failed with NOT_FOUND. Methods return
+ * that for missing data too (uci get of a missing section), so the entry is
+ * only dropped if the object was really removed or re-registered. Returns
+ * the ID to retry the call with, 0 to keep the error. */
+static uint32_t id_cache_recheck(UbusClientObject *self, const char *path, uint32_t old_id) {
+    uint32_t hash = path_hash(path);
+    
+    /* Object events that arrived during the call are queued, run them first */
+    client_dispatch_pending(self);
+    
+    struct id_cache_entry *entry = id_cache_find(self, path, hash);
+    if (!entry) {
+        int ret;
+        entry = id_cache_resolve(self, path, &ret);
+        return entry && entry->id != old_id ? entry->id : 0;
+    }
+    
+    /* Still cached while the removal would have been seen: the method answered */
+    if (entry->id != old_id || self->objects_watched) {
+        return entry->id != old_id ? entry->id : 0;
+    }
+    
+    uint32_t id = id_cache_verify(self, path, hash, old_id);
+    return id != old_id ? id : 0;
+}
+
+/* An async or pipelined call to id failed with NOT_FOUND. Without object
+ * events to tell, the next resolve of its path checks it with a lookup. */
+static void id_cache_suspect_id(UbusClientObject *self, uint32_t id) {
+    if (self->objects_watched) {
+        return;
+    }
+    
+    for (int i = 0; i < ID_CACHE_SIZE; i++) {
+        for (struct id_cache_entry *entry = self->id_cache[i]; entry; entry = entry->next) {
+            if (entry->id == id) {
+                entry->suspect = 1;
+            }
+        }
+    }
+}
+
+/* What a synchronous call returns its reply as, passed around as lazy */
+enum {
+    REPLY_DECODE,               /* Python objects */
+    REPLY_VIEW,                 /* BlobView, call(..., lazy=True) */
+    REPLY_JSON,                 /* Compact JSON text, call_json() */
+};
+
+/* Reply of a synchronous call, timing is NULL unless statistics are
+ * collected. With keep_raw set a copy of the reply blob is kept for the
+ * reply cache. With record set the reply is decoded into a Record, with
+ * json set call_lazy_cb() formats it as JSON instead of keeping a view. */
+struct call_reply {
+    UbusClientObject *client;
+    PyObject *result;
+    struct call_timing *timing;
+    int keep_raw;
+    int json;
+    struct blob_attr *raw;
+    const struct record_layout *record;
+};
+
+static int client_check_reply(UbusClientObject *self, struct blob_attr *msg, int decode,
+                              struct call_timing *timing);
+
+/* Keep a copy of a reply message for the reply cache or coalesced callers,
+ * must be called with the GIL held */
+static void call_keep_raw(struct call_reply *reply, struct blob_attr *msg) {
+    if (reply->keep_raw && !PyErr_Occurred()) {
+        free(reply->raw);
+        reply->raw = blob_memdup(msg);
+        if (!reply->raw) {
+            PyErr_NoMemory();
+        }
+    }
+}
+
+/* Callback for ubus method calls, runs with the GIL released */
+static void call_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct call_reply *reply = (struct call_reply *)req->priv;
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    if (!PyErr_Occurred()) {
+        client_check_reply(reply->client, msg, 1, reply->timing);
+    }
+    call_keep_raw(reply, msg);
+    int64_t start = reply->timing ? monotonic_ns() : 0;
+    
+    if (!PyErr_Occurred()) {
+        /* The reply payload is the list of top-level blobmsg table entries */
+        PyObject *decoded = reply->record ? blob_table_to_record(reply->record, blob_data(msg), blob_len(msg)) :
+                            blob_table_to_python(blob_data(msg), blob_len(msg));
+        if (decoded) {
+            Py_XDECREF(reply->result);
+            reply->result = decoded;
+        }
+    }
+    
+    if (reply->timing) {
+        reply->timing->ns[PHASE_DECODE] += monotonic_ns() - start;
+    }
+    
+    PyGILState_Release(gstate);
+}
+
+/* Note the calling thread as the owner of the context lock it just took */
+static void client_lock_taken(UbusClientObject *self) {
+    if (self->lock_depth++ == 0) {
+        __atomic_store_n(&self->lock_owner, PyThread_get_thread_ident(), __ATOMIC_RELAXED);
+    }
+}
+
+/* Take the context lock, releasing the GIL while waiting for it */
+static void client_lock(UbusClientObject *self) {
+    /* The lock is recursive and must never be waited for with the GIL
+     * held: the thread that owns it may need the GIL in a callback. */
+    if (pthread_mutex_trylock(&self->lock) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+    client_lock_taken(self);
+}
+
+/* Release the context lock */
+static void client_unlock(UbusClientObject *self) {
+    if (--self->lock_depth == 0) {
+        __atomic_store_n(&self->lock_owner, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* Whether the calling thread holds the context lock, e.g. in a handler
+ * dispatched under it. Other threads never see their own ID in lock_owner. */
+static int client_lock_owned(UbusClientObject *self) {
+    return __atomic_load_n(&self->lock_owner, __ATOMIC_RELAXED) == PyThread_get_thread_ident();
+}
+
+/* Get the encode buffer of the context, or local if it is already in use.
+ * Must be called with the context lock held. */
+static struct blob_buf *client_buf_acquire(UbusClientObject *self, struct blob_buf *local) {
+    /* A handler dispatched while a request is being encoded gets its own */
+    if (self->buf_busy) {
+        memset(local, 0, sizeof(*local));
+        return local;
+    }
+    
+    self->buf_busy = 1;
+    return &self->buf;
+}
+
+/* Release a buffer from client_buf_acquire(), must be called with the context lock held */
+static void client_buf_release(UbusClientObject *self, struct blob_buf *b) {
+    if (b != &self->buf) {
+        blob_buf_free(b);
+        return;
+    }
+    
+    /* Keep the buffer for the next call unless one big request grew it */
+    self->buf_busy = 0;
+    if (self->buf.buflen > self->buffer_limit) {
+        blob_buf_free(&self->buf);
+    }
+}
+
+static void client_detach_async(UbusClientObject *self);
+static void client_abort_iterators(UbusClientObject *self);
+static void client_clear_listeners(UbusClientObject *self);
+static void client_clear_objects(UbusClientObject *self);
+static void client_clear_async_pool(UbusClientObject *self);
+
+/* Human readable description of a ubus status code */
+static const char *status_message(int ret) {
+    switch (ret) {
+        case UBUS_STATUS_INVALID_COMMAND:
+            return "Invalid command";
+        case UBUS_STATUS_INVALID_ARGUMENT:
+            return "Invalid argument";
+        case UBUS_STATUS_METHOD_NOT_FOUND:
+            return "Method not found";
+        case UBUS_STATUS_NOT_FOUND:
+            return "Object not found";
+        case UBUS_STATUS_PERMISSION_DENIED:
+            return "Permission denied";
+        case UBUS_STATUS_TIMEOUT:
+            return "Timeout";
+        case UBUS_STATUS_NO_DATA:
+            return "No data";
+        case UBUS_STATUS_NOT_SUPPORTED:
+            return "Not supported";
+        case UBUS_STATUS_CONNECTION_FAILED:
+            return "Connection failed";
+        default:
+            return "Unknown error";
+    }
+}
+
+/* UbusError object structure, shared by all the exception classes */
+typedef struct {
+    PyException_HEAD
+    PyObject *status;
+} UbusErrorObject;
+
+static PyTypeObject UbusErrorType;
+static PyTypeObject UbusMethodErrorType;
+static PyObject *UbusConnectionError;
+static PyObject *UbusAuthError;
+static PyObject *UbusPermissionError;
+static PyObject *UbusTimeoutError;
+static PyObject *UbusReplyLimitError;
+
+/* Argument tuple holding the fixed message of each status code, the last
+ * slot is used for codes libubus does not know */
+static PyObject *status_args[__UBUS_STATUS_LAST + 1];
+
+static int UbusError_traverse(UbusErrorObject *self, visitproc visit, void *arg) {
+    Py_VISIT(self->status);
+    return ((PyTypeObject *)PyExc_RuntimeError)->tp_traverse((PyObject *)self, visit, arg);
+}
+
+static int UbusError_clear(UbusErrorObject *self) {
+    Py_CLEAR(self->status);
+    return ((PyTypeObject *)PyExc_RuntimeError)->tp_clear((PyObject *)self);
+}
+
+static void UbusError_dealloc(UbusErrorObject *self) {
+    PyObject_GC_UnTrack(self);
+    Py_CLEAR(self->status);
+    ((PyTypeObject *)PyExc_RuntimeError)->tp_dealloc((PyObject *)self);
+}
+
+/* UbusError(*args, status=None) */
+static int UbusError_init(UbusErrorObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *status = NULL;
+    
+    if (kwds && PyDict_GET_SIZE(kwds) > 0) {
+        status = PyDict_GetItemString(kwds, "status");
+        if (!status || PyDict_GET_SIZE(kwds) > 1) {
+            PyErr_Format(PyExc_TypeError, "%s() only accepts a 'status' keyword argument",
+                         Py_TYPE(self)->tp_name);
+            return -1;
+        }
+    }
+    
+    if (((PyTypeObject *)PyExc_RuntimeError)->tp_init((PyObject *)self, args, NULL) < 0) {
+        return -1;
+    }
+    
+    Py_XINCREF(status);
+    Py_XSETREF(self->status, status);
+    return 0;
+}
+
+/* UbusMethodError(message, code=None) */
+static int UbusMethodError_init(UbusErrorObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"message", "code", NULL};
+    PyObject *message;
+    PyObject *code = NULL;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:UbusMethodError", kwlist, &message, &code)) {
+        return -1;
+    }
+    
+    PyObject *base_args = PyTuple_Pack(1, message);
+    if (!base_args) {
+        return -1;
+    }
+    int ret = ((PyTypeObject *)PyExc_RuntimeError)->tp_init((PyObject *)self, base_args, NULL);
+    Py_DECREF(base_args);
+    if (ret < 0) {
+        return -1;
+    }
+    
+    Py_XINCREF(code);
+    Py_XSETREF(self->status, code);
+    return 0;
+}
+
+static PyMemberDef UbusError_members[] = {
+    {"status", T_OBJECT, offsetof(UbusErrorObject, status), 0,
+     "UBUS_STATUS_* code of the failure, or None"},
+    {NULL}  /* Sentinel */
+};
+
+/* code is the name the Python exceptions used for the status */
+static PyMemberDef UbusMethodError_members[] = {
+    {"code", T_OBJECT, offsetof(UbusErrorObject, status), 0,
+     "Alias of status"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject UbusErrorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.UbusError",
+    .tp_doc = "Base exception for all ubus-related errors",
+    .tp_basicsize = sizeof(UbusErrorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)UbusError_traverse,
+    .tp_clear = (inquiry)UbusError_clear,
+    .tp_dealloc = (destructor)UbusError_dealloc,
+    .tp_init = (initproc)UbusError_init,
+    .tp_members = UbusError_members,
+};
+
+static PyTypeObject UbusMethodErrorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.UbusMethodError",
+    .tp_doc = "Raised when a ubus method call fails",
+    .tp_basicsize = sizeof(UbusErrorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    .tp_base = &UbusErrorType,
+    .tp_traverse = (traverseproc)UbusError_traverse,
+    .tp_clear = (inquiry)UbusError_clear,
+    .tp_dealloc = (destructor)UbusError_dealloc,
+    .tp_init = (initproc)UbusMethodError_init,
+    .tp_members = UbusMethodError_members,
+};
+
+/* Exception class for a ubus status code */
+static PyObject *status_type(int status) {
+    switch (status) {
+        case UBUS_STATUS_INVALID_COMMAND:
+        case UBUS_STATUS_INVALID_ARGUMENT:
+        case UBUS_STATUS_METHOD_NOT_FOUND:
+        case UBUS_STATUS_NOT_FOUND:
+            return (PyObject *)&UbusMethodErrorType;
+        case UBUS_STATUS_PERMISSION_DENIED:
+            return UbusPermissionError;
+        case UBUS_STATUS_TIMEOUT:
+            return UbusTimeoutError;
+        case UBUS_STATUS_CONNECTION_FAILED:
+            return UbusConnectionError;
+        default:
+            return (PyObject *)&UbusErrorType;
+    }
+}
+
+/* Instantiate the exception for status from a ready argument tuple, tp_new
+ * already stores args so no __init__ call is needed */
+static PyObject *status_error_args(int status, PyObject *args) {
+    PyTypeObject *type = (PyTypeObject *)status_type(status);
+    UbusErrorObject *exc = (UbusErrorObject *)type->tp_new(type, args, NULL);
+    if (!exc) {
+        return NULL;
+    }
+    
+    exc->status = PyLong_FromLong(status);
+    if (!exc->status) {
+        Py_DECREF(exc);
+        return NULL;
+    }
+    return (PyObject *)exc;
+}
+
+/* Build an exception carrying a ubus status code in .status */
+static PyObject *status_error_v(int status, const char *fmt, va_list vargs) {
+    PyObject *msg = PyUnicode_FromFormatV(fmt, vargs);
+    if (!msg) {
+        return NULL;
+    }
+    
+    PyObject *args = PyTuple_New(1);
+    if (!args) {
+        Py_DECREF(msg);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(args, 0, msg);
+    
+    PyObject *exc = status_error_args(status, args);
+    Py_DECREF(args);
+    return exc;
+}
+
+/* Raise a prebuilt exception, always returns NULL */
+static PyObject *raise_error(PyObject *exc) {
+    if (exc) {
+        PyErr_SetObject((PyObject *)Py_TYPE(exc), exc);
+        Py_DECREF(exc);
+    }
+    return NULL;
+}
+
+/* Build an exception carrying a ubus status code without raising it */
+static PyObject *status_error(int status, const char *fmt, ...) {
+    va_list vargs;
+    
+    va_start(vargs, fmt);
+    PyObject *exc = status_error_v(status, fmt, vargs);
+    va_end(vargs);
+    return exc;
+}
+
+/* Raise an exception carrying a ubus status code, always returns NULL */
+static PyObject *raise_status(int status, const char *fmt, ...) {
+    va_list vargs;
+    
+    va_start(vargs, fmt);
+    PyObject *exc = status_error_v(status, fmt, vargs);
+    va_end(vargs);
+    return raise_error(exc);
+}
+
+/* Build the exception for a failed call without raising it. Calls that
+ * probe for objects fail often, so the message is the fixed one of the
+ * status and nothing is formatted. */
+static PyObject *call_error(int ret) {
+    int slot = (ret >= 0 && ret < __UBUS_STATUS_LAST) ? ret : __UBUS_STATUS_LAST;
+    return status_error_args(ret, status_args[slot]);
+}
+
+/* Raise the exception for a failed call, always returns NULL */
+static PyObject *raise_call_error(int ret) {
+    return raise_error(call_error(ret));
+}
+
+/* Account a reply about to be decoded, alloc being its estimated Python
+ * allocation. Must be called with the GIL held. */
+static void client_count_decoded(UbusClientObject *self, size_t size, size_t alloc,
+                                 struct call_timing *timing) {
+    self->bytes_decoded += size;
+    if (alloc > self->decode_peak) {
+        self->decode_peak = alloc;
+    }
+    
+    if (timing) {
+        timing->bytes_decoded += size;
+        if (alloc > timing->decode_alloc) {
+            timing->decode_alloc = alloc;
+        }
+    }
+}
+
+/* Check a reply against max_reply_size and max_reply_depth before anything
+ * is allocated for it. With scan set the estimated decode allocation is
+ * added to alloc. Returns -1 with UbusReplyLimitError set when the reply is
+ * over a limit. */
+static int client_reply_limits(UbusClientObject *self, struct blob_attr *msg, int scan, size_t *alloc) {
+    size_t size = blob_raw_len(msg);
+    
+    if (self->max_reply_size > 0 && size > (size_t)self->max_reply_size) {
+        PyErr_Format(UbusReplyLimitError, "Reply of %zu bytes exceeds max_reply_size (%zd)",
+                     size, self->max_reply_size);
+        return -1;
+    }
+    
+    if (!scan && self->max_reply_depth <= 0) {
+        return 0;
+    }
+    
+    int depth = blob_scan(blob_data(msg), blob_len(msg), 1, 1, self->max_reply_depth, alloc);
+    if (self->max_reply_depth > 0 && depth > self->max_reply_depth) {
+        PyErr_Format(UbusReplyLimitError, "Reply nesting exceeds max_reply_depth (%d)",
+                     self->max_reply_depth);
+        return -1;
+    }
+    return 0;
+}
+
+/* Check a reply kept from an earlier call (reply cache, shared segment or a
+ * coalesced call) against the current limits and account it if it is about
+ * to be decoded again. Must be called with the GIL held. */
+static int client_check_kept(UbusClientObject *self, struct blob_attr *msg, int lazy,
+                             struct call_timing *timing) {
+    size_t alloc = 0;
+    
+    if (client_reply_limits(self, msg, lazy == REPLY_DECODE, &alloc) < 0) {
+        return -1;
+    }
+    
+    if (lazy == REPLY_DECODE) {
+        client_count_decoded(self, blob_raw_len(msg), alloc, timing);
+    }
+    return 0;
+}
+
+/* Check a reply against max_reply_size and max_reply_depth before anything
+ * is allocated for it and account it, decode telling whether it is about to
+ * be turned into Python objects. Must be called with the GIL held, returns
+ * -1 with UbusReplyLimitError set when the reply is over a limit. */
+static int client_check_reply(UbusClientObject *self, struct blob_attr *msg, int decode,
+                              struct call_timing *timing) {
+    size_t size = blob_raw_len(msg), alloc = 0;
+    
+    self->bytes_received += size;
+    if (timing) {
+        timing->bytes_received += size;
+    }
+    
+    if (client_reply_limits(self, msg, decode, &alloc) < 0) {
+        return -1;
+    }
+    
+    if (decode) {
+        client_count_decoded(self, size, alloc, timing);
+    }
+    return 0;
+}
+
+/* Create the exception classes and their per-status messages */
+static int init_exceptions(PyObject *m) {
+    UbusErrorType.tp_base = (PyTypeObject *)PyExc_RuntimeError;
+    if (PyType_Ready(&UbusErrorType) < 0 || PyType_Ready(&UbusMethodErrorType) < 0) {
+        return -1;
+    }
+    
+    UbusConnectionError = PyErr_NewExceptionWithDoc("ubus_native.UbusConnectionError",
+        "Raised when connection to ubus fails", (PyObject *)&UbusErrorType, NULL);
+    UbusAuthError = PyErr_NewExceptionWithDoc("ubus_native.UbusAuthError",
+        "Raised when authentication fails", (PyObject *)&UbusErrorType, NULL);
+    UbusPermissionError = PyErr_NewExceptionWithDoc("ubus_native.UbusPermissionError",
+        "Raised when access is denied due to insufficient permissions", (PyObject *)&UbusErrorType, NULL);
+    UbusTimeoutError = PyErr_NewExceptionWithDoc("ubus_native.UbusTimeoutError",
+        "Raised when a ubus call times out", (PyObject *)&UbusErrorType, NULL);
+    UbusReplyLimitError = PyErr_NewExceptionWithDoc("ubus_native.UbusReplyLimitError",
+        "Raised when a reply exceeds max_reply_size or max_reply_depth", (PyObject *)&UbusErrorType, NULL);
+    if (!UbusConnectionError || !UbusAuthError || !UbusPermissionError || !UbusTimeoutError ||
+        !UbusReplyLimitError) {
+        return -1;
+    }
+    
+    struct {
+        const char *name;
+        PyObject *type;
+    } types[] = {
+        {"UbusError", (PyObject *)&UbusErrorType},
+        {"UbusMethodError", (PyObject *)&UbusMethodErrorType},
+        {"UbusConnectionError", UbusConnectionError},
+        {"UbusAuthError", UbusAuthError},
+        {"UbusPermissionError", UbusPermissionError},
+        {"UbusTimeoutError", UbusTimeoutError},
+        {"UbusReplyLimitError", UbusReplyLimitError},
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        Py_INCREF(types[i].type);
+        if (PyModule_AddObject(m, types[i].name, types[i].type) < 0) {
+            Py_DECREF(types[i].type);
+            return -1;
+        }
+    }
+    
+    for (int i = 0; i <= __UBUS_STATUS_LAST; i++) {
+        status_args[i] = Py_BuildValue("(s)", status_message(i));
+        if (!status_args[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Match the arguments of a METH_FASTCALL | METH_KEYWORDS call against names,
+ * the first npos of which may also be passed positionally. out must be
+ * NULL-initialised, optional arguments that were not passed stay NULL. */
+static int fastcall_args(const char *fname, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                         const char *const *names, int nnames, int npos, int nrequired, PyObject **out) {
+    if (nargs > npos) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %d positional arguments (%zd given)",
+                     fname, npos, nargs);
+        return -1;
+    }
+    
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        out[i] = args[i];
+    }
+    
+    Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (Py_ssize_t k = 0; k < nkw; k++) {
+        PyObject *key = PyTuple_GET_ITEM(kwnames, k);
+        int i;
+        
+        for (i = 0; i < nnames; i++) {
+            if (PyUnicode_CompareWithASCIIString(key, names[i]) == 0) {
+                break;
+            }
+        }
+        
+        if (i == nnames) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", fname, key);
+            return -1;
+        }
+        
+        if (out[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", fname, names[i]);
+            return -1;
+        }
+        out[i] = args[nargs + k];
+    }
+    
+    for (int i = 0; i < nrequired; i++) {
+        if (!out[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", fname, names[i]);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Convert a timeout in (fractional) seconds to milliseconds for libubus,
+ * None leaves *ms unchanged. Rounds up so short timeouts do not become 0,
+ * which libubus takes as no limit. */
+static int timeout_arg(PyObject *arg, int *ms) {
+    if (!arg || arg == Py_None) {
+        return 0;
+    }
+    
+    double seconds = PyFloat_AsDouble(arg);
+    if (seconds == -1.0 && PyErr_Occurred()) {
+        return -1;
+    }
+    
+    if (!(seconds >= 0) || seconds * 1000 > INT_MAX) {
+        PyErr_Format(PyExc_ValueError, "timeout must be between 0 and %d seconds", INT_MAX / 1000);
+        return -1;
+    }
+    
+    *ms = (int)ceil(seconds * 1000);
+    return 0;
+}
+
+/* Deadline a timeout in milliseconds ends at, 0 for no limit */
+static int64_t deadline_after(int timeout_ms) {
+    return timeout_ms ? monotonic_ms() + timeout_ms : 0;
+}
+
+/* Timeout left until a deadline, in the form libubus takes (0 for no limit),
+ * or -1 once it has passed */
+static int deadline_remaining(int64_t deadline) {
+    if (!deadline) {
+        return 0;
+    }
+    
+    int64_t left = deadline - monotonic_ms();
+    return left > 0 ? (int)left : -1;
+}
+
+/* Convert the (object, method, params, timeout, lazy) arguments collected
+ * by fastcall_args() */
+static int convert_call_args(const char *fname, PyObject **out, PyObject **object, const char **method,
+                             PyObject **params, int *timeout_ms, int *lazy) {
+    if (timeout_arg(out[3], timeout_ms) < 0) {
+        return -1;
+    }
+    
+    if (!PyUnicode_Check(out[1])) {
+        PyErr_Format(PyExc_TypeError, "%s() argument 'method' must be str", fname);
+        return -1;
+    }
+    
+    *method = PyUnicode_AsUTF8(out[1]);
+    if (!*method) {
+        return -1;
+    }
+    
+    *object = out[0];
+    *params = out[2];
+    
+    if (lazy) {
+        *lazy = out[4] ? PyObject_IsTrue(out[4]) : 0;
+        if (*lazy < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Parse (object, method, params=None, *, timeout=None, lazy=False) for call()
+ * and friends, *timeout_ms is only overwritten when a timeout is given */
+static int parse_call_args(const char *fname, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                           PyObject **object, const char **method, PyObject **params,
+                           int *timeout_ms, int *lazy) {
+    static const char *const names[] = {"object", "method", "params", "timeout", "lazy"};
+    PyObject *out[5] = {NULL, NULL, NULL, NULL, NULL};
+    
+    if (fastcall_args(fname, args, nargs, kwnames, names, lazy ? 5 : 4, 3, 2, out) < 0) {
+        return -1;
+    }
+    return convert_call_args(fname, out, object, method, params, timeout_ms, lazy);
+}
+
+/* Get a str argument as UTF-8 */
+static const char *str_arg(const char *fname, const char *name, PyObject *arg) {
+    if (!PyUnicode_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be str", fname, name);
+        return NULL;
+    }
+    return PyUnicode_AsUTF8(arg);
+}
+
+/* Set up an empty flight table, waits are timed on the monotonic clock */
+static void flight_table_init(struct flight_table *t) {
+    pthread_condattr_t attr;
+    
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->landed, &attr);
+    pthread_condattr_destroy(&attr);
+    t->head = NULL;
+}
+
+/* Free a flight table, no call may be in flight through it */
+static void flight_table_destroy(struct flight_table *t) {
+    pthread_cond_destroy(&t->landed);
+    pthread_mutex_destroy(&t->lock);
+}
+
+/* Key identical calls are coalesced under: the object as it was given (name,
+ * or ID when name is NULL), the method and the params blob */
+static char *coalesce_key(const char *name, uint32_t id, const char *method,
+                          struct blob_attr *params, size_t *len) {
+    size_t object_len = name ? strlen(name) + 1 : sizeof(id);
+    size_t method_len = strlen(method) + 1, params_len = blob_raw_len(params);
+    char *key = malloc(1 + object_len + method_len + params_len);
+    
+    if (!key) {
+        return NULL;
+    }
+    
+    key[0] = name ? 'n' : 'i';
+    memcpy(key + 1, name ? (const void *)name : (const void *)&id, object_len);
+    memcpy(key + 1 + object_len, method, method_len);
+    memcpy(key + 1 + object_len + method_len, params, params_len);
+    *len = 1 + object_len + method_len + params_len;
+    return key;
+}
+
+/* UbusClient.__new__ */
+static PyObject *UbusClient_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    UbusClientObject *self = (UbusClientObject *)PyType_GenericNew(type, args, kwds);
+    if (!self) {
+        return NULL;
+    }
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&self->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    flight_table_init(&self->flights);
+    
+    INIT_LIST_HEAD(&self->async_requests);
+    INIT_LIST_HEAD(&self->iterators);
+    INIT_LIST_HEAD(&self->cache_lru);
+    INIT_LIST_HEAD(&self->listeners);
+    INIT_LIST_HEAD(&self->objects);
+    INIT_LIST_HEAD(&self->async_pool);
+    INIT_LIST_HEAD(&self->io_list);
+    self->io_wakeup[0] = self->io_wakeup[1] = -1;
+    self->buffer_limit = DEFAULT_BUFFER_LIMIT;
+    self->cache_limit = DEFAULT_CACHE_LIMIT;
+    self->watch_objects = 1;
+    
+    return (PyObject *)self;
+}
+
+/* UbusClient.__init__ */
+static int UbusClient_init(UbusClientObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"timeout", "stats", "coalesce", "max_reply_size", "max_reply_depth", NULL};
+    PyObject *timeout = NULL;
+    int stats = 0;
+    int coalesce = 0;
+    
+    self->timeout_ms = 30000;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oppni", kwlist, &timeout, &stats, &coalesce,
+                                     &self->max_reply_size, &self->max_reply_depth)) {
+        return -1;
+    }
+    
+    self->stats_enabled = (char)stats;
+    self->coalesce = (char)coalesce;
+    return timeout_arg(timeout, &self->timeout_ms);
+}
+
+/* UbusClient.__dealloc__ */
+static void UbusClient_dealloc(UbusClientObject *self) {
+    /* The I/O thread owned a reference, it has exited by now and may be
+     * the thread dropping the last one */
+    if (self->io_state != IO_IDLE) {
+        if (pthread_equal(pthread_self(), self->io_thread)) {
+            pthread_detach(self->io_thread);
+        }
+        else {
+            Py_BEGIN_ALLOW_THREADS
+            pthread_join(self->io_thread, NULL);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    client_io_close(self);
+    
+    client_detach_async(self);
+    id_cache_clear(self);
+    cache_rules_clear(self);
+    if (self->ctx) {
+        ubus_free(self->ctx);
+        self->ctx = NULL;
+    }
+    client_clear_listeners(self);
+    client_clear_objects(self);
+    blob_buf_free(&self->buf);
+    client_clear_async_pool(self);
+    stats_clear(self->stats);
+    if (self->shm) {
+        shm_detach(self->shm);
+    }
+    free(self->socket_path);
+    pthread_mutex_destroy(&self->lock);
+    flight_table_destroy(&self->flights);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Connection lost handler, the next use of the context reconnects it */
+static void client_connection_lost(struct ubus_context *ctx) {
+    (void)ctx;
+}
+
+/* Invalidate cached IDs as objects come and go, returns 0 if both events are
+ * watched. If registration is refused the NOT_FOUND retry in call() checks
+ * cached IDs with a lookup instead. */
+static int client_watch_objects(struct ubus_context *ctx, struct ubus_event_handler *ev) {
+    int ret = bus_register_event_handler(ctx, ev, "ubus.object.add");
+    
+    if (bus_register_event_handler(ctx, ev, "ubus.object.remove") != UBUS_STATUS_OK) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* UbusClient.connect() */
+static PyObject *UbusClient_connect(UbusClientObject *self, PyObject *args) {
+    const char *socket_path = NULL;
+    
+    if (!PyArg_ParseTuple(args, "|s", &socket_path)) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (self->connected) {
+        client_unlock(self);
+        Py_RETURN_NONE;
+    }
+    
+    /* Kept for reconnecting when the socket hangs up */
+    free(self->socket_path);
+    self->socket_path = socket_path ? strdup(socket_path) : NULL;
+    if (socket_path && !self->socket_path) {
+        client_unlock(self);
+        return PyErr_NoMemory();
+    }
+    
+    struct ubus_context *ctx;
+    Py_BEGIN_ALLOW_THREADS
+    ctx = ubus_connect(socket_path);
+    if (ctx) {
+        /* Hang-ups are noticed through sock.eof, the default handler
+         * would stop a uloop we do not run */
+        ctx->connection_lost = client_connection_lost;
+        
+        /* The handler still carries its object ID after a disconnect */
+        memset(&self->object_event, 0, sizeof(self->object_event));
+        self->object_event.cb = object_event_cb;
+        self->objects_watched = self->watch_objects && !client_watch_objects(ctx, &self->object_event);
+    }
+    Py_END_ALLOW_THREADS
+    
+    if (!ctx) {
+        client_unlock(self);
+        return raise_status(UBUS_STATUS_CONNECTION_FAILED, "Failed to connect to ubus");
+    }
+    
+    self->ctx = ctx;
+    self->connected = 1;
+    self->connection++;
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+/* UbusClient.disconnect() */
+static PyObject *UbusClient_disconnect(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    /* Joined before taking the lock, the thread may be waiting for it */
+    client_stop_io_thread(self);
+    
+    client_lock(self);
+    client_detach_async(self);
+    if (self->ctx) {
+        ubus_free(self->ctx);
+        self->ctx = NULL;
+        self->connected = 0;
+    }
+    client_clear_listeners(self);
+    client_clear_objects(self);
+    id_cache_clear(self);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+/* Objects collected by list_cb */
+struct list_result {
+    UbusClientObject *client;
+    /* fnmatch() pattern for wildcards ubusd cannot match itself, or NULL */
+    const char *pattern;
+    int signatures;
+    PyObject *objects;
+};
+
+/* Decode one method signature into {param: BLOBMSG_TYPE_*} */
+static PyObject *method_signature_to_python(struct blob_attr *method) {
+    PyObject *params = PyDict_New();
+    struct blob_attr *pos;
+    size_t rem;
+    
+    if (!params) {
+        return NULL;
+    }
+    
+    blobmsg_for_each_attr(pos, method, rem) {
+        if (blobmsg_type(pos) != BLOBMSG_TYPE_INT32) {
+            continue;
+        }
+        
+        PyObject *key = blob_key_to_python(blobmsg_name(pos));
+        PyObject *type = PyLong_FromUnsignedLong(blobmsg_get_u32(pos));
+        int ret = (key && type) ? PyDict_SetItem(params, key, type) : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(type);
+        if (ret < 0) {
+            Py_DECREF(params);
+            return NULL;
+        }
+    }
+    
+    return params;
+}
+
+/* Decode an object signature into {method: {param: BLOBMSG_TYPE_*}} */
+static PyObject *signature_to_python(struct blob_attr *signature) {
+    PyObject *methods = PyDict_New();
+    struct blob_attr *pos;
+    size_t rem;
+    
+    if (!methods || !signature) {
+        return methods;
+    }
+    
+    blob_for_each_attr(pos, signature, rem) {
+        PyObject *name = blob_key_to_python(blobmsg_name(pos));
+        PyObject *params = method_signature_to_python(pos);
+        int ret = (name && params) ? PyDict_SetItem(methods, name, params) : -1;
+        Py_XDECREF(name);
+        Py_XDECREF(params);
+        if (ret < 0) {
+            Py_DECREF(methods);
+            return NULL;
+        }
+    }
+    
+    return methods;
+}
+
+/* Lookup handler collecting every matching object */
+static void list_cb(struct ubus_context *ctx, struct ubus_object_data *obj, void *priv) {
+    struct list_result *list = (struct list_result *)priv;
+    
+    (void)ctx;
+    
+    if (list->pattern && fnmatch(list->pattern, obj->path, 0) != 0) {
+        return;
+    }
+    
+    /* The lookup already paid for the ID, let later calls skip theirs */
+    uint32_t hash = path_hash(obj->path);
+    if (list->client->shm) {
+        shm_id_publish(list->client->shm, obj->path, hash, obj->id, obj->signature);
+    }
+    if (!id_cache_find(list->client, obj->path, hash)) {
+        id_cache_insert(list->client, obj->path, hash, obj->id,
+                        obj->signature ? blob_memdup(obj->signature) : NULL);
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    if (list->objects) {
+        PyObject *entry = dict_new_presized(list->signatures ? 3 : 2);
+        PyObject *path = PyUnicode_FromString(obj->path);
+        int ret = (entry && path) ? 0 : -1;
+        
+        struct {
+            const char *key;
+            PyObject *value;
+        } fields[] = {
+            {"id", PyLong_FromUnsignedLong(obj->id)},
+            {"type_id", PyLong_FromUnsignedLong(obj->type_id)},
+            {"methods", list->signatures ? signature_to_python(obj->signature) : NULL},
+        };
+        for (int i = 0; i < (list->signatures ? 3 : 2); i++) {
+            PyObject *key = blob_key_to_python(fields[i].key);
+            if (ret < 0 || !key || !fields[i].value || PyDict_SetItem(entry, key, fields[i].value) < 0) {
+                ret = -1;
+            }
+            Py_XDECREF(key);
+            Py_XDECREF(fields[i].value);
+        }
+        
+        if (ret == 0) {
+            ret = PyDict_SetItem(list->objects, path, entry);
+        }
+        Py_XDECREF(path);
+        Py_XDECREF(entry);
+        
+        /* Drop the result so later objects are skipped and the error is raised */
+        if (ret < 0) {
+            Py_CLEAR(list->objects);
+        }
+    }
+    
+    PyGILState_Release(gstate);
+}
+
+/* UbusClient.list(path=None, *, signatures=False) */
+static PyObject *UbusClient_list(UbusClientObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) {
+    static const char *const names[] = {"path", "signatures"};
+    PyObject *out[2] = {NULL, NULL};
+    const char *path = NULL;
+    
+    if (fastcall_args("list", args, nargs, kwnames, names, 2, 1, 0, out) < 0) {
+        return NULL;
+    }
+    
+    if (out[0] && out[0] != Py_None && !(path = str_arg("list", "path", out[0]))) {
+        return NULL;
+    }
+    
+    struct list_result list = { .client = self };
+    list.signatures = out[1] ? PyObject_IsTrue(out[1]) : 0;
+    if (list.signatures < 0) {
+        return NULL;
+    }
+    
+    /* ubusd only matches a single trailing '*'. For other wildcards, look up
+     * everything under the part before the first one and filter with
+     * fnmatch(). */
+    char *prefix = NULL;
+    size_t wildcard = path ? strcspn(path, "*?[") : 0;
+    int is_pattern = path && path[wildcard];
+    if (is_pattern && (path[wildcard] != '*' || path[wildcard + 1])) {
+        list.pattern = path;
+        if (wildcard) {
+            prefix = malloc(wildcard + 2);
+            if (!prefix) {
+                return PyErr_NoMemory();
+            }
+            memcpy(prefix, path, wildcard);
+            memcpy(prefix + wildcard, "*", 2);
+        }
+        path = prefix;
+    }
+    
+    list.objects = PyDict_New();
+    if (!list.objects) {
+        free(prefix);
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (!self->connected) {
+        client_unlock(self);
+        free(prefix);
+        Py_DECREF(list.objects);
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    int ret;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_lookup(self->ctx, path, list_cb, &list);
+    Py_END_ALLOW_THREADS
+    
+    client_unlock(self);
+    free(prefix);
+    
+    if (!list.objects) {
+        return NULL;
+    }
+    
+    /* A pattern matching nothing is an empty listing, a missing object is not */
+    if (ret == UBUS_STATUS_NOT_FOUND && (is_pattern || !path)) {
+        ret = UBUS_STATUS_OK;
+    }
+    if (ret != UBUS_STATUS_OK) {
+        Py_DECREF(list.objects);
+        raise_status(ret, "ubus lookup failed: %s (%d)", status_message(ret), ret);
+        return NULL;
+    }
+    
+    return list.objects;
+}
+
+/* Resolve an object name, must be called with the context lock held */
+static PyObject *client_resolve_locked(UbusClientObject *self, const char *object_name) {
+    if (!self->connected) {
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    client_dispatch_pending(self);
+    
+    int ret;
+    struct id_cache_entry *entry = id_cache_resolve(self, object_name, &ret);
+    if (!entry) {
+        raise_call_error(ret);
+        return NULL;
+    }
+    
+    return PyLong_FromUnsignedLong(entry->id);
+}
+
+/* UbusClient.resolve() */
+static PyObject *UbusClient_resolve(UbusClientObject *self, PyObject *arg) {
+    const char *object_name = str_arg("resolve", "object", arg);
+    
+    if (!object_name) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    PyObject *result = client_resolve_locked(self, object_name);
+    client_unlock(self);
+    return result;
+}
+
+/* Take the pending Python error as a normalized exception instance */
+static PyObject *fetch_error(void) {
+    PyObject *type, *value, *tb;
+    
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    if (tb) {
+        PyException_SetTraceback(value, tb);
+    }
+    Py_XDECREF(type);
+    Py_XDECREF(tb);
+    return value;
+}
+
+/* Call target after name resolution. Set timing to have the lookup and
+ * encode phases measured. */
+struct call_target {
+    const char *object_name;
+    uint32_t id;
+    struct call_timing *timing;
+    struct blob_attr *signature;    /* Of the method, NULL if unknown */
+};
+
+/* Encode params given as JSON text, e.g. read by a script */
+static int json_to_blob(struct blob_buf *b, PyObject *params, struct blob_attr *signature) {
+#if PYUBUS_WITH_JSON
+    /* Parsed without building Python objects first */
+    const char *json = PyUnicode_AsUTF8(params);
+    
+    (void)signature;
+    
+    if (!json) {
+        return -1;
+    }
+    
+    if (!blobmsg_add_json_from_string(b, json)) {
+        PyErr_SetString(PyExc_ValueError, "params must be a JSON object");
+        return -1;
+    }
+    return 0;
+#else
+    /* Built without json-c: go through the json module */
+    PyObject *json = PyImport_ImportModule("json");
+    if (!json) {
+        return -1;
+    }
+    
+    PyObject *dict = PyObject_CallMethod(json, "loads", "(O)", params);
+    Py_DECREF(json);
+    if (!dict || !PyDict_Check(dict)) {
+        Py_XDECREF(dict);
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "params must be a JSON object");
+        return -1;
+    }
+    
+    int ret = python_dict_to_blob(b, dict, signature);
+    Py_DECREF(dict);
+    return ret;
+#endif
+}
+
+/* Resolve the object of a call and encode its params into b,
+ * must be called with the context lock held */
+static int client_prepare_call(UbusClientObject *self, PyObject *object, const char *method,
+                               PyObject *params, struct blob_buf *b, struct call_target *target) {
+    struct blob_attr *signature = NULL;
+    int64_t start = target->timing ? monotonic_ns() : 0;
+    int ret;
+    
+    if (!self->connected) {
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return -1;
+    }
+    
+    client_dispatch_pending(self);
+    
+    // Objects may be given by name or by an ID from resolve()
+    target->object_name = NULL;
+    if (PyLong_Check(object)) {
+        target->id = (uint32_t)PyLong_AsUnsignedLong(object);
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+    }
+    else if (PyUnicode_Check(object)) {
+        target->object_name = PyUnicode_AsUTF8(object);
+        if (!target->object_name) {
+            return -1;
+        }
+        
+        struct id_cache_entry *entry = id_cache_resolve(self, target->object_name, &ret);
+        if (!entry) {
+            raise_call_error(ret);
+            return -1;
+        }
+        target->id = entry->id;
+        signature = signature_method(entry->signature, method);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "object must be a name or an object ID");
+        return -1;
+    }
+    target->signature = signature;
+    
+    if (target->timing) {
+        int64_t now = monotonic_ns();
+        target->timing->ns[PHASE_LOOKUP] = now - start;
+        start = now;
+    }
+    
+    // Prepare parameters
+    blob_buf_init(b, 0);
+    
+    if (params && PyUnicode_Check(params)) {
+        if (json_to_blob(b, params, signature) < 0) {
+            return -1;
+        }
+    }
+    else if (params && params != Py_None) {
+        if (!PyDict_Check(params)) {
+            PyErr_SetString(PyExc_TypeError, "params must be a dict or a JSON object string");
+            return -1;
+        }
+        
+        if (python_dict_to_blob(b, params, signature) < 0) {
+            return -1;
+        }
+    }
+    
+    if (target->timing) {
+        target->timing->ns[PHASE_ENCODE] = monotonic_ns() - start;
+    }
+    
+    return 0;
+}
+
+#if PYUBUS_WITH_JSON
+/* Format a reply message as compact JSON with libubox, the way the ubus
+ * command does, without decoding it into Python objects first */
+static PyObject *blob_to_json(struct blob_attr *msg) {
+    char *json = blobmsg_format_json(msg, true);
+    if (!json) {
+        return PyErr_NoMemory();
+    }
+    
+    PyObject *str = PyUnicode_DecodeUTF8(json, strlen(json), "replace");
+    free(json);
+    return str;
+}
+#else
+/* Built without json-c: format the decoded reply with the json module */
+static PyObject *blob_to_json(struct blob_attr *msg) {
+    PyObject *json = PyImport_ImportModule("json");
+    if (!json) {
+        return NULL;
+    }
+    
+    PyObject *dumps = PyObject_GetAttrString(json, "dumps");
+    Py_DECREF(json);
+    if (!dumps) {
+        return NULL;
+    }
+    
+    PyObject *decoded = blob_table_to_python(blob_data(msg), blob_len(msg));
+    PyObject *kwargs = Py_BuildValue("{s:(ss),s:O}", "separators", ",", ":", "ensure_ascii", Py_False);
+    PyObject *args = decoded ? PyTuple_Pack(1, decoded) : NULL;
+    PyObject *str = args && kwargs ? PyObject_Call(dumps, args, kwargs) : NULL;
+    
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(decoded);
+    Py_DECREF(dumps);
+    return str;
+}
+#endif
+
+/* Turn a raw reply into the value returned for lazy, a REPLY_* format */
+static PyObject *reply_from_msg(struct blob_attr *msg, int lazy) {
+    switch (lazy) {
+        case REPLY_VIEW:
+            return blob_view_from_msg(msg);
+            
+        case REPLY_JSON:
+            return blob_to_json(msg);
+            
+        default:
+            return blob_table_to_python(blob_data(msg), blob_len(msg));
+    }
+}
+
+/* Callback for call(..., lazy=True) and call_json(), keeps a copy of the
+ * reply for a BlobView or formats it as JSON */
+static void call_lazy_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct call_reply *reply = (struct call_reply *)req->priv;
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    if (!PyErr_Occurred()) {
+        client_check_reply(reply->client, msg, 0, reply->timing);
+    }
+    call_keep_raw(reply, msg);
+    int64_t start = reply->timing ? monotonic_ns() : 0;
+    
+    if (!PyErr_Occurred()) {
+        PyObject *view = reply_from_msg(msg, reply->json ? REPLY_JSON : REPLY_VIEW);
+        if (view) {
+            Py_XDECREF(reply->result);
+            reply->result = view;
+        }
+    }
+    
+    if (reply->timing) {
+        reply->timing->ns[PHASE_DECODE] += monotonic_ns() - start;
+    }
+    
+    PyGILState_Release(gstate);
+}
+
+/* Turn the outcome of a synchronous invoke into the value returned to Python */
+static PyObject *call_finish(int ret, PyObject *result, int lazy) {
+    /* A reply that could not be decoded leaves the Python error set */
+    if (PyErr_Occurred()) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+    
+    if (ret != UBUS_STATUS_OK) {
+        raise_call_error(ret);
+        Py_XDECREF(result);
+        return NULL;
+    }
+    
+    if (!result && lazy == REPLY_JSON) {
+        result = PyUnicode_FromString("{}");
+    }
+    else if (!result && lazy) {
+        struct blob_buf empty = {0};
+        blob_buf_init(&empty, 0);
+        result = blob_view_from_msg(empty.head);
+        blob_buf_free(&empty);
+    }
+    else if (!result) {
+        result = PyDict_New();
+    }
+    
+    return result;
+}
+
+/* A call failed with CONNECTION_FAILED (e.g. ubusd restarted): reconnect and
+ * resolve name again for a single retry before deadline. Returns
+ * UBUS_STATUS_OK with *id and *timeout set for the retry, else the status to
+ * report. Must be called with the context lock held. */
+static int client_retry_connection(UbusClientObject *self, const char *name, uint32_t *id,
+                                   int64_t deadline, int *timeout) {
+    int ret = UBUS_STATUS_OK;
+    
+    if (deadline_remaining(deadline) < 0 || client_reconnect_locked(self) != UBUS_STATUS_OK) {
+        return UBUS_STATUS_CONNECTION_FAILED;
+    }
+    
+    if (name) {
+        struct id_cache_entry *entry = id_cache_resolve(self, name, &ret);
+        *id = entry ? entry->id : *id;
+    }
+    
+    if (ret == UBUS_STATUS_OK && (*timeout = deadline_remaining(deadline)) < 0) {
+        ret = UBUS_STATUS_TIMEOUT;
+    }
+    return ret;
+}
+
+/* Reply cache entry of a call while its TTL lasts, taken from the shared
+ * segment if this process has none, NULL on a miss. Counts the hit or miss. */
+static struct reply_cache_entry *client_cached_reply(UbusClientObject *self, uint32_t id, const char *method,
+                                                     struct blob_attr *params) {
+    uint32_t hash = reply_cache_hash(id, method, params);
+    struct reply_cache_entry *entry = reply_cache_find(self, id, method, params, hash);
+    int64_t now = monotonic_ms();
+    
+    if (entry && entry->expires <= now) {
+        reply_cache_remove(self, entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        entry = client_shared_reply(self, id, method, params, hash, now);
+    }
+    
+    if (entry) {
+        list_move(&entry->lru, &self->cache_lru);
+        self->cache_hits++;
+    }
+    else {
+        self->cache_misses++;
+    }
+    return entry;
+}
+
+/* Cache the reply of a call for ttl_ms, publishing it to the shared segment
+ * too; takes reply */
+static void client_cache_reply(UbusClientObject *self, uint32_t id, const char *method,
+                               struct blob_attr *params, struct blob_attr *reply, int ttl_ms) {
+    if (self->shm && self->shm->replies) {
+        shm_reply_publish(self->shm, id, method, params, reply, reply_cache_hash(id, method, params),
+                          monotonic_ms() + ttl_ms);
+    }
+    reply_cache_insert(self, id, method, params, reply, ttl_ms);
+}
+
+/* Perform a call, must be called with the context lock held. Retries share
+ * the timeout of the call. Unless raw is NULL it receives a copy of the raw
+ * reply on success, left NULL for an empty one. */
+static PyObject *client_call_locked(UbusClientObject *self, PyObject *object, const char *method,
+                                    PyObject *params, int timeout_ms, int lazy, struct blob_attr **raw) {
+    struct call_timing timing;
+    struct call_target target = { .timing = PYUBUS_WITH_STATS && self->stats_enabled ? &timing : NULL };
+    struct blob_buf local_buf, *b = client_buf_acquire(self, &local_buf);
+    int ret;
+    
+    if (target.timing) {
+        memset(&timing, 0, sizeof(timing));
+        timing.start = monotonic_ns();
+    }
+    
+    if (client_prepare_call(self, object, method, params, b, &target) < 0) {
+        client_buf_release(self, b);
+        return NULL;
+    }
+    
+    struct call_reply reply = { .client = self, .timing = target.timing, .json = lazy == REPLY_JSON };
+    int ttl_ms = self->cache_rules && target.object_name ?
+                 cache_rule_ttl(self, target.object_name, method) : 0;
+    
+    /* Answer from the reply cache while the TTL lasts */
+    if (ttl_ms) {
+        struct reply_cache_entry *entry = client_cached_reply(self, target.id, method, b->head);
+        
+        if (entry) {
+            client_buf_release(self, b);
+            
+            /* The limits may have been lowered since the reply was cached */
+            if (entry->reply && client_check_kept(self, entry->reply, lazy, target.timing) < 0) {
+                return NULL;
+            }
+            
+            if (raw && entry->reply && !(*raw = blob_memdup(entry->reply))) {
+                return PyErr_NoMemory();
+            }
+            
+            int64_t start = target.timing ? monotonic_ns() : 0;
+            if (entry->reply) {
+                reply.result = reply_from_msg(entry->reply, lazy);
+            }
+            if (target.timing) {
+                timing.ns[PHASE_DECODE] = monotonic_ns() - start;
+                stats_add(stats_find(self->stats, target.object_name, target.id, method, 1),
+                          &timing, PyErr_Occurred() != NULL);
+            }
+            return call_finish(UBUS_STATUS_OK, reply.result, lazy);
+        }
+    }
+    reply.keep_raw = ttl_ms || raw;
+    
+    // Make the call
+    ubus_data_handler_t cb = lazy ? call_lazy_cb : call_cb;
+    int64_t deadline = deadline_after(timeout_ms);
+    int timeout;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_invoke(self->ctx, target.id, method, b->head, cb, &reply, timeout_ms);
+    Py_END_ALLOW_THREADS
+    
+    /* A cached ID may belong to an object that has since been re-registered;
+     * retry once if it now resolves somewhere else. */
+    if (ret == UBUS_STATUS_NOT_FOUND && target.object_name && !PyErr_Occurred() &&
+        (timeout = deadline_remaining(deadline)) >= 0) {
+        uint32_t moved_id = id_cache_recheck(self, target.object_name, target.id);
+        if (moved_id) {
+            target.id = moved_id;
+            Py_BEGIN_ALLOW_THREADS
+            ret = bus_invoke(self->ctx, target.id, method, b->head, cb, &reply, timeout);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    
+    /* The socket hung up (e.g. ubusd restarted): reconnect and retry once */
+    if (ret == UBUS_STATUS_CONNECTION_FAILED && !PyErr_Occurred() &&
+        (ret = client_retry_connection(self, target.object_name, &target.id, deadline, &timeout)) == UBUS_STATUS_OK) {
+        Py_BEGIN_ALLOW_THREADS
+        ret = bus_invoke(self->ctx, target.id, method, b->head, cb, &reply, timeout);
+        Py_END_ALLOW_THREADS
+    }
+    
+    if (ret != UBUS_STATUS_OK || PyErr_Occurred()) {
+        free(reply.raw);
+    }
+    else if (ttl_ms) {
+        if (raw && reply.raw && !(*raw = blob_memdup(reply.raw))) {
+            PyErr_NoMemory();
+        }
+        client_cache_reply(self, target.id, method, b->head, reply.raw, ttl_ms);
+    }
+    else if (raw) {
+        *raw = reply.raw;
+    }
+    
+    client_buf_release(self, b);
+    
+    if (target.timing) {
+        stats_add(stats_find(self->stats, target.object_name, target.id, method, 1),
+                  &timing, ret != UBUS_STATUS_OK || PyErr_Occurred());
+    }
+    
+    return call_finish(ret, reply.result, lazy);
+}
+
+/* Events that arrive while a synchronous call waits for its reply are queued
+ * by libubus and only dispatched the next time the socket is handled, which
+ * an event loop waiting for the socket to become readable would not do.
+ * Must be called with the context lock held. */
+static void client_schedule_pending(UbusClientObject *self) {
+    if (!self->loop || !self->connected || list_empty(&self->ctx->pending)) {
+        return;
+    }
+    
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    
+    PyObject *handler = PyObject_GetAttrString((PyObject *)self, "process_events");
+    if (handler) {
+        PyObject *ret = PyObject_CallMethod(self->loop, "call_soon_threadsafe", "O", handler);
+        Py_XDECREF(ret);
+        Py_DECREF(handler);
+    }
+    PyErr_Clear();
+    
+    PyErr_Restore(type, value, tb);
+}
+
+/* Makes the call of a flight for the thread that asked first */
+typedef PyObject *(*flight_lead_fn)(void *owner, PyObject *object, const char *method, PyObject *params,
+                                    int timeout_ms, int lazy, struct blob_attr **raw);
+
+/* Free a flight once the call landed and its last waiter left, must be
+ * called with the GIL held */
+static void flight_free(struct flight *f) {
+    free(f->reply);
+    Py_XDECREF(f->error);
+    free(f);
+}
+
+/* Hand the outcome of a call to the threads waiting on its flight, takes raw */
+static void flight_land(struct flight_table *t, struct flight *f, PyObject *result, struct blob_attr *raw) {
+    PyObject *error = NULL;
+    
+    if (!result) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        PyErr_NormalizeException(&type, &value, &tb);
+        Py_XINCREF(value);
+        error = value;
+        PyErr_Restore(type, value, tb);
+    }
+    
+    pthread_mutex_lock(&t->lock);
+    struct flight **prev = &t->head;
+    while (*prev != f) {
+        prev = &(*prev)->next;
+    }
+    *prev = f->next;
+    
+    f->done = 1;
+    f->reply = result ? raw : NULL;
+    f->error = error;
+    pthread_cond_broadcast(&t->landed);
+    int last = f->waiters == 0;
+    pthread_mutex_unlock(&t->lock);
+    
+    if (!result) {
+        free(raw);
+    }
+    if (last) {
+        flight_free(f);
+    }
+}
+
+/* New instance of an exception with the same type and args, and the status
+ * of a UbusError, falling back to the instance itself if that fails */
+static PyObject *exception_copy(PyObject *exc) {
+    PyObject *args = PyObject_GetAttrString(exc, "args");
+    PyObject *copy = args ? PyObject_Call((PyObject *)Py_TYPE(exc), args, NULL) : NULL;
+    Py_XDECREF(args);
+    
+    if (!copy || !PyExceptionInstance_Check(copy)) {
+        PyErr_Clear();
+        Py_XDECREF(copy);
+        Py_INCREF(exc);
+        return exc;
+    }
+    
+    if (PyObject_TypeCheck(exc, &UbusErrorType)) {
+        PyObject *status = ((UbusErrorObject *)exc)->status;
+        Py_XINCREF(status);
+        Py_XSETREF(((UbusErrorObject *)copy)->status, status);
+    }
+    return copy;
+}
+
+/* Wait up to timeout_ms (0 for no limit) for the call of a flight and decode
+ * its reply, into a record if record is set, or raise what it failed with */
+static PyObject *flight_wait(struct flight_table *t, struct flight *f, UbusClientObject *limits,
+                             const struct record_layout *record, int timeout_ms, int lazy) {
+    struct timespec deadline;
+    PyObject *result = NULL;
+    int done;
+    
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&t->lock);
+    while (!f->done) {
+        if (!timeout_ms) {
+            pthread_cond_wait(&t->landed, &t->lock);
+        }
+        else if (pthread_cond_timedwait(&t->landed, &t->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    done = f->done;
+    pthread_mutex_unlock(&t->lock);
+    Py_END_ALLOW_THREADS
+    
+    if (!done) {
+        raise_call_error(UBUS_STATUS_TIMEOUT);
+    }
+    else if (f->error) {
+        /* Raising one instance on several threads would share its traceback */
+        PyObject *exc = exception_copy(f->error);
+        if (exc) {
+            PyErr_SetObject((PyObject *)Py_TYPE(exc), exc);
+            Py_DECREF(exc);
+        }
+    }
+    else {
+        /* Every waiter decodes its own copy so none of them share objects */
+        if (f->reply && client_check_kept(limits, f->reply, lazy, NULL) == 0) {
+            result = record ? blob_table_to_record(record, blob_data(f->reply), blob_len(f->reply)) :
+                     reply_from_msg(f->reply, lazy);
+        }
+        else if (!f->reply && record) {
+            result = blob_table_to_record(record, NULL, 0);
+        }
+        result = call_finish(UBUS_STATUS_OK, result, lazy);
+    }
+    
+    pthread_mutex_lock(&t->lock);
+    int last = --f->waiters == 0 && f->done;
+    pthread_mutex_unlock(&t->lock);
+    
+    if (last) {
+        flight_free(f);
+    }
+    return result;
+}
+
+/* Make a call through a flight table under a key built by the caller, freed
+ * here; without a key the call is made alone. Waiters decode the shared reply
+ * into record if it is set. */
+static PyObject *flight_run(struct flight_table *t, char *key, size_t len, flight_lead_fn lead, void *owner,
+                            unsigned long *coalesced, UbusClientObject *limits, const struct record_layout *record,
+                            PyObject *object, const char *method, PyObject *params, int timeout_ms, int lazy) {
+    if (!key) {
+        return lead(owner, object, method, params, timeout_ms, lazy, NULL);
+    }
+    
+    uint32_t hash = bytes_hash(2166136261u, key, len);
+    unsigned long thread = PyThread_get_thread_ident();
+    struct flight *f;
+    
+    pthread_mutex_lock(&t->lock);
+    for (f = t->head; f; f = f->next) {
+        /* A callback of the leader repeating its call would wait on itself */
+        if (f->hash == hash && f->key_len == len && !memcmp(f->key, key, len) && f->leader != thread) {
+            break;
+        }
+    }
+    
+    if (f) {
+        f->waiters++;
+        pthread_mutex_unlock(&t->lock);
+        free(key);
+        (*coalesced)++;
+        return flight_wait(t, f, limits, record, timeout_ms, lazy);
+    }
+    
+    f = malloc(sizeof(*f) + len);
+    if (f) {
+        memset(f, 0, sizeof(*f));
+        f->hash = hash;
+        f->leader = thread;
+        f->key_len = len;
+        memcpy(f->key, key, len);
+        f->next = t->head;
+        t->head = f;
+    }
+    pthread_mutex_unlock(&t->lock);
+    free(key);
+    
+    struct blob_attr *raw = NULL;
+    PyObject *result = lead(owner, object, method, params, timeout_ms, lazy, f ? &raw : NULL);
+    if (f) {
+        flight_land(t, f, result, raw);
+    }
+    return result;
+}
+
+/* Make a call through a flight table: wait for and share the reply of an
+ * identical call already in flight, or make it and let later callers wait on
+ * it. timeout_ms is resolved, 0 for no limit. Waiters check the shared reply
+ * against the reply limits of the client limits. */
+static PyObject *flight_call(struct flight_table *t, flight_lead_fn lead, void *owner, unsigned long *coalesced,
+                             UbusClientObject *limits, PyObject *object, const char *method, PyObject *params,
+                             int timeout_ms, int lazy) {
+    struct blob_buf b = {0};
+    const char *name = NULL;
+    uint32_t id = 0;
+    char *key = NULL;
+    size_t len = 0;
+    
+    /* Params are encoded without a signature just for the key; arguments the
+     * call itself would reject are left for it to report */
+    if (PyUnicode_Check(object)) {
+        name = PyUnicode_AsUTF8(object);
+    }
+    else if (PyLong_Check(object)) {
+        id = (uint32_t)PyLong_AsUnsignedLong(object);
+    }
+    
+    blob_buf_init(&b, 0);
+    if ((name || PyLong_Check(object)) && !PyErr_Occurred() &&
+        (!params || params == Py_None || (PyDict_Check(params) && python_dict_to_blob(&b, params, NULL) == 0))) {
+        key = coalesce_key(name, id, method, b.head, &len);
+    }
+    blob_buf_free(&b);
+    PyErr_Clear();
+    
+    return flight_run(t, key, len, lead, owner, coalesced, limits, NULL, object, method, params, timeout_ms, lazy);
+}
+
+/* Make a call on a client, taking its context lock; a flight_lead_fn */
+static PyObject *client_lead_call(void *owner, PyObject *object, const char *method, PyObject *params,
+                                  int timeout_ms, int lazy, struct blob_attr **raw) {
+    UbusClientObject *self = (UbusClientObject *)owner;
+    
+    client_lock(self);
+    if (timeout_ms < 0) {
+        timeout_ms = self->timeout_ms;
+    }
+    PyObject *result = client_call_locked(self, object, method, params, timeout_ms, lazy, raw);
+    client_schedule_pending(self);
+    client_unlock(self);
+    return result;
+}
+
+/* UbusClient.call() */
+static PyObject *UbusClient_call(UbusClientObject *self, PyObject *const *args,
+                                 Py_ssize_t nargs, PyObject *kwnames) {
+    const char *method;
+    PyObject *object, *params;
+    int timeout_ms = -1;
+    int lazy;
+    
+    if (parse_call_args("call", args, nargs, kwnames, &object, &method, &params, &timeout_ms, &lazy) < 0) {
+        return NULL;
+    }
+    
+    /* A handler running under the context lock would wait on a leader
+     * that needs the lock, it makes its own call instead */
+    if (self->coalesce && !client_lock_owned(self)) {
+        return flight_call(&self->flights, client_lead_call, self, &self->coalesced, self, object, method, params,
+                           timeout_ms < 0 ? self->timeout_ms : timeout_ms, lazy);
+    }
+    return client_lead_call(self, object, method, params, timeout_ms, lazy, NULL);
+}
+
+/* UbusClient.call_json() */
+static PyObject *UbusClient_call_json(UbusClientObject *self, PyObject *const *args,
+                                      Py_ssize_t nargs, PyObject *kwnames) {
+    const char *method;
+    PyObject *object, *params;
+    int timeout_ms = -1;
+    
+    if (parse_call_args("call_json", args, nargs, kwnames, &object, &method, &params, &timeout_ms, NULL) < 0) {
+        return NULL;
+    }
+    
+    if (self->coalesce && !client_lock_owned(self)) {
+        return flight_call(&self->flights, client_lead_call, self, &self->coalesced, self, object, method, params,
+                           timeout_ms < 0 ? self->timeout_ms : timeout_ms, REPLY_JSON);
+    }
+    return client_lead_call(self, object, method, params, timeout_ms, REPLY_JSON, NULL);
+}
+
+/* Handle returned by UbusClient.prepare() */
+typedef struct {
+    PyObject_HEAD
+#if PY_VERSION_HEX >= 0x03090000
+    vectorcallfunc vectorcall;
+#endif
+    UbusClientObject *client;
+    PyObject *object;           /* name or ID as given to prepare() */
+    const char *object_name;    /* NULL if prepared with an ID */
+    char *method;
+    uint32_t id;
+    unsigned int connection;
+    struct blob_attr *params;   /* pre-encoded params */
+    ubus_data_handler_t cb;
+    int timeout_ms;             /* -1 for the client's timeout */
+    int lazy;
+    /* Compiled by prepare(record=..., typed=...), NULL otherwise */
+    struct record_layout *record;
+    struct param_spec *specs;
+    int typed;
+} PreparedCallObject;
+
+static PyTypeObject PreparedCallType;
+
+/* Re-resolve the object of a handle, must be called with the context lock held */
+static int prepared_resolve(PreparedCallObject *self) {
+    UbusClientObject *client = self->client;
+    int ret;
+    
+    self->connection = client->connection;
+    if (!self->object_name) {
+        return 0;
+    }
+    
+    struct id_cache_entry *entry = id_cache_resolve(client, self->object_name, &ret);
+    if (!entry) {
+        raise_call_error(ret);
+        return -1;
+    }
+    
+    self->id = entry->id;
+    return 0;
+}
+
+/* Call a handle with encoded params, must be called with the context lock
+ * held. Goes through the reply cache like call(); unless raw is NULL it
+ * receives a copy of the raw reply on success. */
+static PyObject *prepared_call_locked(PreparedCallObject *self, struct blob_attr *params, struct blob_attr **raw) {
+    UbusClientObject *client = self->client;
+    struct call_timing timing;
+    struct call_reply reply = { .client = client, .record = self->record,
+                                .timing = PYUBUS_WITH_STATS && client->stats_enabled ? &timing : NULL };
+    int timeout_ms = self->timeout_ms >= 0 ? self->timeout_ms : client->timeout_ms;
+    int timeout;
+    int ret;
+    
+    if (!client->connected) {
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    if (reply.timing) {
+        memset(&timing, 0, sizeof(timing));
+        timing.start = monotonic_ns();
+    }
+    
+    client_dispatch_pending(client);
+    
+    /* Object IDs do not survive a reconnect */
+    if (self->connection != client->connection) {
+        int64_t start = reply.timing ? monotonic_ns() : 0;
+        if (prepared_resolve(self) < 0) {
+            return NULL;
+        }
+        if (reply.timing) {
+            timing.ns[PHASE_LOOKUP] = monotonic_ns() - start;
+        }
+    }
+    
+    int ttl_ms = client->cache_rules && self->object_name ?
+                 cache_rule_ttl(client, self->object_name, self->method) : 0;
+    
+    if (ttl_ms) {
+        struct reply_cache_entry *entry = client_cached_reply(client, self->id, self->method, params);
+        
+        if (entry) {
+            int64_t start = reply.timing ? monotonic_ns() : 0;
+            
+            /* The limits may have been lowered since the reply was cached */
+            if (entry->reply && client_check_kept(client, entry->reply, self->lazy, reply.timing) == 0) {
+                if (raw && !(*raw = blob_memdup(entry->reply))) {
+                    PyErr_NoMemory();
+                }
+                else {
+                    reply.result = self->record ?
+                                   blob_table_to_record(self->record, blob_data(entry->reply),
+                                                        blob_len(entry->reply)) :
+                                   reply_from_msg(entry->reply, self->lazy);
+                }
+            }
+            if (reply.timing) {
+                timing.ns[PHASE_DECODE] = monotonic_ns() - start;
+            }
+            ret = UBUS_STATUS_OK;
+            goto finish;
+        }
+    }
+    reply.keep_raw = ttl_ms || raw;
+    
+    int64_t deadline = deadline_after(timeout_ms);
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_invoke(client->ctx, self->id, self->method, params, self->cb, &reply, timeout_ms);
+    Py_END_ALLOW_THREADS
+    
+    /* Same recovery as call() when the object was re-registered */
+    if (ret == UBUS_STATUS_NOT_FOUND && self->object_name && !PyErr_Occurred() &&
+        (timeout = deadline_remaining(deadline)) >= 0) {
+        uint32_t moved_id = id_cache_recheck(client, self->object_name, self->id);
+        
+        if (moved_id) {
+            self->id = moved_id;
+            Py_BEGIN_ALLOW_THREADS
+            ret = bus_invoke(client->ctx, self->id, self->method, params, self->cb, &reply, timeout);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    
+    /* And when the socket hung up */
+    if (ret == UBUS_STATUS_CONNECTION_FAILED && !PyErr_Occurred() &&
+        (ret = client_retry_connection(client, self->object_name, &self->id, deadline, &timeout)) == UBUS_STATUS_OK) {
+        self->connection = client->connection;
+        Py_BEGIN_ALLOW_THREADS
+        ret = bus_invoke(client->ctx, self->id, self->method, params, self->cb, &reply, timeout);
+        Py_END_ALLOW_THREADS
+    }
+    
+    if (ret != UBUS_STATUS_OK || PyErr_Occurred()) {
+        free(reply.raw);
+    }
+    else if (ttl_ms) {
+        if (raw && reply.raw && !(*raw = blob_memdup(reply.raw))) {
+            PyErr_NoMemory();
+        }
+        client_cache_reply(client, self->id, self->method, params, reply.raw, ttl_ms);
+    }
+    else if (raw) {
+        *raw = reply.raw;
+    }
+    
+finish:
+    if (ret == UBUS_STATUS_OK && !reply.result && self->record && !PyErr_Occurred()) {
+        reply.result = blob_table_to_record(self->record, NULL, 0);
+    }
+    
+    if (reply.timing) {
+        stats_add(stats_find(client->stats, self->object_name, self->id, self->method, 1),
+                  &timing, ret != UBUS_STATUS_OK || PyErr_Occurred());
+    }
+    
+    return call_finish(ret, reply.result, self->lazy);
+}
+
+/* Encode params for a typed or record handle with its compiled signature */
+static int prepared_encode(PreparedCallObject *self, struct blob_buf *b, PyObject *params) {
+    static const struct param_spec no_specs[1];
+    
+    blob_buf_init(b, 0);
+    
+    if (!PyDict_Check(params)) {
+        PyErr_SetString(PyExc_TypeError, "params must be a dict");
+        return -1;
+    }
+    return python_dict_to_blob_specs(b, params, self->specs ? self->specs : no_specs, self->method, self->typed);
+}
+
+/* A prepared call and the encoded params it is made with, the owner of its
+ * flight when calls are coalesced */
+struct prepared_flight {
+    PreparedCallObject *call;
+    struct blob_attr *params;
+};
+
+/* Make a prepared call, taking the context lock; a flight_lead_fn */
+static PyObject *prepared_lead_call(void *owner, PyObject *object, const char *method, PyObject *params,
+                                    int timeout_ms, int lazy, struct blob_attr **raw) {
+    struct prepared_flight *pf = (struct prepared_flight *)owner;
+    UbusClientObject *client = pf->call->client;
+    
+    (void)object;
+    (void)method;
+    (void)params;
+    (void)timeout_ms;
+    (void)lazy;
+    
+    client_lock(client);
+    PyObject *result = prepared_call_locked(pf->call, pf->params, raw);
+    client_schedule_pending(client);
+    client_unlock(client);
+    return result;
+}
+
+/* Call a handle, with params overriding the prepared ones unless NULL or None */
+static PyObject *prepared_call(PreparedCallObject *self, PyObject *params) {
+    UbusClientObject *client = self->client;
+    int timeout_ms = self->timeout_ms >= 0 ? self->timeout_ms : client->timeout_ms;
+    PyObject *result;
+    
+    if (params == Py_None) {
+        params = NULL;
+    }
+    
+    /* Plain params are encoded on every call, just as call() does */
+    if (params && !self->record && !self->typed) {
+        if (client->coalesce && !client_lock_owned(client)) {
+            return flight_call(&client->flights, client_lead_call, client, &client->coalesced, client,
+                               self->object, self->method, params, timeout_ms, self->lazy);
+        }
+        return client_lead_call(client, self->object, self->method, params, timeout_ms, self->lazy, NULL);
+    }
+    
+    /* Identical calls share a flight keyed on the encoded params */
+    if (client->coalesce && !client_lock_owned(client)) {
+        struct prepared_flight pf = { .call = self, .params = self->params };
+        struct blob_buf b = {0};
+        size_t len = 0;
+        
+        if (params) {
+            if (prepared_encode(self, &b, params) < 0) {
+                blob_buf_free(&b);
+                return NULL;
+            }
+            pf.params = b.head;
+        }
+        
+        char *key = coalesce_key(self->object_name, self->id, self->method, pf.params, &len);
+        result = flight_run(&client->flights, key, len, prepared_lead_call, &pf, &client->coalesced, client,
+                            self->record, self->object, self->method, NULL, timeout_ms, self->lazy);
+        blob_buf_free(&b);
+        return result;
+    }
+    
+    client_lock(client);
+    if (params) {
+        struct blob_buf local_buf, *b = client_buf_acquire(client, &local_buf);
+        result = prepared_encode(self, b, params) < 0 ? NULL : prepared_call_locked(self, b->head, NULL);
+        client_buf_release(client, b);
+    }
+    else {
+        result = prepared_call_locked(self, self->params, NULL);
+    }
+    client_schedule_pending(client);
+    client_unlock(client);
+    return result;
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+/* PreparedCall.__call__ through vectorcall */
+static PyObject *PreparedCall_vectorcall(PyObject *callable, PyObject *const *args,
+                                         size_t nargsf, PyObject *kwnames) {
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    
+    if ((kwnames && PyTuple_GET_SIZE(kwnames)) || nargs > 1) {
+        PyErr_SetString(PyExc_TypeError, "prepared calls take at most one positional argument (params)");
+        return NULL;
+    }
+    
+    return prepared_call((PreparedCallObject *)callable, nargs ? args[0] : NULL);
+}
+#endif
+
+/* PreparedCall.__call__ */
+static PyObject *PreparedCall_call(PreparedCallObject *self, PyObject *args, PyObject *kwargs) {
+    PyObject *params = NULL;
+    
+    if ((kwargs && PyDict_Size(kwargs)) || PyTuple_GET_SIZE(args) > 1) {
+        PyErr_SetString(PyExc_TypeError, "prepared calls take at most one positional argument (params)");
+        return NULL;
+    }
+    
+    if (PyTuple_GET_SIZE(args)) {
+        params = PyTuple_GET_ITEM(args, 0);
+    }
+    return prepared_call(self, params);
+}
+
+/* PreparedCall.__repr__ */
+static PyObject *PreparedCall_repr(PreparedCallObject *self) {
+    return PyUnicode_FromFormat("<PreparedCall %R.%s>", self->object, self->method);
+}
+
+/* PreparedCall.__dealloc__ */
+static void PreparedCall_dealloc(PreparedCallObject *self) {
+    Py_XDECREF(self->client);
+    Py_XDECREF(self->object);
+    free(self->method);
+    free(self->params);
+    record_layout_free(self->record);
+    param_specs_free(self->specs);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* PreparedCall type definition */
+static PyTypeObject PreparedCallType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.PreparedCall",
+    .tp_doc = "Callable handle for a prepared (object, method) call",
+    .tp_basicsize = sizeof(PreparedCallObject),
+    .tp_itemsize = 0,
+#if PY_VERSION_HEX >= 0x03090000
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+    .tp_vectorcall_offset = offsetof(PreparedCallObject, vectorcall),
+#else
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+#endif
+    .tp_dealloc = (destructor)PreparedCall_dealloc,
+    .tp_repr = (reprfunc)PreparedCall_repr,
+    .tp_call = (ternaryfunc)PreparedCall_call,
+};
+
+/* UbusClient.prepare(object, method, params=None, *, timeout=None, lazy=False,
+ *                    record=None, typed=False) */
+static PyObject *UbusClient_prepare(UbusClientObject *self, PyObject *const *args,
+                                    Py_ssize_t nargs, PyObject *kwnames) {
+    static const char *const names[] = {"object", "method", "params", "timeout", "lazy", "record", "typed"};
+    PyObject *out[7] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    const char *method;
+    PyObject *object, *params;
+    int timeout_ms = -1;
+    int lazy;
+    
+    if (fastcall_args("prepare", args, nargs, kwnames, names, 7, 3, 2, out) < 0 ||
+        convert_call_args("prepare", out, &object, &method, &params, &timeout_ms, &lazy) < 0) {
+        return NULL;
+    }
+    
+    int typed = out[6] ? PyObject_IsTrue(out[6]) : 0;
+    if (typed < 0) {
+        return NULL;
+    }
+    
+    int record = out[5] && out[5] != Py_None;
+    if (record && lazy) {
+        PyErr_SetString(PyExc_ValueError, "prepare() cannot decode into a record lazily");
+        return NULL;
+    }
+    
+    PreparedCallObject *handle = PyObject_New(PreparedCallObject, &PreparedCallType);
+    if (!handle) {
+        return NULL;
+    }
+    
+#if PY_VERSION_HEX >= 0x03090000
+    handle->vectorcall = PreparedCall_vectorcall;
+#endif
+    handle->client = self;
+    Py_INCREF(self);
+    handle->object = object;
+    Py_INCREF(object);
+    handle->method = strdup(method);
+    handle->params = NULL;
+    handle->timeout_ms = timeout_ms;
+    handle->lazy = lazy;
+    handle->cb = lazy ? call_lazy_cb : call_cb;
+    handle->record = NULL;
+    handle->specs = NULL;
+    handle->typed = typed;
+    
+    if (!handle->method) {
+        Py_DECREF(handle);
+        return PyErr_NoMemory();
+    }
+    
+    /* Replies carry no signature, the caller names the fields to keep */
+    if (record && !(handle->record = record_layout_new(out[5]))) {
+        Py_DECREF(handle);
+        return NULL;
+    }
+    
+    // Resolve and encode once, the same way call() would
+    struct call_target target = { .timing = NULL };
+    struct blob_buf local_buf, *b;
+    
+    client_lock(self);
+    b = client_buf_acquire(self, &local_buf);
+    
+    if (client_prepare_call(self, object, method, params, b, &target) < 0) {
+        client_buf_release(self, b);
+        client_unlock(self);
+        Py_DECREF(handle);
+        return NULL;
+    }
+    
+    /* Compile the signature once; typed handles also check the prepared params */
+    if (typed && !target.signature) {
+        PyErr_Format(PyExc_ValueError, "no signature known for %R %s() to type its params", object, method);
+    }
+    else if ((typed || record) && target.signature) {
+        handle->specs = param_specs_new(target.signature);
+        if (handle->specs && typed && params && params != Py_None) {
+            prepared_encode(handle, b, params);
+        }
+    }
+    
+    if (PyErr_Occurred()) {
+        client_buf_release(self, b);
+        client_unlock(self);
+        Py_DECREF(handle);
+        return NULL;
+    }
+    
+    handle->object_name = target.object_name;
+    handle->id = target.id;
+    handle->connection = self->connection;
+    handle->params = blob_memdup(b->head);
+    
+    client_buf_release(self, b);
+    client_unlock(self);
+    
+    if (!handle->params) {
+        Py_DECREF(handle);
+        return PyErr_NoMemory();
+    }
+    
+    return (PyObject *)handle;
+}
+
+/* In-flight request started by call_async() */
+struct async_request {
+    struct ubus_request req;
+    struct list_head list;
+    UbusClientObject *client;
+    PyObject *future;
+    PyObject *result;
+    PyObject *timer;            /* asyncio handle of the timeout, or NULL */
+    struct call_stats *stats;   /* Set when the call is timed */
+    struct call_timing timing;
+    /* With coalesce set identical calls follow the request instead of
+     * sending their own, and get their results from a copy of the reply */
+    char *key;
+    size_t key_len;
+    PyObject *followers;        /* List of their futures, or NULL */
+    struct blob_attr *raw;
+};
+
+/* Get a zeroed async request, reusing a pooled one if possible.
+ * Must be called with the context lock held. */
+static struct async_request *async_request_alloc(UbusClientObject *self) {
+    if (list_empty(&self->async_pool)) {
+        return calloc(1, sizeof(struct async_request));
+    }
+    
+    struct async_request *ar = list_first_entry(&self->async_pool, struct async_request, list);
+    list_del(&ar->list);
+    self->async_pool_size--;
+    memset(ar, 0, sizeof(*ar));
+    return ar;
+}
+
+/* Return an async request to the pool, must be called with the context lock held */
+static void async_request_release(UbusClientObject *self, struct async_request *ar) {
+    if (self->async_pool_size >= ASYNC_POOL_SIZE) {
+        free(ar);
+        return;
+    }
+    
+    list_add(&ar->list, &self->async_pool);
+    self->async_pool_size++;
+}
+
+/* Free the pooled async requests */
+static void client_clear_async_pool(UbusClientObject *self) {
+    struct async_request *ar, *tmp;
+    
+    list_for_each_entry_safe(ar, tmp, &self->async_pool, list) {
+        list_del(&ar->list);
+        free(ar);
+    }
+    self->async_pool_size = 0;
+}
+
+/* asyncio.get_running_loop, imported on first use */
+static PyObject *asyncio_get_running_loop = NULL;
+
+/* Hand a value to the future of an async request */
+static void future_settle(UbusClientObject *self, PyObject *future, PyObject *value, int is_error) {
+    PyObject *done = PyObject_CallMethod(future, "done", NULL);
+    
+    if (!done) {
+        PyErr_WriteUnraisable(future);
+        return;
+    }
+    
+    /* e.g. cancelled by asyncio.wait_for() */
+    if (done == Py_True) {
+        Py_DECREF(done);
+        return;
+    }
+    Py_DECREF(done);
+    
+    const char *setter = is_error ? "set_exception" : "set_result";
+    PyObject *ret;
+    
+    /* Replies can also be dispatched by a synchronous call() running in
+     * another thread; asyncio futures may only be touched from their loop */
+    if (self->loop && PyThread_get_thread_ident() != self->loop_thread) {
+        PyObject *method = PyObject_GetAttrString(future, setter);
+        ret = method ? PyObject_CallMethod(self->loop, "call_soon_threadsafe", "OO", method, value) : NULL;
+        Py_XDECREF(method);
+    }
+    else {
+        ret = PyObject_CallMethod(future, setter, "O", value);
+    }
+    
+    if (!ret) {
+        PyErr_WriteUnraisable(future);
+    }
+    Py_XDECREF(ret);
+}
+
+/* Hand the outcome of an async request to its future and its followers' */
+static void async_settle(struct async_request *ar, PyObject *value, int is_error) {
+    future_settle(ar->client, ar->future, value, is_error);
+    
+    for (Py_ssize_t i = 0; ar->followers && i < PyList_GET_SIZE(ar->followers); i++) {
+        PyObject *future = PyList_GET_ITEM(ar->followers, i);
+        
+        if (is_error) {
+            future_settle(ar->client, future, value, 1);
+            continue;
+        }
+        
+        /* Every follower decodes its own copy so none of them share objects */
+        PyObject *result = ar->raw ? blob_table_to_python(blob_data(ar->raw), blob_len(ar->raw)) : PyDict_New();
+        if (result) {
+            future_settle(ar->client, future, result, 0);
+            Py_DECREF(result);
+        }
+        else {
+            PyObject *exc = fetch_error();
+            future_settle(ar->client, future, exc, 1);
+            Py_XDECREF(exc);
+        }
+    }
+}
+
+/* Attach a future to an identical async request in flight, returns 0 if it
+ * was attached. Must be called with the context lock held. */
+static int async_request_follow(UbusClientObject *self, const char *key, size_t key_len, PyObject *future) {
+    struct async_request *ar;
+    
+    list_for_each_entry(ar, &self->async_requests, list) {
+        if (!ar->key || ar->key_len != key_len || memcmp(ar->key, key, key_len)) {
+            continue;
+        }
+        
+        if ((!ar->followers && !(ar->followers = PyList_New(0))) ||
+            PyList_Append(ar->followers, future) < 0) {
+            PyErr_Clear();
+            return -1;
+        }
+        self->coalesced++;
+        return 0;
+    }
+    return -1;
+}
+
+/* Drop what an async request holds once its future is settled, must be
+ * called with the context lock held */
+static void async_request_done(struct async_request *ar) {
+    UbusClientObject *client = ar->client;
+    
+    if (ar->timer) {
+        PyObject *cancel = PyObject_GetAttrString(ar->timer, "cancel");
+        PyObject *ret = NULL;
+        
+        /* Timer handles belong to their loop like futures do */
+        if (cancel && client->loop && PyThread_get_thread_ident() != client->loop_thread) {
+            ret = PyObject_CallMethod(client->loop, "call_soon_threadsafe", "O", cancel);
+        }
+        else if (cancel) {
+            ret = PyObject_CallObject(cancel, NULL);
+        }
+        Py_XDECREF(ret);
+        Py_XDECREF(cancel);
+        PyErr_Clear();
+        Py_DECREF(ar->timer);
+    }
+    
+    Py_XDECREF(ar->result);
+    Py_DECREF(ar->future);
+    Py_XDECREF(ar->followers);
+    free(ar->key);
+    free(ar->raw);
+    async_request_release(client, ar);
+    Py_DECREF(client);
+}
+
+/* Timer callback failing an async request that ran out of time, bound to
+ * a (client, future) tuple */
+static PyObject *async_expire(PyObject *bound, PyObject *unused) {
+    UbusClientObject *client = (UbusClientObject *)PyTuple_GET_ITEM(bound, 0);
+    PyObject *future = PyTuple_GET_ITEM(bound, 1);
+    struct async_request *ar;
+    
+    (void)unused;
+    
+    client_lock(client);
+    list_for_each_entry(ar, &client->async_requests, list) {
+        if (ar->future != future || !client->ctx) {
+            continue;
+        }
+        
+        ubus_abort_request(client->ctx, &ar->req);
+        list_del(&ar->list);
+        Py_CLEAR(ar->timer);
+        stats_add(ar->stats, &ar->timing, 1);
+        
+        PyObject *exc = call_error(UBUS_STATUS_TIMEOUT);
+        if (exc) {
+            async_settle(ar, exc, 1);
+            Py_DECREF(exc);
+        }
+        PyErr_Clear();
+        async_request_done(ar);
+        break;
+    }
+    client_unlock(client);
+    
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef async_expire_def = {
+    "expire", (PyCFunction)async_expire, METH_NOARGS, NULL
+};
+
+/* Data callback for async requests */
+static void async_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct async_request *ar = container_of(req, struct async_request, req);
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    int64_t start = ar->stats ? monotonic_ns() : 0;
+    
+    /* A decode error is kept to report it through the future */
+    PyObject *decoded = client_check_reply(ar->client, msg, 1, ar->stats ? &ar->timing : NULL) < 0 ? NULL :
+                        blob_table_to_python(blob_data(msg), blob_len(msg));
+    Py_XDECREF(ar->result);
+    ar->result = decoded ? decoded : fetch_error();
+    
+    if (ar->key && decoded) {
+        free(ar->raw);
+        if (!(ar->raw = blob_memdup(msg))) {
+            PyErr_NoMemory();
+            Py_DECREF(ar->result);
+            ar->result = fetch_error();
+        }
+    }
+    
+    if (ar->stats) {
+        ar->timing.ns[PHASE_DECODE] += monotonic_ns() - start;
+    }
+    
+    PyGILState_Release(gstate);
+}
+
+/* Completion callback for async requests */
+static void async_complete_cb(struct ubus_request *req, int ret) {
+    struct async_request *ar = container_of(req, struct async_request, req);
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    list_del(&ar->list);
+    
+    if (ret == UBUS_STATUS_NOT_FOUND) {
+        id_cache_suspect_id(ar->client, ar->req.peer);
+    }
+    
+    stats_add(ar->stats, &ar->timing,
+              ret != UBUS_STATUS_OK || (ar->result && PyExceptionInstance_Check(ar->result)));
+    
+    if (ar->result && PyExceptionInstance_Check(ar->result)) {
+        async_settle(ar, ar->result, 1);
+    }
+    else if (ret != UBUS_STATUS_OK) {
+        PyObject *exc = call_error(ret);
+        if (exc) {
+            async_settle(ar, exc, 1);
+            Py_DECREF(exc);
+        }
+        else {
+            PyErr_WriteUnraisable(ar->future);
+        }
+    }
+    else if (ar->result) {
+        async_settle(ar, ar->result, 0);
+    }
+    else {
+        PyObject *empty = PyDict_New();
+        if (empty) {
+            async_settle(ar, empty, 0);
+            Py_DECREF(empty);
+        }
+        else {
+            PyErr_WriteUnraisable(ar->future);
+        }
+    }
+    
+    async_request_done(ar);
+    
+    PyGILState_Release(gstate);
+}
+
+/* Make sure loop watches the context socket, must be called with the context lock held */
+static int client_attach_loop(UbusClientObject *self, PyObject *loop) {
+    if (self->loop == loop) {
+        return 0;
+    }
+    
+    if (self->loop) {
+        PyObject *ret = PyObject_CallMethod(self->loop, "remove_reader", "i", self->ctx->sock.fd);
+        Py_XDECREF(ret);
+        PyErr_Clear();
+        Py_CLEAR(self->loop);
+    }
+    
+    PyObject *handler = PyObject_GetAttrString((PyObject *)self, "process_events");
+    if (!handler) {
+        return -1;
+    }
+    
+    PyObject *ret = PyObject_CallMethod(loop, "add_reader", "iO", self->ctx->sock.fd, handler);
+    Py_DECREF(handler);
+    if (!ret) {
+        return -1;
+    }
+    Py_DECREF(ret);
+    
+    Py_INCREF(loop);
+    self->loop = loop;
+    self->loop_thread = PyThread_get_thread_ident();
+    return 0;
+}
+
+/* Stop watching the context socket and fail requests still in flight,
+ * must be called with the context lock held */
+static void client_detach_async(UbusClientObject *self) {
+    struct async_request *ar, *tmp;
+    
+    client_abort_iterators(self);
+    
+    list_for_each_entry_safe(ar, tmp, &self->async_requests, list) {
+        if (self->ctx) {
+            ubus_abort_request(self->ctx, &ar->req);
+        }
+        list_del(&ar->list);
+        
+        PyObject *exc = status_error(UBUS_STATUS_CONNECTION_FAILED, "Disconnected from ubus");
+        if (exc) {
+            async_settle(ar, exc, 1);
+            Py_DECREF(exc);
+        }
+        PyErr_Clear();
+        
+        async_request_done(ar);
+    }
+    
+    if (self->loop) {
+        if (self->ctx) {
+            PyObject *ret = PyObject_CallMethod(self->loop, "remove_reader", "i", self->ctx->sock.fd);
+            Py_XDECREF(ret);
+            PyErr_Clear();
+        }
+        Py_CLEAR(self->loop);
+    }
+}
+
+/* Start an async call, must be called with the context lock held */
+static PyObject *client_call_async_locked(UbusClientObject *self, PyObject *object,
+                                          const char *method, PyObject *params, int timeout_ms) {
+    struct call_timing timing;
+    struct call_target target = { .timing = PYUBUS_WITH_STATS && self->stats_enabled ? &timing : NULL };
+    struct blob_buf local_buf, *b = client_buf_acquire(self, &local_buf);
+    int ret;
+    
+    if (target.timing) {
+        memset(&timing, 0, sizeof(timing));
+        timing.start = monotonic_ns();
+    }
+    
+    if (client_prepare_call(self, object, method, params, b, &target) < 0) {
+        client_buf_release(self, b);
+        return NULL;
+    }
+    
+    /* get_event_loop() would make up a loop nothing runs, or warn */
+    PyObject *loop = PyObject_CallObject(asyncio_get_running_loop, NULL);
+    if (!loop) {
+        if (PyErr_ExceptionMatches(PyExc_RuntimeError)) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "call_async() must be called from a coroutine or callback of a running event loop");
+        }
+        client_buf_release(self, b);
+        return NULL;
+    }
+    
+    PyObject *future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (!future || client_attach_loop(self, loop) < 0) {
+        Py_XDECREF(future);
+        Py_DECREF(loop);
+        client_buf_release(self, b);
+        return NULL;
+    }
+    Py_DECREF(loop);
+    
+    char *key = NULL;
+    size_t key_len = 0;
+    
+    /* Share the request of an identical call still in flight */
+    if (self->coalesce) {
+        key = coalesce_key(target.object_name, target.id, method, b->head, &key_len);
+        if (key && async_request_follow(self, key, key_len, future) == 0) {
+            free(key);
+            client_buf_release(self, b);
+            return future;
+        }
+    }
+    
+    struct async_request *ar = async_request_alloc(self);
+    if (!ar) {
+        free(key);
+        Py_DECREF(future);
+        client_buf_release(self, b);
+        return PyErr_NoMemory();
+    }
+    
+    /* Only sends the request, the reply is dispatched by process_events() */
+    int64_t deadline = deadline_after(timeout_ms);
+    int timeout;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_invoke_async(self->ctx, target.id, method, b->head, &ar->req);
+    Py_END_ALLOW_THREADS
+    
+    /* Same recovery as call() when the socket hung up. The reconnect
+     * attaches the loop again, which leaves it detached if that failed. */
+    if (ret == UBUS_STATUS_CONNECTION_FAILED && !PyErr_Occurred() &&
+        (ret = client_retry_connection(self, target.object_name, &target.id, deadline, &timeout)) == UBUS_STATUS_OK) {
+        if (!self->loop) {
+            ret = UBUS_STATUS_CONNECTION_FAILED;
+        }
+        else {
+            Py_BEGIN_ALLOW_THREADS
+            ret = bus_invoke_async(self->ctx, target.id, method, b->head, &ar->req);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    
+    client_buf_release(self, b);
+    
+    if (ret != UBUS_STATUS_OK) {
+        free(key);
+        async_request_release(self, ar);
+        Py_DECREF(future);
+        raise_call_error(ret);
+        return NULL;
+    }
+    
+    ar->key = key;
+    ar->key_len = key_len;
+    ar->req.data_cb = async_data_cb;
+    ar->req.complete_cb = async_complete_cb;
+    ar->client = self;
+    ar->future = future;
+    if (PYUBUS_WITH_STATS && target.timing) {
+        ar->stats = stats_find(self->stats, target.object_name, target.id, method, 1);
+        ar->timing = timing;
+    }
+    Py_INCREF(self);
+    Py_INCREF(future);
+    list_add_tail(&ar->list, &self->async_requests);
+    
+    /* libubus has no timeout for async requests, the loop keeps it */
+    if (timeout_ms) {
+        PyObject *bound = PyTuple_Pack(2, (PyObject *)self, future);
+        PyObject *expire = bound ? PyCFunction_New(&async_expire_def, bound) : NULL;
+        Py_XDECREF(bound);
+        
+        ar->timer = expire ? PyObject_CallMethod(self->loop, "call_later", "dO",
+                                                 timeout_ms / 1000.0, expire) : NULL;
+        Py_XDECREF(expire);
+        if (!ar->timer) {
+            /* The request is already out, dropping it would leave the future hanging */
+            PyErr_WriteUnraisable(future);
+        }
+    }
+    
+    ubus_complete_request_async(self->ctx, &ar->req);
+    
+    return future;
+}
+
+/* UbusClient.call_async() */
+static PyObject *UbusClient_call_async(UbusClientObject *self, PyObject *const *args,
+                                       Py_ssize_t nargs, PyObject *kwnames) {
+    const char *method;
+    PyObject *object, *params;
+    int timeout_ms = -1;
+    
+    if (parse_call_args("call_async", args, nargs, kwnames, &object, &method, &params, &timeout_ms, NULL) < 0) {
+        return NULL;
+    }
+    
+    if (!asyncio_get_running_loop) {
+        PyObject *asyncio = PyImport_ImportModule("asyncio");
+        if (!asyncio) {
+            return NULL;
+        }
+        asyncio_get_running_loop = PyObject_GetAttrString(asyncio, "get_running_loop");
+        Py_DECREF(asyncio);
+        if (!asyncio_get_running_loop) {
+            return NULL;
+        }
+    }
+    
+    client_lock(self);
+    if (timeout_ms < 0) {
+        timeout_ms = self->timeout_ms;
+    }
+    PyObject *result = client_call_async_locked(self, object, method, params, timeout_ms);
+    client_unlock(self);
+    return result;
+}
+
+/* UbusClient.fileno() */
+static PyObject *UbusClient_fileno(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    if (!self->connected) {
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    return PyLong_FromLong(self->ctx->sock.fd);
+}
+
+/* Reply message queued for a call_iter() iterator */
+struct iter_msg {
+    struct iter_msg *next;
+    struct blob_attr *msg;
+};
+
+/* Iterator returned by UbusClient.call_iter() */
+typedef struct {
+    PyObject_HEAD
+    UbusClientObject *client;
+    struct ubus_request req;
+    struct list_head list;      /* In client->iterators while the request is open */
+    int pending;
+    int status;
+    int timeout_ms;
+    /* Messages received but not yielded yet, copied off the socket buffer */
+    struct iter_msg *queue;
+    struct iter_msg **queue_tail;
+    /* Message being yielded: next top-level field, and the array whose
+     * elements are being yielded one by one */
+    struct iter_msg *cur;
+    struct blob_attr *pos;
+    size_t rem;
+    struct blob_attr *array;
+    struct blob_attr *elem;
+    size_t elem_rem;
+    PyObject *error;            /* Reply over a limit, raised once the queue is drained */
+} CallIteratorObject;
+
+static PyTypeObject CallIteratorType;
+
+/* Data callback of call_iter() requests, only queues a copy of the message */
+static void iter_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    CallIteratorObject *self = container_of(req, CallIteratorObject, req);
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    /* Messages after one over a limit are dropped */
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    if (!self->error && client_check_reply(self->client, msg, 1, NULL) < 0) {
+        self->error = fetch_error();
+    }
+    int drop = self->error != NULL;
+    PyGILState_Release(gstate);
+    if (drop) {
+        return;
+    }
+    
+    struct iter_msg *im = malloc(sizeof(*im));
+    if (!im || !(im->msg = blob_memdup(msg))) {
+        free(im);
+        self->status = UBUS_STATUS_NO_MEMORY;
+        return;
+    }
+    
+    im->next = NULL;
+    *self->queue_tail = im;
+    self->queue_tail = &im->next;
+}
+
+/* Completion callback of call_iter() requests */
+static void iter_complete_cb(struct ubus_request *req, int ret) {
+    CallIteratorObject *self = container_of(req, CallIteratorObject, req);
+    
+    self->pending = 0;
+    if (self->status == UBUS_STATUS_OK) {
+        self->status = ret;
+    }
+    list_del(&self->list);
+}
+
+/* Fail the open call_iter() requests of a context that goes away, must be
+ * called with the context lock held */
+static void client_abort_iterators(UbusClientObject *self) {
+    CallIteratorObject *it, *tmp;
+    
+    list_for_each_entry_safe(it, tmp, &self->iterators, list) {
+        if (self->ctx) {
+            ubus_abort_request(self->ctx, &it->req);
+        }
+        list_del(&it->list);
+        it->pending = 0;
+        it->status = UBUS_STATUS_CONNECTION_FAILED;
+    }
+}
+
+/* Step over one attribute of a blob buffer, NULL at its end */
+static struct blob_attr *blob_iter_next(struct blob_attr **pos, size_t *rem) {
+    struct blob_attr *attr = *pos;
+    
+    if (*rem < sizeof(struct blob_attr) || blob_pad_len(attr) > *rem ||
+        blob_pad_len(attr) < sizeof(struct blob_attr)) {
+        return NULL;
+    }
+    
+    *rem -= blob_pad_len(attr);
+    *pos = blob_next(attr);
+    return attr;
+}
+
+/* Decode the next (name, value) of the current message, or return NULL
+ * without an exception set once it is used up */
+static PyObject *iter_decode_next(CallIteratorObject *self) {
+    struct blob_attr *attr;
+    
+    while (self->cur) {
+        if (self->array) {
+            attr = blob_iter_next(&self->elem, &self->elem_rem);
+            if (!attr) {
+                self->array = NULL;
+                continue;
+            }
+            if (!blobmsg_check_attr(attr, false)) {
+                continue;
+            }
+            
+            PyObject *key = blob_key_to_python(blobmsg_name(self->array));
+            PyObject *value = key ? blob_to_python(attr) : NULL;
+            PyObject *item = value ? PyTuple_Pack(2, key, value) : NULL;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            return item;
+        }
+        
+        attr = blob_iter_next(&self->pos, &self->rem);
+        if (!attr) {
+            free(self->cur->msg);
+            free(self->cur);
+            self->cur = NULL;
+            break;
+        }
+        
+        if (!blobmsg_check_attr(attr, true)) {
+            continue;
+        }
+        
+        /* Arrays are yielded element by element instead of as one list */
+        if (blobmsg_type(attr) == BLOBMSG_TYPE_ARRAY) {
+            self->array = attr;
+            self->elem = blobmsg_data(attr);
+            self->elem_rem = blobmsg_data_len(attr);
+            continue;
+        }
+        
+        PyObject *key = blob_key_to_python(blobmsg_name(attr));
+        PyObject *value = key ? blob_to_python(attr) : NULL;
+        PyObject *item = value ? PyTuple_Pack(2, key, value) : NULL;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        return item;
+    }
+    
+    /* Move on to the next queued message */
+    if (self->queue) {
+        self->cur = self->queue;
+        self->queue = self->cur->next;
+        if (!self->queue) {
+            self->queue_tail = &self->queue;
+        }
+        self->pos = blob_data(self->cur->msg);
+        self->rem = blob_len(self->cur->msg);
+        return iter_decode_next(self);
+    }
+    
+    return NULL;
+}
+
+/* CallIterator.__next__(), must be called with the context lock held */
+static PyObject *call_iter_next_locked(CallIteratorObject *self) {
+    UbusClientObject *client = self->client;
+    int64_t deadline = deadline_after(self->timeout_ms);
+    
+    for (;;) {
+        PyObject *item = iter_decode_next(self);
+        if (item || PyErr_Occurred()) {
+            return item;
+        }
+        
+        if (self->error) {
+            if (self->pending) {
+                ubus_abort_request(client->ctx, &self->req);
+                list_del(&self->list);
+                self->pending = 0;
+            }
+            self->status = UBUS_STATUS_OK;
+            PyErr_SetObject((PyObject *)Py_TYPE(self->error), self->error);
+            Py_CLEAR(self->error);
+            return NULL;
+        }
+        
+        if (!self->pending) {
+            int status = self->status;
+            
+            /* Raise a failure once, then stop like a finished iterator */
+            self->status = UBUS_STATUS_OK;
+            return status != UBUS_STATUS_OK ? raise_call_error(status) : NULL;
+        }
+        
+        int timeout = deadline_remaining(deadline);
+        if (timeout < 0) {
+            ubus_abort_request(client->ctx, &self->req);
+            list_del(&self->list);
+            self->pending = 0;
+            return raise_call_error(UBUS_STATUS_TIMEOUT);
+        }
+        
+        client_dispatch_pending(client);
+        if (!self->pending || self->queue) {
+            continue;
+        }
+        
+        /* Wait for the next message and handle whatever has arrived */
+        struct pollfd pfd = { .fd = client->ctx->sock.fd, .events = POLLIN };
+        Py_BEGIN_ALLOW_THREADS
+        if (poll(&pfd, 1, timeout ? timeout : -1) > 0) {
+            ubus_handle_event(client->ctx);
+        }
+        Py_END_ALLOW_THREADS
+        
+        if (client->ctx->sock.eof) {
+            client_reconnect_locked(client);
+        }
+    }
+}
+
+/* CallIterator.__next__() */
+static PyObject *CallIterator_next(CallIteratorObject *self) {
+    client_lock(self->client);
+    PyObject *item = call_iter_next_locked(self);
+    client_schedule_pending(self->client);
+    client_unlock(self->client);
+    return item;
+}
+
+/* CallIterator.__dealloc__ */
+static void CallIterator_dealloc(CallIteratorObject *self) {
+    client_lock(self->client);
+    if (self->pending) {
+        ubus_abort_request(self->client->ctx, &self->req);
+        list_del(&self->list);
+    }
+    client_unlock(self->client);
+    
+    struct iter_msg *im = self->cur;
+    if (im) {
+        im->next = self->queue;
+    }
+    else {
+        im = self->queue;
+    }
+    while (im) {
+        struct iter_msg *next = im->next;
+        free(im->msg);
+        free(im);
+        im = next;
+    }
+    
+    Py_XDECREF(self->error);
+    Py_DECREF(self->client);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* CallIterator type definition */
+static PyTypeObject CallIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.CallIterator",
+    .tp_doc = "Iterator over the (name, value) pairs of a ubus reply",
+    .tp_basicsize = sizeof(CallIteratorObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)CallIterator_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)CallIterator_next,
+};
+
+/* Start a call_iter() request, must be called with the context lock held */
+static PyObject *client_call_iter_locked(UbusClientObject *self, PyObject *object,
+                                         const char *method, PyObject *params, int timeout_ms) {
+    struct call_target target = { .timing = NULL };
+    struct blob_buf local_buf, *b = client_buf_acquire(self, &local_buf);
+    int ret;
+    
+    if (client_prepare_call(self, object, method, params, b, &target) < 0) {
+        client_buf_release(self, b);
+        return NULL;
+    }
+    
+    CallIteratorObject *it = PyObject_New(CallIteratorObject, &CallIteratorType);
+    if (!it) {
+        client_buf_release(self, b);
+        return NULL;
+    }
+    
+    it->client = self;
+    Py_INCREF(self);
+    it->pending = 0;
+    it->status = UBUS_STATUS_OK;
+    it->timeout_ms = timeout_ms;
+    it->queue = NULL;
+    it->queue_tail = &it->queue;
+    it->cur = NULL;
+    it->array = NULL;
+    it->error = NULL;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_invoke_async(self->ctx, target.id, method, b->head, &it->req);
+    Py_END_ALLOW_THREADS
+    
+    client_buf_release(self, b);
+    
+    if (ret != UBUS_STATUS_OK) {
+        Py_DECREF(it);
+        return raise_call_error(ret);
+    }
+    
+    it->req.data_cb = iter_data_cb;
+    it->req.complete_cb = iter_complete_cb;
+    it->pending = 1;
+    list_add_tail(&it->list, &self->iterators);
+    ubus_complete_request_async(self->ctx, &it->req);
+    
+    return (PyObject *)it;
+}
+
+/* UbusClient.call_iter() */
+static PyObject *UbusClient_call_iter(UbusClientObject *self, PyObject *const *args,
+                                      Py_ssize_t nargs, PyObject *kwnames) {
+    const char *method;
+    PyObject *object, *params;
+    int timeout_ms = -1;
+    
+    if (parse_call_args("call_iter", args, nargs, kwnames, &object, &method, &params, &timeout_ms, NULL) < 0) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    if (timeout_ms < 0) {
+        timeout_ms = self->timeout_ms;
+    }
+    PyObject *result = client_call_iter_locked(self, object, method, params, timeout_ms);
+    client_unlock(self);
+    return result;
+}
+
+/* Registered listen() or subscribe() callback */
+struct event_listener {
+    struct list_head list;
+    UbusClientObject *client;
+    uint64_t id;
+    PyObject *callback;
+    struct ubus_event_handler handler;
+    struct ubus_subscriber subscriber;
+    int is_subscriber;
+    char name[];
+};
+
+/* Event copied off the socket, waiting to be handed to Python */
+struct event_msg {
+    uint64_t listener;
+    const char *type;
+    size_t data_len;
+    uint32_t payload[];
+};
+
+/* Wake the I/O thread up, must be called with the context lock held. The
+ * pipe is closed under that lock once the thread is joined. */
+static void client_io_wake(UbusClientObject *self) {
+    char c = 0;
+    
+    /* A full pipe wakes the thread up just as well */
+    if (write(self->io_wakeup[1], &c, 1) < 0) {
+        return;
+    }
+}
+
+#if PYUBUS_WITH_EVENTS
+/* Queue an event for its listener, runs without the GIL */
+static void event_push(struct event_listener *listener, const char *type, struct blob_attr *msg) {
+    UbusClientObject *self = listener->client;
+    unsigned int head = self->event_head;
+    unsigned int tail = __atomic_load_n(&self->event_tail, __ATOMIC_ACQUIRE);
+    
+    if (head - tail >= EVENT_RING_SIZE) {
+        self->events_dropped++;
+        return;
+    }
+    
+    /* Events are held to the reply limits too, there is nobody to raise
+     * the error to so they are dropped */
+    size_t alloc = 0;
+    if (msg) {
+        self->bytes_received += blob_raw_len(msg);
+        if ((self->max_reply_size > 0 && blob_raw_len(msg) > (size_t)self->max_reply_size) ||
+            (self->max_reply_depth > 0 && blob_scan(blob_data(msg), blob_len(msg), 1, 1,
+                                                    self->max_reply_depth, &alloc) > self->max_reply_depth)) {
+            self->events_dropped++;
+            return;
+        }
+    }
+    
+    size_t data_len = msg ? blob_pad_len(msg) : 0;
+    struct event_msg *m = malloc(sizeof(*m) + data_len + strlen(type) + 1);
+    if (!m) {
+        self->events_dropped++;
+        return;
+    }
+    
+    m->listener = listener->id;
+    m->data_len = data_len;
+    if (msg) {
+        memcpy(m->payload, msg, data_len);
+    }
+    m->type = (char *)m->payload + data_len;
+    strcpy((char *)m->type, type);
+    
+    self->event_ring[head % EVENT_RING_SIZE] = m;
+    __atomic_store_n(&self->event_head, head + 1, __ATOMIC_RELEASE);
+    
+    /* Events dispatched by another thread's call are handed over by the
+     * I/O thread, which would not notice them on the socket */
+    if (__atomic_load_n(&self->io_state, __ATOMIC_ACQUIRE) == IO_RUNNING &&
+        !pthread_equal(pthread_self(), self->io_thread)) {
+        client_io_wake(self);
+    }
+}
+
+/* Event handler callback for listen() */
+static void listen_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                      const char *type, struct blob_attr *msg) {
+    (void)ctx;
+    event_push(container_of(ev, struct event_listener, handler), type, msg);
+}
+
+/* Notification callback for subscribe() */
+static int subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj,
+                        struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+    struct ubus_subscriber *sub = container_of(obj, struct ubus_subscriber, obj);
+    
+    (void)ctx;
+    (void)req;
+    event_push(container_of(sub, struct event_listener, subscriber), method, msg);
+    return 0;
+}
+#endif  /* PYUBUS_WITH_EVENTS */
+
+/* Hand queued events to their callbacks, must be called with the GIL held.
+ * Only events queued before the call are handled, so a steady stream
+ * cannot keep the caller here forever. */
+static int client_drain_events(UbusClientObject *self) {
+    /* A callback that releases the GIL must not let another thread
+     * (or a nested process_events()) consume the ring concurrently */
+    if (self->draining) {
+        return 0;
+    }
+    self->draining = 1;
+    
+    unsigned int head = __atomic_load_n(&self->event_head, __ATOMIC_ACQUIRE);
+    int ret = 0;
+    
+    while (self->event_tail != head) {
+        unsigned int tail = self->event_tail;
+        struct event_msg *m = self->event_ring[tail % EVENT_RING_SIZE];
+        __atomic_store_n(&self->event_tail, tail + 1, __ATOMIC_RELEASE);
+        
+        // Events of a listener removed since they were queued are dropped
+        struct event_listener *listener, *found = NULL;
+        list_for_each_entry(listener, &self->listeners, list) {
+            if (listener->id == m->listener) {
+                found = listener;
+                break;
+            }
+        }
+        
+        if (found) {
+            PyObject *callback = found->callback;
+            struct blob_attr *data = (struct blob_attr *)m->payload;
+            PyObject *decoded = m->data_len ?
+                blob_table_to_python(blob_data(data), blob_len(data)) : PyDict_New();
+            PyObject *result = NULL;
+            
+            Py_INCREF(callback);
+            if (decoded) {
+                result = PyObject_CallFunction(callback, "sO", m->type, decoded);
+                Py_DECREF(decoded);
+            }
+            Py_DECREF(callback);
+            
+            if (!result) {
+                free(m);
+                ret = -1;
+                break;
+            }
+            Py_DECREF(result);
+        }
+        
+        free(m);
+        
+        /* disconnect() from a callback empties the ring */
+        if (head - self->event_tail > EVENT_RING_SIZE) {
+            break;
+        }
+    }
+    
+    self->draining = 0;
+    return ret;
+}
+
+/* Free all listeners and queued events, must be called with the context lock
+ * held after the context is gone */
+static void client_clear_listeners(UbusClientObject *self) {
+    struct event_listener *listener, *tmp;
+    
+    list_for_each_entry_safe(listener, tmp, &self->listeners, list) {
+        list_del(&listener->list);
+        Py_DECREF(listener->callback);
+        free(listener);
+    }
+    
+    while (self->event_tail != self->event_head) {
+        free(self->event_ring[self->event_tail % EVENT_RING_SIZE]);
+        self->event_tail++;
+    }
+}
+
+#if PYUBUS_WITH_EVENTS
+/* Allocate a listener for callback, registered by the caller */
+static struct event_listener *listener_new(UbusClientObject *self, const char *name, PyObject *callback) {
+    struct event_listener *listener = calloc(1, sizeof(*listener) + strlen(name) + 1);
+    if (!listener) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    
+    strcpy(listener->name, name);
+    listener->client = self;
+    listener->id = ++self->next_listener_id;
+    listener->callback = callback;
+    Py_INCREF(callback);
+    return listener;
+}
+
+/* UbusClient.listen() */
+static PyObject *UbusClient_listen(UbusClientObject *self, PyObject *args) {
+    const char *pattern;
+    PyObject *callback;
+    int ret;
+    
+    if (!PyArg_ParseTuple(args, "sO", &pattern, &callback)) {
+        return NULL;
+    }
+    
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (!self->connected) {
+        client_unlock(self);
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    struct event_listener *listener = listener_new(self, pattern, callback);
+    if (!listener) {
+        client_unlock(self);
+        return NULL;
+    }
+    
+    listener->handler.cb = listen_cb;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_register_event_handler(self->ctx, &listener->handler, pattern);
+    Py_END_ALLOW_THREADS
+    
+    if (ret != UBUS_STATUS_OK) {
+        client_unlock(self);
+        Py_DECREF(callback);
+        free(listener);
+        raise_status(ret, "Failed to listen for '%s': %s (%d)",
+                      pattern, status_message(ret), ret);
+        return NULL;
+    }
+    
+    list_add_tail(&listener->list, &self->listeners);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+/* UbusClient.subscribe() */
+static PyObject *UbusClient_subscribe(UbusClientObject *self, PyObject *args) {
+    const char *path;
+    PyObject *callback;
+    int ret;
+    
+    if (!PyArg_ParseTuple(args, "sO", &path, &callback)) {
+        return NULL;
+    }
+    
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (!self->connected) {
+        client_unlock(self);
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    struct id_cache_entry *entry = id_cache_resolve(self, path, &ret);
+    if (!entry) {
+        client_unlock(self);
+        raise_status(ret, "Object '%s' not found: %d", path, ret);
+        return NULL;
+    }
+    uint32_t id = entry->id;
+    
+    struct event_listener *listener = listener_new(self, path, callback);
+    if (!listener) {
+        client_unlock(self);
+        return NULL;
+    }
+    
+    listener->is_subscriber = 1;
+    listener->subscriber.cb = subscribe_cb;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_register_subscriber(self->ctx, &listener->subscriber);
+    if (ret == UBUS_STATUS_OK) {
+        ret = bus_subscribe(self->ctx, &listener->subscriber, id);
+        if (ret != UBUS_STATUS_OK) {
+            bus_unregister_subscriber(self->ctx, &listener->subscriber);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    if (ret != UBUS_STATUS_OK) {
+        client_unlock(self);
+        Py_DECREF(callback);
+        free(listener);
+        raise_status(ret, "Failed to subscribe to '%s': %s (%d)",
+                      path, status_message(ret), ret);
+        return NULL;
+    }
+    
+    list_add_tail(&listener->list, &self->listeners);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+/* Remove the listeners registered for name, must be called with the context lock held */
+static int client_remove_listeners(UbusClientObject *self, const char *name, int is_subscriber) {
+    struct event_listener *listener, *tmp;
+    int removed = 0;
+    
+    list_for_each_entry_safe(listener, tmp, &self->listeners, list) {
+        if (listener->is_subscriber != is_subscriber || strcmp(listener->name, name) != 0) {
+            continue;
+        }
+        
+        if (self->connected) {
+            Py_BEGIN_ALLOW_THREADS
+            if (is_subscriber) {
+                bus_unregister_subscriber(self->ctx, &listener->subscriber);
+            }
+            else {
+                bus_unregister_event_handler(self->ctx, &listener->handler);
+            }
+            Py_END_ALLOW_THREADS
+        }
+        
+        list_del(&listener->list);
+        Py_DECREF(listener->callback);
+        free(listener);
+        removed++;
+    }
+    
+    return removed;
+}
+#endif  /* PYUBUS_WITH_EVENTS */
+
+/* Reconnect a context whose socket hung up, must be called with the context
+ * lock held. libubus registers the context's objects again; event patterns,
+ * subscriptions and the loop reader are redone here and cached object IDs,
+ * which ubusd may have reassigned, are dropped. Returns a ubus status. */
+static int client_reconnect_locked(UbusClientObject *self) {
+    struct event_listener *listener;
+    int ret;
+    
+    /* Requests in flight are lost with the old socket and the loop still
+     * watches its file descriptor */
+    PyObject *loop = self->loop;
+    unsigned long loop_thread = self->loop_thread;
+    Py_XINCREF(loop);
+    client_detach_async(self);
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = ubus_reconnect(self->ctx, self->socket_path);
+    Py_END_ALLOW_THREADS
+    
+    if (ret != UBUS_STATUS_OK) {
+        Py_XDECREF(loop);
+        return ret;
+    }
+    
+    self->connection++;
+    self->reconnects++;
+    id_cache_clear(self);
+    /* A new ubusd hands out new IDs, the shared ones are stale as well */
+    if (self->shm) {
+        shm_clear(self->shm);
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    self->objects_watched = self->watch_objects && !client_watch_objects(self->ctx, &self->object_event);
+    list_for_each_entry(listener, &self->listeners, list) {
+        if (!listener->is_subscriber) {
+            bus_register_event_handler(self->ctx, &listener->handler, listener->name);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    /* An object that is not back yet stays unsubscribed */
+    list_for_each_entry(listener, &self->listeners, list) {
+        int lookup_ret;
+        struct id_cache_entry *entry;
+        
+        if (listener->is_subscriber && (entry = id_cache_resolve(self, listener->name, &lookup_ret))) {
+            uint32_t id = entry->id;
+            Py_BEGIN_ALLOW_THREADS
+            bus_subscribe(self->ctx, &listener->subscriber, id);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    
+    if (loop) {
+        if (client_attach_loop(self, loop) < 0) {
+            PyErr_Clear();
+        }
+        self->loop_thread = loop_thread;
+        Py_DECREF(loop);
+    }
+    
+    return UBUS_STATUS_OK;
+}
+
+#if PYUBUS_WITH_EVENTS
+/* UbusClient.unlisten() */
+static PyObject *UbusClient_unlisten(UbusClientObject *self, PyObject *args) {
+    const char *pattern;
+    
+    if (!PyArg_ParseTuple(args, "s", &pattern)) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    int removed = client_remove_listeners(self, pattern, 0);
+    client_unlock(self);
+    return PyLong_FromLong(removed);
+}
+
+/* UbusClient.unsubscribe() */
+static PyObject *UbusClient_unsubscribe(UbusClientObject *self, PyObject *args) {
+    const char *path;
+    
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    int removed = client_remove_listeners(self, path, 1);
+    client_unlock(self);
+    return PyLong_FromLong(removed);
+}
+#endif  /* PYUBUS_WITH_EVENTS */
+
+/* Request being handled by a published object method */
+typedef struct {
+    PyObject_HEAD
+    UbusClientObject *client;
+    unsigned int connection;
+    struct ubus_request_data *req;
+    struct ubus_request_data deferred_req;
+    int deferred;
+    int completed;
+} UbusRequestObject;
+
+static PyTypeObject UbusRequestType;
+
+/* The context a request arrived on, NULL with an exception set if it is gone */
+static struct ubus_context *request_context(UbusRequestObject *self) {
+    if (!self->client->connected || self->client->connection != self->connection) {
+        PyErr_SetString(PyExc_RuntimeError, "Connection of the request was closed");
+        return NULL;
+    }
+    
+    if (self->completed) {
+        PyErr_SetString(PyExc_RuntimeError, "Request already completed");
+        return NULL;
+    }
+    
+    return self->client->ctx;
+}
+
+/* Request.reply() */
+static PyObject *UbusRequest_reply(UbusRequestObject *self, PyObject *args) {
+    PyObject *data;
+    int ret;
+    
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &data)) {
+        return NULL;
+    }
+    
+    client_lock(self->client);
+    
+    struct ubus_context *ctx = request_context(self);
+    if (!ctx) {
+        client_unlock(self->client);
+        return NULL;
+    }
+    
+    struct blob_buf local_buf, *b = client_buf_acquire(self->client, &local_buf);
+    blob_buf_init(b, 0);
+    if (python_dict_to_blob(b, data, NULL) < 0) {
+        client_buf_release(self->client, b);
+        client_unlock(self->client);
+        return NULL;
+    }
+    
+    struct ubus_request_data *req = self->deferred ? &self->deferred_req : self->req;
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_send_reply(ctx, req, b->head);
+    Py_END_ALLOW_THREADS
+    
+    client_buf_release(self->client, b);
+    client_unlock(self->client);
+    
+    if (ret != UBUS_STATUS_OK) {
+        raise_status(ret, "Failed to send reply: %s (%d)", status_message(ret), ret);
+        return NULL;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* Request.defer() */
+static PyObject *UbusRequest_defer(UbusRequestObject *self, PyObject *args) {
+    (void)args;
+    
+    if (!self->req) {
+        PyErr_SetString(PyExc_RuntimeError, "Requests can only be deferred from their handler");
+        return NULL;
+    }
+    
+    if (!self->deferred) {
+        ubus_defer_request(self->client->ctx, self->req, &self->deferred_req);
+        self->deferred = 1;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* Request.complete() */
+static PyObject *UbusRequest_complete(UbusRequestObject *self, PyObject *args) {
+    int status = UBUS_STATUS_OK;
+    
+    if (!PyArg_ParseTuple(args, "|i", &status)) {
+        return NULL;
+    }
+    
+    if (!self->deferred) {
+        PyErr_SetString(PyExc_RuntimeError, "Only deferred requests can be completed");
+        return NULL;
+    }
+    
+    client_lock(self->client);
+    
+    struct ubus_context *ctx = request_context(self);
+    if (!ctx) {
+        client_unlock(self->client);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    bus_complete_deferred(ctx, &self->deferred_req, status);
+    Py_END_ALLOW_THREADS
+    
+    self->completed = 1;
+    client_unlock(self->client);
+    Py_RETURN_NONE;
+}
+
+/* Request.__dealloc__ */
+static void UbusRequest_dealloc(UbusRequestObject *self) {
+    Py_XDECREF(self->client);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Request methods table */
+static PyMethodDef UbusRequest_methods[] = {
+    {"reply", (PyCFunction)UbusRequest_reply, METH_VARARGS,
+     "Send a dict as reply data"},
+    {"defer", (PyCFunction)UbusRequest_defer, METH_NOARGS,
+     "Keep the request open after the handler returns"},
+    {"complete", (PyCFunction)UbusRequest_complete, METH_VARARGS,
+     "Finish a deferred request with a ubus status code"},
+    {NULL}  /* Sentinel */
+};
+
+/* Request type definition */
+static PyTypeObject UbusRequestType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.Request",
+    .tp_doc = "Request received by a published ubus object",
+    .tp_basicsize = sizeof(UbusRequestObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)UbusRequest_dealloc,
+    .tp_methods = UbusRequest_methods,
+};
+
+/* Python side of one published method */
+struct published_method {
+    PyObject *handler;
+    struct blobmsg_policy *policy;
+    int n_policy;
+};
+
+/* Object registered with add_object() */
+struct published_object {
+    struct list_head list;
+    UbusClientObject *client;
+    struct ubus_object obj;
+    struct ubus_object_type type;
+    struct ubus_method *methods;
+    struct published_method *info;
+    int n_methods;
+    char name[];
+};
+
+/* Free a published object, the caller removes it from ubus first */
+static void published_object_free(struct published_object *pobj) {
+    for (int i = 0; i < pobj->n_methods; i++) {
+        for (int j = 0; j < pobj->info[i].n_policy; j++) {
+            free((char *)pobj->info[i].policy[j].name);
+        }
+        free(pobj->info[i].policy);
+        free((char *)pobj->methods[i].name);
+        Py_XDECREF(pobj->info[i].handler);
+    }
+    free(pobj->methods);
+    free(pobj->info);
+    free(pobj);
+}
+
+/* Complete a request the handler did not defer. libubus would send the status
+ * itself once the callback returns, outside send_lock, so it is deferred and
+ * completed here with the reply, if any. */
+static int published_complete(struct ubus_context *ctx, struct ubus_request_data *req,
+                              struct blob_attr *reply, int status) {
+    struct ubus_request_data deferred;
+    
+    ubus_defer_request(ctx, req, &deferred);
+    send_lock_acquire();
+    if (reply) {
+        ubus_send_reply(ctx, &deferred, reply);
+    }
+    ubus_complete_deferred_request(ctx, &deferred, status);
+    send_lock_release();
+    return status;
+}
+
+/* Method callback of published objects, called while the socket is dispatched */
+static int published_method_cb(struct ubus_context *ctx, struct ubus_object *obj,
+                               struct ubus_request_data *req, const char *method,
+                               struct blob_attr *msg) {
+    struct published_object *pobj = container_of(obj, struct published_object, obj);
+    UbusClientObject *client = pobj->client;
+    struct published_method *info = NULL;
+    
+    for (int i = 0; i < pobj->n_methods; i++) {
+        if (!strcmp(pobj->methods[i].name, method)) {
+            info = &pobj->info[i];
+            break;
+        }
+    }
+    
+    if (!info) {
+        return published_complete(ctx, req, NULL, UBUS_STATUS_METHOD_NOT_FOUND);
+    }
+    
+    // Split the arguments before taking the GIL
+    struct blob_attr *tb_buf[16];
+    struct blob_attr **tb = tb_buf;
+    
+    if (info->n_policy > 16) {
+        tb = calloc(info->n_policy, sizeof(*tb));
+        if (!tb) {
+            return published_complete(ctx, req, NULL, UBUS_STATUS_NO_MEMORY);
+        }
+    }
+    
+    if (info->n_policy) {
+        blobmsg_parse(info->policy, info->n_policy, tb, blob_data(msg), blob_len(msg));
+    }
+    
+    /* Handlers run inside a lookup keep the lock from other contexts */
+    int send_depth_held = send_lock_suspend();
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    int status = UBUS_STATUS_UNKNOWN_ERROR, deferred = 0;
+    PyObject *kwargs = NULL, *handler = info->handler, *result = NULL;
+    UbusRequestObject *request = NULL;
+    struct blob_buf local_buf, *reply = NULL;
+    struct ubus_request_data deferred_req;
+    
+    /* The handler may remove this object, keep it until its errors have
+     * been reported */
+    Py_INCREF(handler);
+    
+    /* Methods without a policy get every top-level field */
+    if (info->n_policy) {
+        kwargs = PyDict_New();
+        for (int i = 0; kwargs && i < info->n_policy; i++) {
+            if (!tb[i]) {
+                continue;
+            }
+            
+            PyObject *value = blob_to_python(tb[i]);
+            if (!value || PyDict_SetItemString(kwargs, info->policy[i].name, value) < 0) {
+                Py_XDECREF(value);
+                Py_CLEAR(kwargs);
+                break;
+            }
+            Py_DECREF(value);
+        }
+    }
+    else {
+        kwargs = blob_table_to_python(blob_data(msg), blob_len(msg));
+    }
+    
+    if (tb != tb_buf) {
+        free(tb);
+    }
+    
+    if (!kwargs) {
+        goto error;
+    }
+    
+    request = PyObject_New(UbusRequestObject, &UbusRequestType);
+    if (!request) {
+        goto error;
+    }
+    
+    request->client = pobj->client;
+    Py_INCREF(request->client);
+    request->connection = pobj->client->connection;
+    request->req = req;
+    request->deferred = 0;
+    request->completed = 0;
+    
+    PyObject *call_args = PyTuple_Pack(1, (PyObject *)request);
+    if (call_args) {
+        result = PyObject_Call(handler, call_args, kwargs);
+        Py_DECREF(call_args);
+    }
+    
+    /* A deferred request can no longer use req, libubus reuses it */
+    request->req = NULL;
+    
+    if (!result) {
+        goto error;
+    }
+    
+    if (result == Py_None) {
+        status = UBUS_STATUS_OK;
+    }
+    else if (PyLong_Check(result)) {
+        status = (int)PyLong_AsLong(result);
+        if (PyErr_Occurred()) {
+            goto error;
+        }
+    }
+    else if (PyDict_Check(result) && request->completed) {
+        PyErr_SetString(PyExc_RuntimeError, "method handler returned a reply for a request it already completed");
+        goto error;
+    }
+    else if (PyDict_Check(result)) {
+        /* A deferred request gets it like from Request.reply() */
+        reply = client_buf_acquire(client, &local_buf);
+        blob_buf_init(reply, 0);
+        if (python_dict_to_blob(reply, result, NULL) < 0) {
+            client_buf_release(client, reply);
+            reply = NULL;
+            goto error;
+        }
+        status = UBUS_STATUS_OK;
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "method handlers must return a dict, a status code or None");
+        goto error;
+    }
+    
+    goto done;
+    
+error:
+    PyErr_WriteUnraisable(handler);
+    status = UBUS_STATUS_UNKNOWN_ERROR;
+    
+done:
+    if (request) {
+        deferred = request->deferred;
+        deferred_req = request->deferred_req;
+        request->completed |= !deferred;
+    }
+    Py_XDECREF(request);
+    Py_XDECREF(result);
+    Py_XDECREF(kwargs);
+    Py_DECREF(handler);
+    PyGILState_Release(gstate);
+    
+    if (!deferred) {
+        published_complete(ctx, req, reply ? reply->head : NULL, status);
+    }
+    else if (reply) {
+        bus_send_reply(ctx, &deferred_req, reply->head);
+    }
+    if (reply) {
+        client_buf_release(client, reply);
+    }
+    send_lock_resume(send_depth_held);
+    return status;
+}
+
+/* Build a published object from a methods dict, registered by the caller */
+static struct published_object *published_object_new(UbusClientObject *self, const char *name,
+                                                      PyObject *methods) {
+    Py_ssize_t n = PyDict_Size(methods);
+    struct published_object *pobj = calloc(1, sizeof(*pobj) + strlen(name) + 1);
+    
+    if (!pobj) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    
+    strcpy(pobj->name, name);
+    pobj->client = self;
+    pobj->n_methods = (int)n;
+    pobj->methods = calloc(n ? n : 1, sizeof(*pobj->methods));
+    pobj->info = calloc(n ? n : 1, sizeof(*pobj->info));
+    if (!pobj->methods || !pobj->info) {
+        published_object_free(pobj);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    
+    for (int i = 0; PyDict_Next(methods, &pos, &key, &value); i++) {
+        struct published_method *info = &pobj->info[i];
+        PyObject *policy = NULL;
+        
+        // Methods are given as handler or (handler, policy)
+        if (PyTuple_Check(value)) {
+            if (!PyArg_ParseTuple(value, "OO!", &value, &PyDict_Type, &policy)) {
+                goto error;
+            }
+        }
+        
+        const char *method = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+        if (!method || !PyCallable_Check(value)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError, "methods must map names to a handler or (handler, policy)");
+            }
+            goto error;
+        }
+        
+        pobj->methods[i].name = strdup(method);
+        if (!pobj->methods[i].name) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        pobj->methods[i].handler = published_method_cb;
+        info->handler = value;
+        Py_INCREF(value);
+        
+        if (policy && PyDict_Size(policy)) {
+            PyObject *arg, *type;
+            Py_ssize_t arg_pos = 0;
+            
+            info->policy = calloc(PyDict_Size(policy), sizeof(*info->policy));
+            if (!info->policy) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            
+            while (PyDict_Next(policy, &arg_pos, &arg, &type)) {
+                const char *arg_name = PyUnicode_Check(arg) ? PyUnicode_AsUTF8(arg) : NULL;
+                long arg_type = PyLong_Check(type) ? PyLong_AsLong(type) : -1;
+                
+                if (!arg_name || arg_type < BLOBMSG_TYPE_UNSPEC || arg_type > BLOBMSG_TYPE_LAST) {
+                    if (!PyErr_Occurred()) {
+                        PyErr_SetString(PyExc_TypeError, "policy must map names to BLOBMSG_TYPE_* constants");
+                    }
+                    goto error;
+                }
+                
+                info->policy[info->n_policy].name = strdup(arg_name);
+                if (!info->policy[info->n_policy].name) {
+                    PyErr_NoMemory();
+                    goto error;
+                }
+                info->policy[info->n_policy].type = (enum blobmsg_type)arg_type;
+                info->n_policy++;
+            }
+        }
+        
+        pobj->methods[i].policy = info->policy;
+        pobj->methods[i].n_policy = info->n_policy;
+    }
+    
+    pobj->type.name = pobj->name;
+    pobj->type.methods = pobj->methods;
+    pobj->type.n_methods = pobj->n_methods;
+    pobj->obj.name = pobj->name;
+    pobj->obj.type = &pobj->type;
+    pobj->obj.methods = pobj->methods;
+    pobj->obj.n_methods = pobj->n_methods;
+    return pobj;
+    
+error:
+    published_object_free(pobj);
+    return NULL;
+}
+
+/* UbusClient.add_object() */
+static PyObject *UbusClient_add_object(UbusClientObject *self, PyObject *args) {
+    const char *name;
+    PyObject *methods;
+    int ret;
+    
+    if (!PyArg_ParseTuple(args, "sO!", &name, &PyDict_Type, &methods)) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (!self->connected) {
+        client_unlock(self);
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    struct published_object *pobj = published_object_new(self, name, methods);
+    if (!pobj) {
+        client_unlock(self);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_add_object(self->ctx, &pobj->obj);
+    Py_END_ALLOW_THREADS
+    
+    if (ret != UBUS_STATUS_OK) {
+        client_unlock(self);
+        published_object_free(pobj);
+        raise_status(ret, "Failed to add object '%s': %s (%d)",
+                      name, status_message(ret), ret);
+        return NULL;
+    }
+    
+    list_add_tail(&pobj->list, &self->objects);
+    client_unlock(self);
+    return PyLong_FromUnsignedLong(pobj->obj.id);
+}
+
+/* UbusClient.remove_object() */
+static PyObject *UbusClient_remove_object(UbusClientObject *self, PyObject *args) {
+    const char *name;
+    struct published_object *pobj;
+    
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    list_for_each_entry(pobj, &self->objects, list) {
+        if (strcmp(pobj->name, name) != 0) {
+            continue;
+        }
+        
+        if (self->connected) {
+            Py_BEGIN_ALLOW_THREADS
+            bus_remove_object(self->ctx, &pobj->obj);
+            Py_END_ALLOW_THREADS
+        }
+        
+        list_del(&pobj->list);
+        client_unlock(self);
+        published_object_free(pobj);
+        Py_RETURN_NONE;
+    }
+    
+    client_unlock(self);
+    PyErr_Format(PyExc_KeyError, "Object '%s' is not published by this client", name);
+    return NULL;
+}
+
+/* Free all published objects, must be called with the context lock
+ * held after the context is gone */
+static void client_clear_objects(UbusClientObject *self) {
+    struct published_object *pobj, *tmp;
+    
+    list_for_each_entry_safe(pobj, tmp, &self->objects, list) {
+        list_del(&pobj->list);
+        published_object_free(pobj);
+    }
+}
+
+/* UbusClient.process_events() */
+static PyObject *UbusClient_process_events(UbusClientObject *self, PyObject *args) {
+    double timeout = 0;
+    
+    if (!PyArg_ParseTuple(args, "|d", &timeout)) {
+        return NULL;
+    }
+    
+    /* Nothing to wait for if events are already queued */
+    if (timeout > 0 && self->connected && list_empty(&self->ctx->pending) &&
+        self->event_tail == __atomic_load_n(&self->event_head, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = self->ctx->sock.fd, .events = POLLIN };
+        
+        Py_BEGIN_ALLOW_THREADS
+        poll(&pfd, 1, (int)(timeout * 1000));
+        Py_END_ALLOW_THREADS
+    }
+    
+    client_lock(self);
+    
+    if (self->connected) {
+        /* The socket is non-blocking, this only handles what has arrived */
+        Py_BEGIN_ALLOW_THREADS
+        ubus_handle_event(self->ctx);
+        Py_END_ALLOW_THREADS
+        
+        /* A hung up socket stays readable, do not leave it to the loop */
+        if (self->ctx->sock.eof) {
+            client_reconnect_locked(self);
+        }
+    }
+    
+    client_unlock(self);
+    
+    if (client_drain_events(self) < 0) {
+        return NULL;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* Clients whose I/O thread is running, only touched with the GIL held */
+static LIST_HEAD(io_clients);
+
+/* Take the context lock on the I/O thread, returns -1 if the thread is asked
+ * to stop first. Waits in slices so a stop is not held up by a caller that
+ * owns the lock itself while it joins the thread. */
+static int io_lock(UbusClientObject *self) {
+    struct timespec ts;
+    
+    while (!__atomic_load_n(&self->io_stop, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += IO_LOCK_POLL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        
+        if (pthread_mutex_timedlock(&self->lock, &ts) == 0) {
+            client_lock_taken(self);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void io_schedule(UbusClientObject *self);
+
+/* Pending call handing queued events to their callbacks on the main thread */
+static int io_pending_cb(void *arg) {
+    UbusClientObject *self = (UbusClientObject *)arg;
+    
+    if (client_drain_events(self) < 0) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    __atomic_store_n(&self->io_pending, 0, __ATOMIC_RELEASE);
+    
+    /* The thread exited while this call was scheduled */
+    if (self->io_orphaned) {
+        self->io_orphaned = 0;
+        Py_DECREF(self);
+        return 0;
+    }
+    
+    /* The I/O thread does not schedule another call for events queued
+     * while this one ran */
+    if (__atomic_load_n(&self->io_state, __ATOMIC_ACQUIRE) == IO_RUNNING &&
+        self->event_tail != __atomic_load_n(&self->event_head, __ATOMIC_ACQUIRE)) {
+        io_schedule(self);
+    }
+    return 0;
+}
+
+/* Schedule io_pending_cb() unless it already is, it drains every queued event */
+static void io_schedule(UbusClientObject *self) {
+    if (!__atomic_exchange_n(&self->io_pending, 1, __ATOMIC_ACQ_REL) &&
+        Py_AddPendingCall(io_pending_cb, self) < 0) {
+        /* Queue full, the next batch tries again */
+        __atomic_store_n(&self->io_pending, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Hand the events queued by one round of dispatching to Python, runs on the
+ * I/O thread without the GIL. The GIL is taken once for the whole batch. */
+static void io_deliver(UbusClientObject *self) {
+    if (__atomic_load_n(&self->event_tail, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&self->event_head, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    if (self->io_main) {
+        io_schedule(self);
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    if (client_drain_events(self) < 0) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    PyGILState_Release(gstate);
+}
+
+/* Body of the I/O thread: wait for the socket without the GIL, dispatch it
+ * with the context lock held, then hand what was queued to Python. Replies
+ * to async calls and published object methods are handled while
+ * dispatching, their callbacks take the GIL themselves. */
+static void *io_thread_main(void *arg) {
+    UbusClientObject *self = (UbusClientObject *)arg;
+    int backoff_ms = 0;
+    
+    while (io_lock(self) == 0) {
+        /* Read again every round, reconnecting replaces the socket */
+        int fd = self->connected ? self->ctx->sock.fd : -1;
+        int queued = self->connected && !list_empty(&self->ctx->pending);
+        client_unlock(self);
+        
+        /* disconnect() called by a callback on this thread */
+        if (fd < 0) {
+            break;
+        }
+        
+        /* A hung up socket stays readable, it is left alone between
+         * reconnect attempts */
+        struct pollfd pfd[2] = {
+            { .fd = self->io_wakeup[0], .events = POLLIN },
+            { .fd = backoff_ms ? -1 : fd, .events = POLLIN },
+        };
+        
+        if (poll(pfd, 2, queued ? 0 : backoff_ms ? backoff_ms : -1) < 0 && errno != EINTR) {
+            break;
+        }
+        
+        if (pfd[0].revents) {
+            char buf[64];
+            while (read(self->io_wakeup[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+        
+        if (io_lock(self) < 0) {
+            break;
+        }
+        
+        if (self->connected) {
+            /* The socket is non-blocking, this only handles what has arrived */
+            ubus_handle_event(self->ctx);
+            
+            if (self->ctx->sock.eof) {
+                PyGILState_STATE gstate = PyGILState_Ensure();
+                int ret = client_reconnect_locked(self);
+                PyGILState_Release(gstate);
+                
+                if (ret == UBUS_STATUS_OK) {
+                    backoff_ms = 0;
+                }
+                else {
+                    backoff_ms = backoff_ms ? backoff_ms * 2 : IO_BACKOFF_MIN_MS;
+                    if (backoff_ms > IO_BACKOFF_MAX_MS) {
+                        backoff_ms = IO_BACKOFF_MAX_MS;
+                    }
+                }
+            }
+        }
+        client_unlock(self);
+        
+        io_deliver(self);
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    __atomic_store_n(&self->io_state, IO_EXITED, __ATOMIC_RELEASE);
+    list_del_init(&self->io_list);
+    
+    /* A scheduled pending call still uses the client and drops the
+     * reference once it ran */
+    if (__atomic_load_n(&self->io_pending, __ATOMIC_ACQUIRE)) {
+        self->io_orphaned = 1;
+    }
+    else {
+        Py_DECREF(self);
+    }
+    PyGILState_Release(gstate);
+    return NULL;
+}
+
+/* Close the wake-up pipe of the I/O thread, must be called with the context
+ * lock held once the thread is gone */
+static void client_io_close(UbusClientObject *self) {
+    for (int i = 0; i < 2; i++) {
+        if (self->io_wakeup[i] >= 0) {
+            close(self->io_wakeup[i]);
+            self->io_wakeup[i] = -1;
+        }
+    }
+}
+
+/* Join an I/O thread that exited or was asked to stop, must be called with
+ * the GIL held. Does not wait for the thread it is called on; that one is
+ * joined by the next start or stop. */
+static void client_io_join(UbusClientObject *self) {
+    if (self->io_state == IO_IDLE || self->io_joining ||
+        pthread_equal(pthread_self(), self->io_thread)) {
+        return;
+    }
+    
+    /* The thread needs the GIL to exit */
+    self->io_joining = 1;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->io_thread, NULL);
+    Py_END_ALLOW_THREADS
+    self->io_joining = 0;
+    
+    client_lock(self);
+    __atomic_store_n(&self->io_state, IO_IDLE, __ATOMIC_RELEASE);
+    client_io_close(self);
+    client_unlock(self);
+}
+
+/* Ask the I/O thread to stop and join it, must be called with the GIL held
+ * and without the context lock unless owned recursively */
+static void client_stop_io_thread(UbusClientObject *self) {
+    if (self->io_state == IO_IDLE) {
+        return;
+    }
+    
+    __atomic_store_n(&self->io_stop, 1, __ATOMIC_RELEASE);
+    client_lock(self);
+    client_io_wake(self);
+    client_unlock(self);
+    
+    client_io_join(self);
+}
+
+/* UbusClient.start_io_thread() */
+static PyObject *UbusClient_start_io_thread(UbusClientObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"main_thread", NULL};
+    int main_thread = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &main_thread)) {
+        return NULL;
+    }
+    
+    if (self->io_state == IO_RUNNING && !self->io_stop) {
+        Py_RETURN_NONE;
+    }
+    
+    client_io_join(self);
+    if (self->io_state != IO_IDLE) {
+        PyErr_SetString(PyExc_RuntimeError, "I/O thread is still stopping");
+        return NULL;
+    }
+    
+    client_lock(self);
+    
+    if (!self->connected) {
+        client_unlock(self);
+        raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+        return NULL;
+    }
+    
+    if (pipe(self->io_wakeup) < 0) {
+        self->io_wakeup[0] = self->io_wakeup[1] = -1;
+        client_unlock(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        fcntl(self->io_wakeup[i], F_SETFL, O_NONBLOCK);
+        fcntl(self->io_wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
+    
+    self->io_main = (char)main_thread;
+    self->io_stop = 0;
+    __atomic_store_n(&self->io_state, IO_RUNNING, __ATOMIC_RELEASE);
+    
+    /* Signals are left to the threads Python runs on */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    
+    /* The thread owns a reference until it exits */
+    Py_INCREF(self);
+    int err = pthread_create(&self->io_thread, NULL, io_thread_main, self);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (err) {
+        __atomic_store_n(&self->io_state, IO_IDLE, __ATOMIC_RELEASE);
+        client_io_close(self);
+        client_unlock(self);
+        Py_DECREF(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    
+    list_add_tail(&self->io_list, &io_clients);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+/* UbusClient.stop_io_thread() */
+static PyObject *UbusClient_stop_io_thread(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    client_stop_io_thread(self);
+    Py_RETURN_NONE;
+}
+
+/* Stop every I/O thread before the interpreter finalizes, their callbacks
+ * could not take the GIL anymore. Registered with atexit. */
+static PyObject *io_threads_stop(PyObject *module, PyObject *args) {
+    (void)module;
+    (void)args;
+    
+    while (!list_empty(&io_clients)) {
+        UbusClientObject *client = list_first_entry(&io_clients, UbusClientObject, io_list);
+        
+        Py_INCREF(client);
+        list_del_init(&client->io_list);
+        client_stop_io_thread(client);
+        Py_DECREF(client);
+    }
+    
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef io_threads_stop_def = {
+    "stop_io_threads", (PyCFunction)io_threads_stop, METH_NOARGS, NULL
+};
+
+/* One entry of a call_many() batch */
+struct multi_request {
+    struct ubus_request req;
+    UbusClientObject *client;
+    PyObject *result;
+    int status;
+    int pending;
+    int done;       /* Completed, or failed before it was sent */
+};
+
+/* Data callback for call_many() requests */
+static void multi_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct multi_request *mr = container_of(req, struct multi_request, req);
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    PyObject *decoded = client_check_reply(mr->client, msg, 1, NULL) < 0 ? NULL :
+                        blob_table_to_python(blob_data(msg), blob_len(msg));
+    Py_XDECREF(mr->result);
+    mr->result = decoded ? decoded : fetch_error();
+    
+    PyGILState_Release(gstate);
+}
+
+/* Send the calls of a batch that are neither out nor done. Returns -1 when
+ * the whole batch fails. Must be called with the context lock held. */
+static int multi_send(UbusClientObject *self, PyObject **items, struct multi_request *reqs, Py_ssize_t n) {
+    unsigned int connection = self->connection;
+    
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *object, *params = NULL;
+        const char *method;
+        
+        if (reqs[i].pending || reqs[i].done) {
+            continue;
+        }
+        
+        if (!PyTuple_Check(items[i])) {
+            PyErr_SetString(PyExc_TypeError, "calls must be (object, method[, params]) tuples");
+            return -1;
+        }
+        
+        if (!PyArg_ParseTuple(items[i], "Os|O", &object, &method, &params)) {
+            return -1;
+        }
+        
+        struct call_target target = { .timing = NULL };
+        struct blob_buf local_buf, *b = client_buf_acquire(self, &local_buf);
+        
+        if (client_prepare_call(self, object, method, params, b, &target) < 0) {
+            client_buf_release(self, b);
+            
+            /* Not connected fails the whole batch, anything else just this entry */
+            if (!self->connected) {
+                return -1;
+            }
+            reqs[i].result = fetch_error();
+            reqs[i].done = 1;
+            continue;
+        }
+        
+        /* Preparing reconnects a socket that hung up, the requests sent
+         * before are lost with it */
+        if (self->connection != connection) {
+            for (Py_ssize_t j = 0; j < i; j++) {
+                if (reqs[j].pending && !reqs[j].done) {
+                    ubus_abort_request(self->ctx, &reqs[j].req);
+                    reqs[j].status = UBUS_STATUS_CONNECTION_FAILED;
+                    reqs[j].done = 1;
+                }
+            }
+            connection = self->connection;
+        }
+        
+        int status;
+        Py_BEGIN_ALLOW_THREADS
+        status = bus_invoke_async(self->ctx, target.id, method, b->head, &reqs[i].req);
+        Py_END_ALLOW_THREADS
+        
+        client_buf_release(self, b);
+        
+        if (status != UBUS_STATUS_OK) {
+            reqs[i].status = status;
+            reqs[i].result = call_error(status);
+            reqs[i].done = 1;
+            continue;
+        }
+        
+        /* Registered at once, so replies arriving out of order are taken
+         * while an earlier request is waited for */
+        reqs[i].req.data_cb = multi_data_cb;
+        reqs[i].client = self;
+        reqs[i].pending = 1;
+        ubus_complete_request_async(self->ctx, &reqs[i].req);
+    }
+    
+    return 0;
+}
+
+/* Issue every call of a batch before waiting for any reply, the whole
+ * batch shares one timeout. Must be called with the context lock held. */
+static int client_call_many_locked(UbusClientObject *self, PyObject *seq,
+                                   struct multi_request *reqs, Py_ssize_t n, int timeout_ms) {
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    int64_t deadline = deadline_after(timeout_ms);
+    int retried = 0;
+    
+    for (;;) {
+        unsigned int connection = self->connection;
+        
+        if (multi_send(self, items, reqs, n) < 0) {
+            for (Py_ssize_t i = 0; i < n; i++) {
+                if (reqs[i].pending && !reqs[i].done) {
+                    ubus_abort_request(self->ctx, &reqs[i].req);
+                }
+                reqs[i].pending = 0;
+            }
+            return -1;
+        }
+        
+        /* Replies to later requests are handled while waiting for earlier ones,
+         * so this waits about one round-trip for the whole batch */
+        Py_BEGIN_ALLOW_THREADS
+        for (Py_ssize_t i = 0; i < n; i++) {
+            if (!reqs[i].pending || reqs[i].done) {
+                continue;
+            }
+            
+            int timeout = deadline_remaining(deadline);
+            if (timeout < 0 && !reqs[i].req.status_msg) {
+                ubus_abort_request(self->ctx, &reqs[i].req);
+                reqs[i].status = UBUS_STATUS_TIMEOUT;
+            }
+            else {
+                /* A request already answered completes at once, even when the
+                 * budget is spent */
+                reqs[i].status = ubus_complete_request(self->ctx, &reqs[i].req, timeout < 0 ? 1 : timeout);
+            }
+            reqs[i].done = 1;
+        }
+        Py_END_ALLOW_THREADS
+        
+        /* The socket hung up (e.g. ubusd restarted): reconnect, unless
+         * preparing a later call already did, and send the calls it took
+         * down once more, as call() does */
+        int lost = 0;
+        for (Py_ssize_t i = 0; i < n; i++) {
+            lost |= reqs[i].status == UBUS_STATUS_CONNECTION_FAILED;
+        }
+        
+        int timeout;
+        uint32_t no_id = 0;
+        if (!lost || retried || PyErr_Occurred()) {
+            break;
+        }
+        if (self->connection == connection ?
+            client_retry_connection(self, NULL, &no_id, deadline, &timeout) != UBUS_STATUS_OK :
+            deadline_remaining(deadline) < 0) {
+            break;
+        }
+        retried = 1;
+        
+        for (Py_ssize_t i = 0; i < n; i++) {
+            if (reqs[i].status == UBUS_STATUS_CONNECTION_FAILED) {
+                Py_CLEAR(reqs[i].result);
+                reqs[i].status = UBUS_STATUS_OK;
+                reqs[i].pending = 0;
+                reqs[i].done = 0;
+            }
+        }
+    }
+    
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (!reqs[i].pending) {
+            continue;
+        }
+        
+        if (reqs[i].result && PyExceptionInstance_Check(reqs[i].result)) {
+            continue;
+        }
+        
+        if (reqs[i].status != UBUS_STATUS_OK) {
+            if (reqs[i].status == UBUS_STATUS_NOT_FOUND) {
+                id_cache_suspect_id(self, reqs[i].req.peer);
+            }
+            Py_XDECREF(reqs[i].result);
+            reqs[i].result = call_error(reqs[i].status);
+        }
+        else if (!reqs[i].result) {
+            reqs[i].result = PyDict_New();
+        }
+    }
+    
+    return 0;
+}
+
+/* UbusClient.call_many(calls, *, timeout=None) */
+static PyObject *UbusClient_call_many(UbusClientObject *self, PyObject *const *args,
+                                      Py_ssize_t nargs, PyObject *kwnames) {
+    static const char *const names[] = {"calls", "timeout"};
+    PyObject *out[2] = {NULL, NULL};
+    int timeout_ms = -1;
+    
+    if (fastcall_args("call_many", args, nargs, kwnames, names, 2, 1, 1, out) < 0 ||
+        timeout_arg(out[1], &timeout_ms) < 0) {
+        return NULL;
+    }
+    
+    PyObject *seq = PySequence_Fast(out[0], "calls must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+    
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    struct multi_request *reqs = PyMem_Calloc(n > 0 ? n : 1, sizeof(*reqs));
+    if (!reqs) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    
+    client_lock(self);
+    if (timeout_ms < 0) {
+        timeout_ms = self->timeout_ms;
+    }
+    int ret = client_call_many_locked(self, seq, reqs, n, timeout_ms);
+    client_schedule_pending(self);
+    client_unlock(self);
+    
+    PyObject *results = NULL;
+    
+    if (ret == 0) {
+        results = PyList_New(n);
+    }
+    
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (results && reqs[i].result) {
+            PyList_SET_ITEM(results, i, reqs[i].result);
+        }
+        else {
+            Py_XDECREF(reqs[i].result);
+        }
+    }
+    
+    /* An entry whose error could not be built leaves its slot empty */
+    if (results) {
+        for (Py_ssize_t i = 0; i < n; i++) {
+            if (!PyList_GET_ITEM(results, i)) {
+                Py_CLEAR(results);
+                if (!PyErr_Occurred()) {
+                    PyErr_NoMemory();
+                }
+                break;
+            }
+        }
+    }
+    
+    PyMem_Free(reqs);
+    Py_DECREF(seq);
+    return results;
+}
+
+/* base64 alphabet, and its inverse with 64 for padding and 255 for
+ * characters that are not part of it */
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static unsigned char b64_values[256];
+
+static void b64_init(void) {
+    memset(b64_values, 255, sizeof(b64_values));
+    for (int i = 0; i < 64; i++) {
+        b64_values[(unsigned char)b64_alphabet[i]] = (unsigned char)i;
+    }
+    b64_values['='] = 64;
+}
+
+/* Encode len bytes of src into dst, which needs room for (len + 2) / 3 * 4 chars */
+static size_t b64_encode_into(const unsigned char *src, size_t len, char *dst) {
+    char *out = dst;
+    size_t i;
+    
+    for (i = 0; i + 2 < len; i += 3) {
+        uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];
+        *out++ = b64_alphabet[v >> 18];
+        *out++ = b64_alphabet[(v >> 12) & 63];
+        *out++ = b64_alphabet[(v >> 6) & 63];
+        *out++ = b64_alphabet[v & 63];
+    }
+    
+    if (i < len) {
+        uint32_t v = (uint32_t)src[i] << 16 | (i + 1 < len ? (uint32_t)src[i + 1] << 8 : 0);
+        *out++ = b64_alphabet[v >> 18];
+        *out++ = b64_alphabet[(v >> 12) & 63];
+        *out++ = i + 1 < len ? b64_alphabet[(v >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+    
+    return (size_t)(out - dst);
+}
+
+/* Decode base64 into dst, which needs room for len / 4 * 3 + 3 bytes;
+ * whitespace is skipped. Returns the decoded length or -1 if src is not base64. */
+static Py_ssize_t b64_decode_into(const char *src, size_t len, unsigned char *dst) {
+    unsigned char *out = dst;
+    uint32_t v = 0;
+    int bits = 0, padding = 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = b64_values[(unsigned char)src[i]];
+        
+        if (c == 255) {
+            if (src[i] == ' ' || src[i] == '\n' || src[i] == '\r' || src[i] == '\t') {
+                continue;
+            }
+            return -1;
+        }
+        if (c == 64) {
+            padding++;
+            continue;
+        }
+        if (padding) {
+            return -1;
+        }
+        
+        v = v << 6 | c;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *out++ = (unsigned char)(v >> bits);
+        }
+    }
+    
+    return (Py_ssize_t)(out - dst);
+}
+
+/* Reply state of read_file() */
+struct file_read {
+    UbusClientObject *client;
+    Py_buffer *into;            /* Caller's buffer, or NULL to return bytes */
+    PyObject *result;           /* bytes, length as int, or the exception */
+};
+
+/* Data callback of read_file(), decodes the base64 "data" field straight
+ * into the result */
+static void file_read_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+    struct file_read *fr = (struct file_read *)req->priv;
+    struct blob_attr *pos, *data = NULL;
+    size_t rem;
+    
+    (void)type;
+    
+    if (!msg) {
+        return;
+    }
+    
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    if (client_check_reply(fr->client, msg, 1, NULL) < 0) {
+        Py_XSETREF(fr->result, fetch_error());
+        PyGILState_Release(gstate);
+        return;
+    }
+    
+    rem = blob_len(msg);
+    __blob_for_each_attr(pos, blob_data(msg), rem) {
+        if (blobmsg_type(pos) == BLOBMSG_TYPE_STRING && !strcmp(blobmsg_name(pos), "data") &&
+            blobmsg_check_attr(pos, true)) {
+            data = pos;
+        }
+    }
+    
+    if (!data) {
+        PyGILState_Release(gstate);
+        return;
+    }
+    
+    const char *text = blobmsg_get_string(data);
+    size_t len = strlen(text);
+    size_t room = len / 4 * 3 + 3;
+    Py_ssize_t n;
+    
+    Py_CLEAR(fr->result);
+    
+    if (fr->into) {
+        /* Bound the decode by the buffer without a scratch copy when the
+         * encoded size already shows it fits */
+        if ((size_t)fr->into->len >= room) {
+            n = b64_decode_into(text, len, fr->into->buf);
+        }
+        else {
+            unsigned char *scratch = PyMem_Malloc(room);
+            n = scratch ? b64_decode_into(text, len, scratch) : -2;
+            if (n > fr->into->len) {
+                PyErr_SetString(PyExc_ValueError, "buffer is too small for the file");
+                n = -2;
+            }
+            else if (n >= 0) {
+                memcpy(fr->into->buf, scratch, n);
+            }
+            if (!scratch) {
+                PyErr_NoMemory();
+            }
+            PyMem_Free(scratch);
+        }
+        
+        if (n >= 0) {
+            fr->result = PyLong_FromSsize_t(n);
+        }
+    }
+    else {
+        fr->result = PyBytes_FromStringAndSize(NULL, room);
+        n = fr->result ? b64_decode_into(text, len, (unsigned char *)PyBytes_AS_STRING(fr->result)) : -2;
+        if (n >= 0) {
+            _PyBytes_Resize(&fr->result, n);
+        }
+    }
+    
+    if (n == -1) {
+        PyErr_SetString(PyExc_ValueError, "file data is not valid base64");
+    }
+    if (!fr->result || n < 0) {
+        Py_CLEAR(fr->result);
+        fr->result = fetch_error();
+    }
+    
+    PyGILState_Release(gstate);
+}
+
+/* Read a file through rpcd's file object, must be called with the context lock held */
+static PyObject *client_read_file_locked(UbusClientObject *self, const char *path,
+                                         Py_buffer *into, int timeout_ms) {
+    struct blob_buf local_buf, *b;
+    struct id_cache_entry *entry;
+    struct file_read fr = { .client = self, .into = into };
+    int ret;
+    
+    if (!self->connected) {
+        return raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+    }
+    
+    client_dispatch_pending(self);
+    
+    entry = id_cache_resolve(self, "file", &ret);
+    if (!entry) {
+        return raise_call_error(ret);
+    }
+    
+    b = client_buf_acquire(self, &local_buf);
+    blob_buf_init(b, 0);
+    blobmsg_add_string(b, "path", path);
+    blobmsg_add_u8(b, "base64", 1);
+    
+    Py_BEGIN_ALLOW_THREADS
+    ret = bus_invoke(self->ctx, entry->id, "read", b->head, file_read_cb, &fr, timeout_ms);
+    Py_END_ALLOW_THREADS
+    
+    client_buf_release(self, b);
+    
+    if (ret != UBUS_STATUS_OK) {
+        Py_XDECREF(fr.result);
+        return raise_call_error(ret);
+    }
+    
+    if (fr.result && PyExceptionInstance_Check(fr.result)) {
+        return raise_error(fr.result);
+    }
+    
+    if (!fr.result) {
+        fr.result = into ? PyLong_FromLong(0) : PyBytes_FromStringAndSize(NULL, 0);
+    }
+    return fr.result;
+}
+
+/* UbusClient.read_file(path, *, into=None, timeout=None) */
+static PyObject *UbusClient_read_file(UbusClientObject *self, PyObject *const *args,
+                                      Py_ssize_t nargs, PyObject *kwnames) {
+    static const char *const names[] = {"path", "into", "timeout"};
+    PyObject *out[3] = {NULL, NULL, NULL};
+    int timeout_ms = self->timeout_ms;
+    Py_buffer into;
+    
+    if (fastcall_args("read_file", args, nargs, kwnames, names, 3, 1, 1, out) < 0) {
+        return NULL;
+    }
+    
+    const char *path = str_arg("read_file", "path", out[0]);
+    if (!path || timeout_arg(out[2], &timeout_ms) < 0) {
+        return NULL;
+    }
+    
+    int have_into = out[1] && out[1] != Py_None;
+    if (have_into && PyObject_GetBuffer(out[1], &into, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    PyObject *result = client_read_file_locked(self, path, have_into ? &into : NULL, timeout_ms);
+    client_schedule_pending(self);
+    client_unlock(self);
+    
+    if (have_into) {
+        PyBuffer_Release(&into);
+    }
+    return result;
+}
+
+/* Write a file through rpcd's file object in base64 chunks, FILE_WINDOW of
+ * them in flight at a time. Must be called with the context lock held. */
+static PyObject *client_write_file_locked(UbusClientObject *self, const char *path, Py_buffer *data,
+                                          Py_ssize_t chunk_size, int mode, int timeout_ms) {
+    struct ubus_request reqs[FILE_WINDOW];
+    int pending[FILE_WINDOW] = {0};
+    struct blob_buf local_buf, *b;
+    struct id_cache_entry *entry;
+    const unsigned char *src = data->buf;
+    Py_ssize_t offset = 0;
+    int status = UBUS_STATUS_OK;
+    int ret, slot = 0;
+    
+    if (!self->connected) {
+        return raise_status(UBUS_STATUS_CONNECTION_FAILED, "Not connected to ubus");
+    }
+    
+    client_dispatch_pending(self);
+    
+    entry = id_cache_resolve(self, "file", &ret);
+    if (!entry) {
+        return raise_call_error(ret);
+    }
+    uint32_t id = entry->id;
+    
+    b = client_buf_acquire(self, &local_buf);
+    
+    Py_BEGIN_ALLOW_THREADS
+    do {
+        Py_ssize_t len = data->len - offset < chunk_size ? data->len - offset : chunk_size;
+        
+        /* Reuse the oldest slot once its reply is in */
+        if (pending[slot]) {
+            ret = ubus_complete_request(self->ctx, &reqs[slot], timeout_ms);
+            pending[slot] = 0;
+            if (ret != UBUS_STATUS_OK) {
+                status = ret;
+                break;
+            }
+        }
+        
+        blob_buf_init(b, 0);
+        blobmsg_add_string(b, "path", path);
+        if (offset) {
+            blobmsg_add_u8(b, "append", 1);
+        }
+        else if (mode >= 0) {
+            blobmsg_add_u32(b, "mode", (uint32_t)mode);
+        }
+        blobmsg_add_u8(b, "base64", 1);
+        
+        char *text = blobmsg_alloc_string_buffer(b, "data", (len + 2) / 3 * 4 + 1);
+        if (!text) {
+            status = UBUS_STATUS_NO_MEMORY;
+            break;
+        }
+        text[b64_encode_into(src + offset, len, text)] = '\0';
+        blobmsg_add_string_buffer(b);
+        
+        memset(&reqs[slot], 0, sizeof(reqs[slot]));
+        ret = bus_invoke_async(self->ctx, id, "write", b->head, &reqs[slot]);
+        if (ret != UBUS_STATUS_OK) {
+            status = ret;
+            break;
+        }
+        /* Replies to later chunks may come in first */
+        ubus_complete_request_async(self->ctx, &reqs[slot]);
+        pending[slot] = 1;
+        slot = (slot + 1) % FILE_WINDOW;
+        offset += len;
+    } while (offset < data->len);
+    
+    /* Collect the rest in order, aborting them once one chunk failed */
+    for (int i = 0; i < FILE_WINDOW; i++, slot = (slot + 1) % FILE_WINDOW) {
+        if (!pending[slot]) {
+            continue;
+        }
+        
+        if (status != UBUS_STATUS_OK) {
+            ubus_abort_request(self->ctx, &reqs[slot]);
+        }
+        else if ((ret = ubus_complete_request(self->ctx, &reqs[slot], timeout_ms)) != UBUS_STATUS_OK) {
+            status = ret;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    client_buf_release(self, b);
+    
+    if (status != UBUS_STATUS_OK) {
+        return raise_call_error(status);
+    }
+    return PyLong_FromSsize_t(data->len);
+}
+
+/* UbusClient.write_file(path, data, *, mode=None, chunk_size=49152, timeout=None) */
+static PyObject *UbusClient_write_file(UbusClientObject *self, PyObject *const *args,
+                                       Py_ssize_t nargs, PyObject *kwnames) {
+    static const char *const names[] = {"path", "data", "mode", "chunk_size", "timeout"};
+    PyObject *out[5] = {NULL, NULL, NULL, NULL, NULL};
+    int timeout_ms = self->timeout_ms;
+    Py_ssize_t chunk_size = FILE_CHUNK_SIZE;
+    int mode = -1;
+    Py_buffer data;
+    
+    if (fastcall_args("write_file", args, nargs, kwnames, names, 5, 2, 2, out) < 0) {
+        return NULL;
+    }
+    
+    const char *path = str_arg("write_file", "path", out[0]);
+    if (!path || timeout_arg(out[4], &timeout_ms) < 0) {
+        return NULL;
+    }
+    
+    if (out[2] && out[2] != Py_None) {
+        long value = PyLong_AsLong(out[2]);
+        if (value == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (value < 0 || value > 07777) {
+            PyErr_SetString(PyExc_ValueError, "mode must be between 0 and 0o7777");
+            return NULL;
+        }
+        mode = (int)value;
+    }
+    
+    if (out[3] && out[3] != Py_None) {
+        chunk_size = PyLong_AsSsize_t(out[3]);
+        if (chunk_size == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (chunk_size < 1 || chunk_size > FILE_CHUNK_MAX) {
+            PyErr_Format(PyExc_ValueError, "chunk_size must be between 1 and %d", FILE_CHUNK_MAX);
+            return NULL;
+        }
+    }
+    
+    if (PyObject_GetBuffer(out[1], &data, PyBUF_C_CONTIGUOUS) < 0) {
+        return NULL;
+    }
+    
+    client_lock(self);
+    PyObject *result = client_write_file_locked(self, path, &data, chunk_size, mode, timeout_ms);
+    client_schedule_pending(self);
+    client_unlock(self);
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+/* UbusClient.stats() */
+static PyObject *UbusClient_stats(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    client_lock(self);
+    PyObject *result = stats_to_python(self->stats);
+    client_unlock(self);
+    return result;
+}
+
+/* UbusClient.reset_stats() */
+static PyObject *UbusClient_reset_stats(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    client_lock(self);
+    stats_reset(self->stats);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+
+#if PYUBUS_WITH_CACHE
+/* Parse the (object, method, ttl) arguments of set_cache_ttl() */
+static int cache_ttl_args(PyObject *args, const char **object, const char **method, int *ttl_ms) {
+    PyObject *ttl;
+    
+    *ttl_ms = 0;
+    if (!PyArg_ParseTuple(args, "ssO", object, method, &ttl)) {
+        return -1;
+    }
+    return timeout_arg(ttl, ttl_ms);
+}
+
+/* Set a cache rule and drop the replies cached under the old rules */
+static PyObject *client_set_cache_ttl(UbusClientObject *self, const char *object,
+                                      const char *method, int ttl_ms) {
+    client_lock(self);
+    int ret = cache_rule_set(self, object, method, ttl_ms);
+    reply_cache_clear(self);
+    client_unlock(self);
+    
+    if (ret < 0) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+/* UbusClient.set_cache_ttl(object, method, ttl) */
+static PyObject *UbusClient_set_cache_ttl(UbusClientObject *self, PyObject *args) {
+    const char *object, *method;
+    int ttl_ms;
+    
+    if (cache_ttl_args(args, &object, &method, &ttl_ms) < 0) {
+        return NULL;
+    }
+    return client_set_cache_ttl(self, object, method, ttl_ms);
+}
+
+/* UbusClient.clear_cache() */
+static PyObject *UbusClient_clear_cache(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    client_lock(self);
+    reply_cache_clear(self);
+    client_unlock(self);
+    Py_RETURN_NONE;
+}
+#endif  /* PYUBUS_WITH_CACHE */
+
+/* Attach a shared cache segment, replacing the one attached before */
+static int client_attach_shared(UbusClientObject *self, const char *path, Py_ssize_t size,
+                                int replies, int watch) {
+    struct shm_segment *shm;
+    
+    Py_BEGIN_ALLOW_THREADS
+    shm = shm_attach(path, (size_t)size);
+    Py_END_ALLOW_THREADS
+    
+    if (!shm) {
+        if (errno == EINVAL) {
+            PyErr_Format(PyExc_ValueError, "%s is not a compatible shared cache", path);
+        }
+        else {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        }
+        return -1;
+    }
+    shm->replies = (char)replies;
+    
+    client_lock(self);
+    if (self->shm) {
+        shm_detach(self->shm);
+    }
+    self->shm = shm;
+    
+    /* Leave the object events to the process that keeps the segment current */
+    if (self->connected && self->watch_objects != watch) {
+        Py_BEGIN_ALLOW_THREADS
+        if (watch) {
+            self->objects_watched = !client_watch_objects(self->ctx, &self->object_event);
+        }
+        else {
+            bus_unregister_event_handler(self->ctx, &self->object_event);
+            self->objects_watched = 0;
+        }
+        Py_END_ALLOW_THREADS
+    }
+    self->watch_objects = (char)watch;
+    client_unlock(self);
+    return 0;
+}
+
+/* Detach the shared cache segment and watch object events again */
+static void client_detach_shared(UbusClientObject *self) {
+    client_lock(self);
+    if (self->shm) {
+        shm_detach(self->shm);
+        self->shm = NULL;
+    }
+    
+    if (self->connected && !self->watch_objects) {
+        /* Objects may have come and gone unnoticed meanwhile */
+        id_cache_clear(self);
+        Py_BEGIN_ALLOW_THREADS
+        self->objects_watched = !client_watch_objects(self->ctx, &self->object_event);
+        Py_END_ALLOW_THREADS
+    }
+    self->watch_objects = 1;
+    client_unlock(self);
+}
+
+/* Parse the arguments of attach_shared_cache() */
+static int shared_cache_args(PyObject *args, PyObject *kwds, const char **path, Py_ssize_t *size,
+                             int *replies, int *watch) {
+    static char *kwlist[] = {"path", "size", "replies", "watch", NULL};
+    
+    *path = "/dev/shm/pyubus";
+    *size = SHM_DEFAULT_SIZE;
+    *replies = 0;
+    *watch = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s$npp", kwlist, path, size, replies, watch)) {
+        return -1;
+    }
+    
+    if (*size < SHM_HEADER_SIZE + SHM_ID_SLOTS * SHM_ID_SLOT_SIZE) {
+        PyErr_Format(PyExc_ValueError, "size must be at least %d bytes",
+                     SHM_HEADER_SIZE + SHM_ID_SLOTS * SHM_ID_SLOT_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+/* UbusClient.attach_shared_cache(path="/dev/shm/pyubus", *, size, replies, watch) */
+static PyObject *UbusClient_attach_shared_cache(UbusClientObject *self, PyObject *args, PyObject *kwds) {
+    const char *path;
+    Py_ssize_t size;
+    int replies, watch;
+    
+    if (shared_cache_args(args, kwds, &path, &size, &replies, &watch) < 0 ||
+        client_attach_shared(self, path, size, replies, watch) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* UbusClient.detach_shared_cache() */
+static PyObject *UbusClient_detach_shared_cache(UbusClientObject *self, PyObject *args) {
+    (void)args;
+    
+    client_detach_shared(self);
+    Py_RETURN_NONE;
+}
+
+/* UbusClient methods table */
+static PyMethodDef UbusClient_methods[] = {
+    {"connect", (PyCFunction)UbusClient_connect, METH_VARARGS,
+     "Connect to ubus daemon"},
+    {"disconnect", (PyCFunction)UbusClient_disconnect, METH_NOARGS,
+     "Disconnect from ubus daemon"},
+    {"list", (PyCFunction)(void (*)(void))UbusClient_list, METH_FASTCALL | METH_KEYWORDS,
+     "List ubus objects"},
+    {"call", (PyCFunction)(void (*)(void))UbusClient_call, METH_FASTCALL | METH_KEYWORDS,
+     "Call ubus method"},
+    {"call_json", (PyCFunction)(void (*)(void))UbusClient_call_json, METH_FASTCALL | METH_KEYWORDS,
+     "Call ubus method and return its reply as compact JSON text"},
+    {"resolve", (PyCFunction)UbusClient_resolve, METH_O,
+     "Resolve an object name to its ubus object ID"},
+    {"prepare", (PyCFunction)(void (*)(void))UbusClient_prepare, METH_FASTCALL | METH_KEYWORDS,
+     "Resolve and encode a call once, returning a callable handle for it"},
+    {"call_many", (PyCFunction)(void (*)(void))UbusClient_call_many, METH_FASTCALL | METH_KEYWORDS,
+     "Pipeline a batch of (object, method[, params]) calls over the connection"},
+    {"call_async", (PyCFunction)(void (*)(void))UbusClient_call_async, METH_FASTCALL | METH_KEYWORDS,
+     "Start a ubus method call and return an asyncio future for its result"},
+    {"call_iter", (PyCFunction)(void (*)(void))UbusClient_call_iter, METH_FASTCALL | METH_KEYWORDS,
+     "Call a ubus method and iterate over the (name, value) pairs of its reply as they arrive"},
+    {"fileno", (PyCFunction)UbusClient_fileno, METH_NOARGS,
+     "File descriptor of the ubus socket"},
+    {"process_events", (PyCFunction)UbusClient_process_events, METH_VARARGS,
+     "Dispatch replies and events from the ubus socket, waiting up to timeout seconds"},
+    {"start_io_thread", (PyCFunction)(void (*)(void))UbusClient_start_io_thread, METH_VARARGS | METH_KEYWORDS,
+     "Dispatch the ubus socket on a native background thread instead of process_events()"},
+    {"stop_io_thread", (PyCFunction)UbusClient_stop_io_thread, METH_NOARGS,
+     "Stop the thread started by start_io_thread() and wait for it to exit"},
+#if PYUBUS_WITH_EVENTS
+    {"listen", (PyCFunction)UbusClient_listen, METH_VARARGS,
+     "Call callback(type, data) for ubus events matching pattern"},
+    {"unlisten", (PyCFunction)UbusClient_unlisten, METH_VARARGS,
+     "Remove the listeners registered for pattern"},
+    {"subscribe", (PyCFunction)UbusClient_subscribe, METH_VARARGS,
+     "Call callback(type, data) for notifications sent by an object"},
+    {"unsubscribe", (PyCFunction)UbusClient_unsubscribe, METH_VARARGS,
+     "Remove the subscriptions to an object"},
+#endif
+    {"add_object", (PyCFunction)UbusClient_add_object, METH_VARARGS,
+     "Publish an object whose methods are handled by Python callables"},
+    {"remove_object", (PyCFunction)UbusClient_remove_object, METH_VARARGS,
+     "Remove an object published with add_object()"},
+    {"read_file", (PyCFunction)(void (*)(void))UbusClient_read_file, METH_FASTCALL | METH_KEYWORDS,
+     "Read a file through the rpcd file object as bytes, or into a writable buffer"},
+    {"write_file", (PyCFunction)(void (*)(void))UbusClient_write_file, METH_FASTCALL | METH_KEYWORDS,
+     "Write bytes or any buffer to a file through the rpcd file object"},
+    {"stats", (PyCFunction)UbusClient_stats, METH_NOARGS,
+     "Call counts and per-phase latency histograms by (object, method)"},
+    {"reset_stats", (PyCFunction)UbusClient_reset_stats, METH_NOARGS,
+     "Zero the call statistics"},
+#if PYUBUS_WITH_CACHE
+    {"set_cache_ttl", (PyCFunction)UbusClient_set_cache_ttl, METH_VARARGS,
+     "Cache the replies of an (object, method) for ttl seconds, None or 0 stops caching"},
+    {"clear_cache", (PyCFunction)UbusClient_clear_cache, METH_NOARGS,
+     "Drop every cached reply"},
+#endif
+    {"attach_shared_cache", (PyCFunction)(void (*)(void))UbusClient_attach_shared_cache,
+     METH_VARARGS | METH_KEYWORDS,
+     "Share resolved object IDs, and optionally cached replies, with other processes through a file in /dev/shm"},
+    {"detach_shared_cache", (PyCFunction)UbusClient_detach_shared_cache, METH_NOARGS,
+     "Stop using the shared cache segment"},
+    {NULL}  /* Sentinel */
+};
+
+/* UbusClient.timeout getter, in seconds */
+static PyObject *UbusClient_get_timeout(UbusClientObject *self, void *closure) {
+    (void)closure;
+    return PyFloat_FromDouble(self->timeout_ms / 1000.0);
+}
+
+/* UbusClient.timeout setter */
+static int UbusClient_set_timeout(UbusClientObject *self, PyObject *value, void *closure) {
+    (void)closure;
+    
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete timeout");
+        return -1;
+    }
+    
+    if (value == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "timeout must be a number");
+        return -1;
+    }
+    return timeout_arg(value, &self->timeout_ms);
+}
+
+/* UbusClient.io_thread getter */
+static PyObject *UbusClient_get_io_thread(UbusClientObject *self, void *closure) {
+    (void)closure;
+    return PyBool_FromLong(self->io_state == IO_RUNNING && !self->io_stop);
+}
+
+/* UbusClient members table */
+static PyMemberDef UbusClient_members[] = {
+    {"timeout_ms", T_INT, offsetof(UbusClientObject, timeout_ms), READONLY,
+     "Default timeout for ubus calls in milliseconds"},
+    {"connected", T_BOOL, offsetof(UbusClientObject, connected), READONLY,
+     "Connection status"},
+    {"buffer_limit", T_INT, offsetof(UbusClientObject, buffer_limit), 0,
+     "Largest encode buffer in bytes kept for reuse between calls"},
+    {"events_dropped", T_ULONG, offsetof(UbusClientObject, events_dropped), READONLY,
+     "Events dropped because the event queue was full"},
+    {"reconnects", T_ULONG, offsetof(UbusClientObject, reconnects), READONLY,
+     "Times the connection was re-established after the socket hung up"},
+    {"stats_enabled", T_BOOL, offsetof(UbusClientObject, stats_enabled), 0,
+     "Whether calls are timed for stats()"},
+    {"cache_limit", T_PYSSIZET, offsetof(UbusClientObject, cache_limit), 0,
+     "Largest number of bytes the reply cache may hold"},
+    {"cache_bytes", T_PYSSIZET, offsetof(UbusClientObject, cache_bytes), READONLY,
+     "Bytes held by the reply cache"},
+    {"cache_hits", T_ULONG, offsetof(UbusClientObject, cache_hits), READONLY,
+     "Calls answered from the reply cache"},
+    {"cache_misses", T_ULONG, offsetof(UbusClientObject, cache_misses), READONLY,
+     "Calls to cached methods that had to go to ubusd"},
+    {"coalesce", T_BOOL, offsetof(UbusClientObject, coalesce), 0,
+     "Whether identical calls in flight at the same time share one request"},
+    {"coalesced", T_ULONG, offsetof(UbusClientObject, coalesced), READONLY,
+     "Calls answered by sharing the request of an identical call"},
+    {"max_reply_size", T_PYSSIZET, offsetof(UbusClientObject, max_reply_size), 0,
+     "Largest reply in bytes accepted before UbusReplyLimitError is raised, 0 for no limit"},
+    {"max_reply_depth", T_INT, offsetof(UbusClientObject, max_reply_depth), 0,
+     "Deepest nesting of tables and arrays accepted in a reply, 0 for no limit"},
+    {"bytes_received", T_ULONGLONG, offsetof(UbusClientObject, bytes_received), READONLY,
+     "Bytes of replies and events received"},
+    {"bytes_decoded", T_ULONGLONG, offsetof(UbusClientObject, bytes_decoded), READONLY,
+     "Bytes of replies decoded into Python objects"},
+    {"decode_peak", T_ULONGLONG, offsetof(UbusClientObject, decode_peak), READONLY,
+     "Estimated bytes allocated by the largest reply decoded"},
+    {"shared_hits", T_ULONG, offsetof(UbusClientObject, shared_hits), READONLY,
+     "Object IDs and replies taken from the shared cache segment"},
+    {NULL}  /* Sentinel */
+};
+
+/* UbusClient.shared_cache getter */
+static PyObject *UbusClient_get_shared_cache(UbusClientObject *self, void *closure) {
+    (void)closure;
+    
+    if (!self->shm) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_DecodeFSDefault(self->shm->path);
+}
+
+static PyGetSetDef UbusClient_getset[] = {
+    {"timeout", (getter)UbusClient_get_timeout, (setter)UbusClient_set_timeout,
+     "Default timeout for ubus calls in seconds, 0 waits without limit", NULL},
+    {"io_thread", (getter)UbusClient_get_io_thread, NULL,
+     "Whether a thread started by start_io_thread() is dispatching the socket", NULL},
+    {"shared_cache", (getter)UbusClient_get_shared_cache, NULL,
+     "Path of the attached shared cache segment, None if there is none", NULL},
+    {NULL}  /* Sentinel */
+};
+
+/* UbusClient type definition */
+static PyTypeObject UbusClientType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "ubus_native.UbusClient",
+    .tp_doc = "Native ubus client using libubus",
+    .tp_basicsize = sizeof(UbusClientObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = UbusClient_new,
+    .tp_init = (initproc)UbusClient_init,
+    .tp_dealloc = (destructor)UbusClient_dealloc,
+    .tp_methods = UbusClient_methods,
+    .tp_members = UbusClient_members,
+    .tp_getset = UbusClient_getset,
+};
+
+/* Pool of connections for callers on several threads. Each context keeps
+ * its own lock, so one request per context can be in flight at a time. */
+typedef struct {
+    PyObject_HEAD
+    UbusClientObject **clients;
+    int size;
+    unsigned int next;
+    /* Identical calls in flight on any context share one request */
+    char coalesce;
+    unsigned long coalesced;
+    struct flight_table flights;
+} UbusPoolObject;
+
+/* UbusPool.__init__ */
+static int UbusPool_init(UbusPoolObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"size", "timeout", "stats", "coalesce", "max_reply_size", "max_reply_depth", NULL};
+    int size = 4;
+    PyObject *timeout = Py_None;
+    int stats = 0;
+    int coalesce = 0;
+    Py_ssize_t max_reply_size = 0;
+    int max_reply_depth = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iOppni", kwlist, &size, &timeout, &stats, &coalesce,
+                                     &max_reply_size, &max_reply_depth)) {
+        return -1;
+    }
+    
+    if (size < 1) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 1");
+        return -1;
+    }
+    
+    if (self->clients) {
+        PyErr_SetString(PyExc_RuntimeError, "UbusPool is already initialised");
+        return -1;
+    }
+    
+    self->clients = PyMem_Calloc(size, sizeof(*self->clients));
+    if (!self->clients) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->coalesce = (char)coalesce;
+    flight_table_init(&self->flights);
+    
+    for (int i = 0; i < size; i++) {
+        self->clients[i] = (UbusClientObject *)PyObject_CallFunctionObjArgs((PyObject *)&UbusClientType, timeout, NULL);
+        if (!self->clients[i]) {
+            return -1;
+        }
+        self->clients[i]->stats_enabled = (char)stats;
+        self->clients[i]->max_reply_size = max_reply_size;
+        self->clients[i]->max_reply_depth = max_reply_depth;
+        self->size = i + 1;
+    }
+    
+    return 0;
+}
+
+/* UbusPool.__dealloc__ */
+static void UbusPool_dealloc(UbusPoolObject *self) {
+    for (int i = 0; i < self->size; i++) {
+        Py_XDECREF(self->clients[i]);
+    }
+    if (self->clients) {
+        flight_table_destroy(&self->flights);
+    }
+    PyMem_Free(self->clients);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Fail with an exception if the pool was never initialised */
+static int pool_check(UbusPoolObject *self) {
+    if (!self->size) {
+        PyErr_SetString(PyExc_RuntimeError, "UbusPool is not initialised");
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether the calling thread holds the lock of any context of the pool */
+static int pool_lock_owned(UbusPoolObject *self) {
+    for (int i = 0; i < self->size; i++) {
+        if (client_lock_owned(self->clients[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Pick a context and take its lock: the first idle one from a rotating
+ * start, or the start one when all of them are busy */
+static UbusClientObject *pool_checkout(UbusPoolObject *self) {
+    unsigned int start = __atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED);
+    
+    for (int i = 0; i < self->size; i++) {
+        UbusClientObject *client = self->clients[(start + i) % self->size];
+        if (pthread_mutex_trylock(&client->lock) == 0) {
+            client_lock_taken(client);
+            return client;
+        }
+    }
+    
+    UbusClientObject *client = self->clients[start % self->size];
+    client_lock(client);
+    return client;
+}
+
+/* UbusPool.connect() */
+static PyObject *UbusPool_connect(UbusPoolObject *self, PyObject *args) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    
+    for (int i = 0; i < self->size; i++) {
+        PyObject *ret = UbusClient_connect(self->clients[i], args);
+        if (!ret) {
+            /* Do not leave a partly connected pool behind */
+            for (int j = 0; j < i; j++) {
+                Py_XDECREF(UbusClient_disconnect(self->clients[j], NULL));
+            }
+            return NULL;
+        }
+        Py_DECREF(ret);
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* UbusPool.disconnect() */
+static PyObject *UbusPool_disconnect(UbusPoolObject *self, PyObject *args) {
+    (void)args;
+    
+    for (int i = 0; i < self->size; i++) {
+        Py_XDECREF(UbusClient_disconnect(self->clients[i], NULL));
+    }
+    
+    Py_RETURN_NONE;
+}
+
+/* Make a call on an idle context of a pool; a flight_lead_fn */
+static PyObject *pool_lead_call(void *owner, PyObject *object, const char *method, PyObject *params,
+                                int timeout_ms, int lazy, struct blob_attr **raw) {
+    UbusClientObject *client = pool_checkout((UbusPoolObject *)owner);
+    PyObject *result = client_lead_call(client, object, method, params, timeout_ms, lazy, raw);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.call() */
+static PyObject *UbusPool_call(UbusPoolObject *self, PyObject *const *args,
+                               Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    
+    /* Coalescing happens before a context is taken, so waiting callers do
+     * not hold one up. Handlers running under a context lock make their own
+     * call, as with UbusClient.call(). */
+    if (self->coalesce && !pool_lock_owned(self)) {
+        const char *method;
+        PyObject *object, *params;
+        int timeout_ms = -1;
+        int lazy;
+        
+        if (parse_call_args("call", args, nargs, kwnames, &object, &method, &params, &timeout_ms, &lazy) < 0) {
+            return NULL;
+        }
+        return flight_call(&self->flights, pool_lead_call, self, &self->coalesced, self->clients[0],
+                           object, method, params,
+                           timeout_ms < 0 ? self->clients[0]->timeout_ms : timeout_ms, lazy);
+    }
+    
+    /* The context lock is recursive, call() takes it again */
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_call(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.call_json() */
+static PyObject *UbusPool_call_json(UbusPoolObject *self, PyObject *const *args,
+                                    Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
+    }
+    
+    if (self->coalesce && !pool_lock_owned(self)) {
+        const char *method;
+        PyObject *object, *params;
+        int timeout_ms = -1;
+        
+        if (parse_call_args("call_json", args, nargs, kwnames, &object, &method, &params, &timeout_ms, NULL) < 0) {
+            return NULL;
+        }
+        return flight_call(&self->flights, pool_lead_call, self, &self->coalesced, self->clients[0],
+                           object, method, params,
+                           timeout_ms < 0 ? self->clients[0]->timeout_ms : timeout_ms, REPLY_JSON);
     }
+    
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_call_json(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
 }
 
-/* Convert Python object to JSON object */
-static json_object *python_to_json(PyObject *obj) {
-    if (obj == Py_None) {
+/* UbusPool.call_iter(), the iterator stays on the context it started on */
+static PyObject *UbusPool_call_iter(UbusPoolObject *self, PyObject *const *args,
+                                    Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
         return NULL;
     }
     
-    if (PyBool_Check(obj)) {
-        return json_object_new_boolean(obj == Py_True);
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_call_iter(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.read_file() */
+static PyObject *UbusPool_read_file(UbusPoolObject *self, PyObject *const *args,
+                                    Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
     }
     
-    if (PyLong_Check(obj)) {
-        return json_object_new_int64(PyLong_AsLongLong(obj));
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_read_file(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.write_file() */
+static PyObject *UbusPool_write_file(UbusPoolObject *self, PyObject *const *args,
+                                     Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
     }
     
-    if (PyFloat_Check(obj)) {
-        return json_object_new_double(PyFloat_AsDouble(obj));
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_write_file(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.call_many() */
+static PyObject *UbusPool_call_many(UbusPoolObject *self, PyObject *const *args,
+                                    Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
     }
     
-    if (PyUnicode_Check(obj)) {
-        return json_object_new_string(PyUnicode_AsUTF8(obj));
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_call_many(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.list() */
+static PyObject *UbusPool_list(UbusPoolObject *self, PyObject *const *args,
+                               Py_ssize_t nargs, PyObject *kwnames) {
+    if (pool_check(self) < 0) {
+        return NULL;
     }
     
-    if (PyList_Check(obj) || PyTuple_Check(obj)) {
-        Py_ssize_t len = PySequence_Length(obj);
-        json_object *arr = json_object_new_array();
-        
-        for (Py_ssize_t i = 0; i < len; i++) {
-            PyObject *item = PySequence_GetItem(obj, i);
-            json_object *json_item = python_to_json(item);
-            Py_DECREF(item);
-            
-            if (json_item) {
-                json_object_array_add(arr, json_item);
-            }
-        }
-        return arr;
+    UbusClientObject *client = pool_checkout(self);
+    PyObject *result = UbusClient_list(client, args, nargs, kwnames);
+    client_unlock(client);
+    return result;
+}
+
+/* UbusPool.timeout getter */
+static PyObject *UbusPool_get_timeout(UbusPoolObject *self, void *closure) {
+    if (pool_check(self) < 0) {
+        return NULL;
     }
-    
-    if (PyDict_Check(obj)) {
-        json_object *dict = json_object_new_object();
-        PyObject *key, *value;
-        Py_ssize_t pos = 0;
-        
-        while (PyDict_Next(obj, &pos, &key, &value)) {
-            if (PyUnicode_Check(key)) {
-                const char *key_str = PyUnicode_AsUTF8(key);
-                json_object *json_val = python_to_json(value);
-                
-                if (json_val) {
-                    json_object_object_add(dict, key_str, json_val);
-                }
-            }
+    return UbusClient_get_timeout(self->clients[0], closure);
+}
+
+/* UbusPool.timeout setter, applies to every context */
+static int UbusPool_set_timeout(UbusPoolObject *self, PyObject *value, void *closure) {
+    for (int i = 0; i < self->size; i++) {
+        if (UbusClient_set_timeout(self->clients[i], value, closure) < 0) {
+            return -1;
         }
-        return dict;
     }
-    
-    return NULL;
+    return 0;
 }
 
-/* Callback for ubus method calls */
-static void call_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
-    PyObject **result = (PyObject **)req->priv;
+/* UbusPool.connected getter, true once every context is connected */
+static PyObject *UbusPool_get_connected(UbusPoolObject *self, void *closure) {
+    (void)closure;
     
-    if (msg) {
-        char *json_str = blobmsg_format_json(msg, true);
-        if (json_str) {
-            json_object *json_obj = json_tokener_parse(json_str);
-            if (json_obj) {
-                *result = json_to_python(json_obj);
-                json_object_put(json_obj);
-            }
-            free(json_str);
+    for (int i = 0; i < self->size; i++) {
+        if (!self->clients[i]->connected) {
+            Py_RETURN_FALSE;
         }
     }
+    return PyBool_FromLong(self->size > 0);
+}
+
+/* UbusPool.reconnects getter, summed over the contexts */
+static PyObject *UbusPool_get_reconnects(UbusPoolObject *self, void *closure) {
+    unsigned long reconnects = 0;
     
-    if (!*result) {
-        *result = PyDict_New();
+    (void)closure;
+    
+    for (int i = 0; i < self->size; i++) {
+        reconnects += self->clients[i]->reconnects;
     }
+    return PyLong_FromUnsignedLong(reconnects);
 }
 
-/* UbusClient.__init__ */
-static int UbusClient_init(UbusClientObject *self, PyObject *args, PyObject *kwds) {
-    static char *kwlist[] = {"timeout", NULL};
+/* UbusPool.stats(), merged over the contexts */
+static PyObject *UbusPool_stats(UbusPoolObject *self, PyObject *args) {
+    struct call_stats *merged[STATS_TABLE_SIZE] = {NULL};
+    int ret = 0;
     
-    self->timeout = 30;
-    self->connected = 0;
-    self->ctx = NULL;
+    (void)args;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &self->timeout)) {
-        return -1;
+    for (int i = 0; i < self->size && ret == 0; i++) {
+        client_lock(self->clients[i]);
+        ret = stats_merge(merged, self->clients[i]->stats);
+        client_unlock(self->clients[i]);
     }
     
-    return 0;
+    PyObject *result = ret == 0 ? stats_to_python(merged) : PyErr_NoMemory();
+    stats_clear(merged);
+    return result;
 }
 
-/* UbusClient.__dealloc__ */
-static void UbusClient_dealloc(UbusClientObject *self) {
-    if (self->ctx) {
-        ubus_free(self->ctx);
-        self->ctx = NULL;
+/* UbusPool.reset_stats() */
+static PyObject *UbusPool_reset_stats(UbusPoolObject *self, PyObject *args) {
+    (void)args;
+    
+    for (int i = 0; i < self->size; i++) {
+        client_lock(self->clients[i]);
+        stats_reset(self->clients[i]->stats);
+        client_unlock(self->clients[i]);
     }
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    Py_RETURN_NONE;
 }
 
-/* UbusClient.connect() */
-static PyObject *UbusClient_connect(UbusClientObject *self, PyObject *args) {
-    const char *socket_path = NULL;
+#if PYUBUS_WITH_CACHE
+/* UbusPool.set_cache_ttl(object, method, ttl), applies to every context */
+static PyObject *UbusPool_set_cache_ttl(UbusPoolObject *self, PyObject *args) {
+    const char *object, *method;
+    int ttl_ms;
     
-    if (!PyArg_ParseTuple(args, "|s", &socket_path)) {
+    if (cache_ttl_args(args, &object, &method, &ttl_ms) < 0) {
         return NULL;
     }
     
-    if (self->connected) {
-        Py_RETURN_NONE;
-    }
-    
-    self->ctx = ubus_connect(socket_path);
-    if (!self->ctx) {
-        PyErr_SetString(PyExc_ConnectionError, "Failed to connect to ubus");
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        PyObject *ret = client_set_cache_ttl(self->clients[i], object, method, ttl_ms);
+        if (!ret) {
+            return NULL;
+        }
+        Py_DECREF(ret);
     }
-    
-    self->connected = 1;
     Py_RETURN_NONE;
 }
 
-/* UbusClient.disconnect() */
-static PyObject *UbusClient_disconnect(UbusClientObject *self, PyObject *args) {
-    if (self->ctx) {
-        ubus_free(self->ctx);
-        self->ctx = NULL;
-        self->connected = 0;
+/* UbusPool.clear_cache() */
+static PyObject *UbusPool_clear_cache(UbusPoolObject *self, PyObject *args) {
+    (void)args;
+    
+    for (int i = 0; i < self->size; i++) {
+        client_lock(self->clients[i]);
+        reply_cache_clear(self->clients[i]);
+        client_unlock(self->clients[i]);
     }
     Py_RETURN_NONE;
 }
+#endif  /* PYUBUS_WITH_CACHE */
 
-/* UbusClient.list() */
-static PyObject *UbusClient_list(UbusClientObject *self, PyObject *args) {
-    const char *path = NULL;
+/* UbusPool.attach_shared_cache(path="/dev/shm/pyubus", *, size, replies, watch) */
+static PyObject *UbusPool_attach_shared_cache(UbusPoolObject *self, PyObject *args, PyObject *kwds) {
+    const char *path;
+    Py_ssize_t size;
+    int replies, watch;
     
-    if (!PyArg_ParseTuple(args, "|s", &path)) {
+    if (shared_cache_args(args, kwds, &path, &size, &replies, &watch) < 0) {
         return NULL;
     }
     
-    if (!self->connected) {
-        PyErr_SetString(PyExc_RuntimeError, "Not connected to ubus");
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        if (client_attach_shared(self->clients[i], path, size, replies, watch) < 0) {
+            return NULL;
+        }
     }
+    Py_RETURN_NONE;
+}
+
+/* UbusPool.detach_shared_cache() */
+static PyObject *UbusPool_detach_shared_cache(UbusPoolObject *self, PyObject *args) {
+    (void)args;
     
-    PyObject *result = NULL;
-    struct ubus_request req;
-    
-    int ret = ubus_lookup(self->ctx, path, call_cb, &result);
-    
-    if (ret != UBUS_STATUS_OK) {
-        PyErr_Format(PyExc_RuntimeError, "ubus lookup failed: %d", ret);
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        client_detach_shared(self->clients[i]);
     }
+    Py_RETURN_NONE;
+}
+
+/* UbusPool.shared_hits getter */
+static PyObject *UbusPool_get_shared_hits(UbusPoolObject *self, void *closure) {
+    unsigned long hits = 0;
     
-    if (!result) {
-        result = PyDict_New();
-    }
+    (void)closure;
     
-    return result;
+    for (int i = 0; i < self->size; i++) {
+        hits += self->clients[i]->shared_hits;
+    }
+    return PyLong_FromUnsignedLong(hits);
 }
 
-/* UbusClient.call() */
-static PyObject *UbusClient_call(UbusClientObject *self, PyObject *args, PyObject *kwargs) {
-    const char *object_name, *method;
-    PyObject *params = NULL;
+/* UbusPool.stats_enabled getter */
+static PyObject *UbusPool_get_stats_enabled(UbusPoolObject *self, void *closure) {
+    (void)closure;
+    return PyBool_FromLong(self->size > 0 && self->clients[0]->stats_enabled);
+}
+
+/* UbusPool.stats_enabled setter, applies to every context */
+static int UbusPool_set_stats_enabled(UbusPoolObject *self, PyObject *value, void *closure) {
+    (void)closure;
     
-    static char *kwlist[] = {"object", "method", "params", NULL};
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete stats_enabled");
+        return -1;
+    }
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|O", kwlist, 
-                                   &object_name, &method, &params)) {
-        return NULL;
+    int enabled = PyObject_IsTrue(value);
+    if (enabled < 0) {
+        return -1;
     }
     
-    if (!self->connected) {
-        PyErr_SetString(PyExc_RuntimeError, "Not connected to ubus");
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        self->clients[i]->stats_enabled = (char)enabled;
     }
+    return 0;
+}
+
+/* UbusPool.bytes_received and bytes_decoded, summed over the contexts.
+ * closure is the offset of the counter in UbusClientObject. */
+static PyObject *UbusPool_get_bytes(UbusPoolObject *self, void *closure) {
+    unsigned long long bytes = 0;
     
-    // Look up object ID
-    uint32_t obj_id;
-    int ret = ubus_lookup_id(self->ctx, object_name, &obj_id);
-    if (ret != UBUS_STATUS_OK) {
-        PyErr_Format(PyExc_RuntimeError, "Object '%s' not found: %d", object_name, ret);
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        bytes += *(unsigned long long *)((char *)self->clients[i] + (size_t)closure);
     }
+    return PyLong_FromUnsignedLongLong(bytes);
+}
+
+/* UbusPool.decode_peak, the largest of the contexts */
+static PyObject *UbusPool_get_decode_peak(UbusPoolObject *self, void *closure) {
+    unsigned long long peak = 0;
     
-    // Prepare parameters
-    struct blob_buf b = {0};
-    blob_buf_init(&b, 0);
+    (void)closure;
     
-    if (params && params != Py_None) {
-        json_object *json_params = python_to_json(params);
-        if (json_params) {
-            const char *json_str = json_object_to_json_string(json_params);
-            if (json_str) {
-                // Convert JSON to blobmsg format
-                if (!blobmsg_add_json_from_string(&b, json_str)) {
-                    json_object_put(json_params);
-                    blob_buf_free(&b);
-                    PyErr_SetString(PyExc_ValueError, "Failed to convert parameters");
-                    return NULL;
-                }
-            }
-            json_object_put(json_params);
+    for (int i = 0; i < self->size; i++) {
+        if (self->clients[i]->decode_peak > peak) {
+            peak = self->clients[i]->decode_peak;
         }
     }
+    return PyLong_FromUnsignedLongLong(peak);
+}
+
+/* UbusPool.max_reply_size getter */
+static PyObject *UbusPool_get_max_reply_size(UbusPoolObject *self, void *closure) {
+    (void)closure;
+    return PyLong_FromSsize_t(self->size > 0 ? self->clients[0]->max_reply_size : 0);
+}
+
+/* UbusPool.max_reply_size setter, applies to every context */
+static int UbusPool_set_max_reply_size(UbusPoolObject *self, PyObject *value, void *closure) {
+    (void)closure;
     
-    // Make the call
-    PyObject *result = NULL;
-    ret = ubus_invoke(self->ctx, obj_id, method, b.head, call_cb, &result, self->timeout * 1000);
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete max_reply_size");
+        return -1;
+    }
     
-    blob_buf_free(&b);
+    Py_ssize_t limit = PyLong_AsSsize_t(value);
+    if (limit == -1 && PyErr_Occurred()) {
+        return -1;
+    }
     
-    if (ret != UBUS_STATUS_OK) {
-        const char *error_msg = "Unknown error";
-        switch (ret) {
-            case UBUS_STATUS_INVALID_COMMAND:
-                error_msg = "Invalid command";
-                break;
-            case UBUS_STATUS_INVALID_ARGUMENT:
-                error_msg = "Invalid argument";
-                break;
-            case UBUS_STATUS_METHOD_NOT_FOUND:
-                error_msg = "Method not found";
-                break;
-            case UBUS_STATUS_NOT_FOUND:
-                error_msg = "Object not found";
-                break;
-            case UBUS_STATUS_PERMISSION_DENIED:
-                error_msg = "Permission denied";
-                break;
-            case UBUS_STATUS_TIMEOUT:
-                error_msg = "Timeout";
-                break;
-        }
-        
-        PyErr_Format(PyExc_RuntimeError, "ubus call failed: %s (%d)", error_msg, ret);
-        Py_XDECREF(result);
-        return NULL;
+    for (int i = 0; i < self->size; i++) {
+        self->clients[i]->max_reply_size = limit;
+    }
+    return 0;
+}
+
+/* UbusPool.max_reply_depth getter */
+static PyObject *UbusPool_get_max_reply_depth(UbusPoolObject *self, void *closure) {
+    (void)closure;
+    return PyLong_FromLong(self->size > 0 ? self->clients[0]->max_reply_depth : 0);
+}
+
+/* UbusPool.max_reply_depth setter, applies to every context */
+static int UbusPool_set_max_reply_depth(UbusPoolObject *self, PyObject *value, void *closure) {
+    (void)closure;
+    
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete max_reply_depth");
+        return -1;
     }
     
-    if (!result) {
-        result = PyDict_New();
+    long limit = PyLong_AsLong(value);
+    if (limit == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (limit > INT_MAX || limit < INT_MIN) {
+        PyErr_SetString(PyExc_OverflowError, "max_reply_depth is out of range");
+        return -1;
     }
     
-    return result;
+    for (int i = 0; i < self->size; i++) {
+        self->clients[i]->max_reply_depth = (int)limit;
+    }
+    return 0;
 }
 
-/* UbusClient methods table */
-static PyMethodDef UbusClient_methods[] = {
-    {"connect", (PyCFunction)UbusClient_connect, METH_VARARGS,
-     "Connect to ubus daemon"},
-    {"disconnect", (PyCFunction)UbusClient_disconnect, METH_NOARGS,
-     "Disconnect from ubus daemon"},
-    {"list", (PyCFunction)UbusClient_list, METH_VARARGS,
+/* UbusPool methods table */
+static PyMethodDef UbusPool_methods[] = {
+    {"connect", (PyCFunction)UbusPool_connect, METH_VARARGS,
+     "Connect every context of the pool to ubus"},
+    {"disconnect", (PyCFunction)UbusPool_disconnect, METH_NOARGS,
+     "Disconnect every context of the pool"},
+    {"call", (PyCFunction)(void (*)(void))UbusPool_call, METH_FASTCALL | METH_KEYWORDS,
+     "Call a ubus method on an idle context"},
+    {"call_json", (PyCFunction)(void (*)(void))UbusPool_call_json, METH_FASTCALL | METH_KEYWORDS,
+     "Call a ubus method on an idle context and return its reply as compact JSON text"},
+    {"call_many", (PyCFunction)(void (*)(void))UbusPool_call_many, METH_FASTCALL | METH_KEYWORDS,
+     "Call several ubus methods in one round-trip on an idle context"},
+    {"call_iter", (PyCFunction)(void (*)(void))UbusPool_call_iter, METH_FASTCALL | METH_KEYWORDS,
+     "Call a ubus method on an idle context and iterate over its reply"},
+    {"read_file", (PyCFunction)(void (*)(void))UbusPool_read_file, METH_FASTCALL | METH_KEYWORDS,
+     "Read a file through the rpcd file object on an idle context"},
+    {"write_file", (PyCFunction)(void (*)(void))UbusPool_write_file, METH_FASTCALL | METH_KEYWORDS,
+     "Write a file through the rpcd file object on an idle context"},
+    {"list", (PyCFunction)(void (*)(void))UbusPool_list, METH_FASTCALL | METH_KEYWORDS,
      "List ubus objects"},
-    {"call", (PyCFunction)UbusClient_call, METH_VARARGS | METH_KEYWORDS,
-     "Call ubus method"},
+    {"stats", (PyCFunction)UbusPool_stats, METH_NOARGS,
+     "Call statistics of all contexts, merged"},
+    {"reset_stats", (PyCFunction)UbusPool_reset_stats, METH_NOARGS,
+     "Zero the call statistics of every context"},
+#if PYUBUS_WITH_CACHE
+    {"set_cache_ttl", (PyCFunction)UbusPool_set_cache_ttl, METH_VARARGS,
+     "Cache the replies of an (object, method) for ttl seconds on every context"},
+    {"clear_cache", (PyCFunction)UbusPool_clear_cache, METH_NOARGS,
+     "Drop the cached replies of every context"},
+#endif
+    {"attach_shared_cache", (PyCFunction)(void (*)(void))UbusPool_attach_shared_cache,
+     METH_VARARGS | METH_KEYWORDS,
+     "Attach every context to a shared cache segment, see UbusClient.attach_shared_cache()"},
+    {"detach_shared_cache", (PyCFunction)UbusPool_detach_shared_cache, METH_NOARGS,
+     "Detach every context from its shared cache segment"},
     {NULL}  /* Sentinel */
 };
 
-/* UbusClient members table */
-static PyMemberDef UbusClient_members[] = {
-    {"timeout", T_INT, offsetof(UbusClientObject, timeout), 0,
-     "Timeout for ubus calls"},
-    {"connected", T_BOOL, offsetof(UbusClientObject, connected), READONLY,
-     "Connection status"},
+static PyMemberDef UbusPool_members[] = {
+    {"size", T_INT, offsetof(UbusPoolObject, size), READONLY,
+     "Number of contexts in the pool"},
+    {"coalesce", T_BOOL, offsetof(UbusPoolObject, coalesce), 0,
+     "Whether identical calls in flight at the same time share one request"},
+    {"coalesced", T_ULONG, offsetof(UbusPoolObject, coalesced), READONLY,
+     "Calls answered by sharing the request of an identical call"},
     {NULL}  /* Sentinel */
 };
 
-/* UbusClient type definition */
-static PyTypeObject UbusClientType = {
+static PyGetSetDef UbusPool_getset[] = {
+    {"timeout", (getter)UbusPool_get_timeout, (setter)UbusPool_set_timeout,
+     "Timeout for ubus calls", NULL},
+    {"connected", (getter)UbusPool_get_connected, NULL,
+     "Connection status", NULL},
+    {"reconnects", (getter)UbusPool_get_reconnects, NULL,
+     "Times a context was re-established after its socket hung up", NULL},
+    {"shared_hits", (getter)UbusPool_get_shared_hits, NULL,
+     "Object IDs and replies taken from the shared cache segment by any context", NULL},
+    {"stats_enabled", (getter)UbusPool_get_stats_enabled, (setter)UbusPool_set_stats_enabled,
+     "Whether calls are timed for stats()", NULL},
+    {"max_reply_size", (getter)UbusPool_get_max_reply_size, (setter)UbusPool_set_max_reply_size,
+     "Largest reply in bytes accepted, 0 for no limit", NULL},
+    {"max_reply_depth", (getter)UbusPool_get_max_reply_depth, (setter)UbusPool_set_max_reply_depth,
+     "Deepest nesting accepted in a reply, 0 for no limit", NULL},
+    {"bytes_received", (getter)UbusPool_get_bytes, NULL,
+     "Bytes of replies and events received by all contexts",
+     (void *)offsetof(UbusClientObject, bytes_received)},
+    {"bytes_decoded", (getter)UbusPool_get_bytes, NULL,
+     "Bytes of replies decoded by all contexts",
+     (void *)offsetof(UbusClientObject, bytes_decoded)},
+    {"decode_peak", (getter)UbusPool_get_decode_peak, NULL,
+     "Estimated bytes allocated by the largest reply decoded", NULL},
+    {NULL}  /* Sentinel */
+};
+
+/* UbusPool type definition */
+static PyTypeObject UbusPoolType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "ubus_native.UbusClient",
-    .tp_doc = "Native ubus client using libubus",
-    .tp_basicsize = sizeof(UbusClientObject),
+    .tp_name = "ubus_native.UbusPool",
+    .tp_doc = "Pool of ubus connections shared by several threads",
+    .tp_basicsize = sizeof(UbusPoolObject),
     .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
     .tp_new = PyType_GenericNew,
-    .tp_init = (initproc)UbusClient_init,
-    .tp_dealloc = (destructor)UbusClient_dealloc,
-    .tp_methods = UbusClient_methods,
-    .tp_members = UbusClient_members,
+    .tp_init = (initproc)UbusPool_init,
+    .tp_dealloc = (destructor)UbusPool_dealloc,
+    .tp_methods = UbusPool_methods,
+    .tp_members = UbusPool_members,
+    .tp_getset = UbusPool_getset,
 };
 
 /* Module definition */
@@ -385,12 +8933,69 @@ static PyModuleDef ubus_native_module = {
     .m_size = -1,
 };
 
+/* Register type as a virtual subclass of a collections.abc class */
+static int register_abc(const char *name, PyTypeObject *type) {
+    PyObject *abc = PyImport_ImportModule("collections.abc");
+    if (!abc) return -1;
+    
+    PyObject *base = PyObject_GetAttrString(abc, name);
+    Py_DECREF(abc);
+    if (!base) return -1;
+    
+    PyObject *ret = PyObject_CallMethod(base, "register", "O", (PyObject *)type);
+    Py_DECREF(base);
+    if (!ret) return -1;
+    
+    Py_DECREF(ret);
+    return 0;
+}
+
+/* Stop the I/O threads at interpreter exit */
+static int register_atexit(void) {
+    PyObject *atexit = PyImport_ImportModule("atexit");
+    if (!atexit) return -1;
+    
+    PyObject *func = PyCFunction_New(&io_threads_stop_def, NULL);
+    if (!func) {
+        Py_DECREF(atexit);
+        return -1;
+    }
+    
+    PyObject *ret = PyObject_CallMethod(atexit, "register", "O", func);
+    Py_DECREF(func);
+    Py_DECREF(atexit);
+    if (!ret) return -1;
+    
+    Py_DECREF(ret);
+    return 0;
+}
+
 /* Module initialization */
 PyMODINIT_FUNC PyInit_ubus_native(void) {
     PyObject *m;
 
+    pthread_once(&send_lock_once, send_lock_init);
+    
     if (PyType_Ready(&UbusClientType) < 0)
         return NULL;
+    
+    if (PyType_Ready(&UbusRequestType) < 0)
+        return NULL;
+    
+    if (PyType_Ready(&BlobViewType) < 0 || PyType_Ready(&BlobListViewType) < 0)
+        return NULL;
+    
+    if (PyType_Ready(&PreparedCallType) < 0)
+        return NULL;
+    
+    if (PyType_Ready(&RecordType) < 0)
+        return NULL;
+    
+    if (PyType_Ready(&CallIteratorType) < 0)
+        return NULL;
+    
+    if (PyType_Ready(&UbusPoolType) < 0)
+        return NULL;
 
     m = PyModule_Create(&ubus_native_module);
     if (m == NULL)
@@ -403,6 +9008,73 @@ PyMODINIT_FUNC PyInit_ubus_native(void) {
         return NULL;
     }
     
+    Py_INCREF(&UbusPoolType);
+    if (PyModule_AddObject(m, "UbusPool", (PyObject *)&UbusPoolType) < 0) {
+        Py_DECREF(&UbusPoolType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&UbusRequestType);
+    if (PyModule_AddObject(m, "Request", (PyObject *)&UbusRequestType) < 0) {
+        Py_DECREF(&UbusRequestType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&PreparedCallType);
+    if (PyModule_AddObject(m, "PreparedCall", (PyObject *)&PreparedCallType) < 0) {
+        Py_DECREF(&PreparedCallType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&RecordType);
+    if (PyModule_AddObject(m, "Record", (PyObject *)&RecordType) < 0) {
+        Py_DECREF(&RecordType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&CallIteratorType);
+    if (PyModule_AddObject(m, "CallIterator", (PyObject *)&CallIteratorType) < 0) {
+        Py_DECREF(&CallIteratorType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&BlobViewType);
+    if (PyModule_AddObject(m, "BlobView", (PyObject *)&BlobViewType) < 0) {
+        Py_DECREF(&BlobViewType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    Py_INCREF(&BlobListViewType);
+    if (PyModule_AddObject(m, "BlobListView", (PyObject *)&BlobListViewType) < 0) {
+        Py_DECREF(&BlobListViewType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    if (init_exceptions(m) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    b64_init();
+    
+    /* Let views pass isinstance() checks for the ABCs they implement */
+    if (register_abc("Mapping", &BlobViewType) < 0 || register_abc("Sequence", &BlobListViewType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    
+    if (register_atexit() < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    
     /* Add status constants */
     PyModule_AddIntConstant(m, "UBUS_STATUS_OK", UBUS_STATUS_OK);
     PyModule_AddIntConstant(m, "UBUS_STATUS_INVALID_COMMAND", UBUS_STATUS_INVALID_COMMAND);
@@ -412,6 +9084,48 @@ PyMODINIT_FUNC PyInit_ubus_native(void) {
     PyModule_AddIntConstant(m, "UBUS_STATUS_NO_DATA", UBUS_STATUS_NO_DATA);
     PyModule_AddIntConstant(m, "UBUS_STATUS_PERMISSION_DENIED", UBUS_STATUS_PERMISSION_DENIED);
     PyModule_AddIntConstant(m, "UBUS_STATUS_TIMEOUT", UBUS_STATUS_TIMEOUT);
+    PyModule_AddIntConstant(m, "UBUS_STATUS_NOT_SUPPORTED", UBUS_STATUS_NOT_SUPPORTED);
+    PyModule_AddIntConstant(m, "UBUS_STATUS_UNKNOWN_ERROR", UBUS_STATUS_UNKNOWN_ERROR);
+    PyModule_AddIntConstant(m, "UBUS_STATUS_CONNECTION_FAILED", UBUS_STATUS_CONNECTION_FAILED);
+    
+    /* Add blobmsg types for add_object() policies */
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_UNSPEC", BLOBMSG_TYPE_UNSPEC);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_ARRAY", BLOBMSG_TYPE_ARRAY);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_TABLE", BLOBMSG_TYPE_TABLE);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_STRING", BLOBMSG_TYPE_STRING);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_INT64", BLOBMSG_TYPE_INT64);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_INT32", BLOBMSG_TYPE_INT32);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_INT16", BLOBMSG_TYPE_INT16);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_INT8", BLOBMSG_TYPE_INT8);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_BOOL", BLOBMSG_TYPE_BOOL);
+    PyModule_AddIntConstant(m, "BLOBMSG_TYPE_DOUBLE", BLOBMSG_TYPE_DOUBLE);
+    
+    /* Optional features this build includes, as a tuple of names */
+    static const struct {
+        const char *name;
+        int built;
+    } features[] = {
+        {"json", PYUBUS_WITH_JSON},
+        {"events", PYUBUS_WITH_EVENTS},
+        {"stats", PYUBUS_WITH_STATS},
+        {"cache", PYUBUS_WITH_CACHE},
+    };
+    PyObject *built = PyList_New(0);
+    for (size_t i = 0; built && i < sizeof(features) / sizeof(features[0]); i++) {
+        PyObject *name = features[i].built ? PyUnicode_FromString(features[i].name) : NULL;
+        if (features[i].built && (!name || PyList_Append(built, name) < 0)) {
+            Py_CLEAR(built);
+        }
+        Py_XDECREF(name);
+    }
+    
+    PyObject *names = built ? PyList_AsTuple(built) : NULL;
+    Py_XDECREF(built);
+    if (!names || PyModule_AddObject(m, "FEATURES", names) < 0) {
+        Py_XDECREF(names);
+        Py_DECREF(m);
+        return NULL;
+    }
 
     return m;
 } 
\ No newline at end of file
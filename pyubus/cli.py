@@ -3,24 +3,17 @@
 PyUbus command-line interface
 
 A CLI tool that provides similar functionality to the native ubus command
-but works over HTTP/JSON-RPC.
+through the native C extension.
 """
 
 import argparse
 import json
 import sys
-from typing import Dict, Any, Optional
+from typing import Any, Iterable, Optional
 
 from .client import UbusClient
 from .exceptions import UbusError
 
-# Try to import UCI config for OpenWrt integration
-try:
-    from .uci_config import UCIConfig, UCIError
-    UCI_AVAILABLE = True
-except ImportError:
-    UCI_AVAILABLE = False
-
 
 def print_json(data: Any, indent: int = 2) -> None:
     """Print data as formatted JSON"""
@@ -30,30 +23,15 @@ def print_json(data: Any, indent: int = 2) -> None:
 def list_objects(client: UbusClient, path: Optional[str] = None, verbose: bool = False) -> None:
     """List ubus objects and optionally their methods"""
     try:
-        if path and verbose:
-            # List methods for specific object
-            objects = client.list(path)
-            if objects:
-                print(f"'{path}' methods:")
-                for obj_name, methods in objects.items():
-                    if isinstance(methods, dict):
-                        for method, signature in methods.items():
-                            if method.startswith('.'):  # Skip metadata
-                                continue
-                            print(f"  {method}: {json.dumps(signature)}")
-                    else:
-                        print(f"  {obj_name}")
-            else:
-                print(f"Object '{path}' not found or has no methods")
+        objects = client.list(path, signatures=verbose)
+        if verbose:
+            for obj_name in sorted(objects):
+                print(f"'{obj_name}' @{objects[obj_name]['id']:08x}")
+                for method, signature in objects[obj_name]['methods'].items():
+                    print(f"  {method}: {json.dumps(signature)}")
         else:
-            # List all objects or filter by path pattern
-            objects = client.list(path)
-            if isinstance(objects, dict):
-                for obj_name in sorted(objects.keys()):
-                    print(obj_name)
-            elif isinstance(objects, list):
-                for obj_name in sorted(objects):
-                    print(obj_name)
+            for obj_name in sorted(objects):
+                print(obj_name)
     except UbusError as e:
         print(f"Error: {e}", file=sys.stderr)
         sys.exit(1)
@@ -119,37 +97,57 @@ def network_info(client: UbusClient, interface: Optional[str] = None) -> None:
         sys.exit(1)
 
 
-def list_uci_hosts() -> None:
-    """List UCI configured hosts (OpenWrt only)"""
-    if not UCI_AVAILABLE:
-        print("Error: UCI configuration not available (not running on OpenWrt?)", file=sys.stderr)
-        sys.exit(1)
+def batch_error(message: str, status: Optional[int] = None) -> str:
+    """Format a failed batch command as a JSON line"""
+    error = {"error": message}
+    if status is not None:
+        error["status"] = status
+    return json.dumps(error, separators=(',', ':'), ensure_ascii=False)
+
+
+def run_batch(client: UbusClient, lines: Iterable[str], flush: bool = False) -> int:
+    """
+    Run call/list command lines over one connection
     
-    try:
-        uci = UCIConfig()
-        hosts = uci.list_configured_hosts()
-        
-        if not hosts:
-            print("No hosts configured in /etc/config/pyubus")
-            return
+    Writes one compact JSON line per command, in order: the reply of a call,
+    the object names of a list, or {"error": ..., "status": ...} for a
+    command that failed. Call replies are formatted in C from the ubus
+    message. Blank lines and lines starting with '#' are skipped.
+    
+    Returns the number of commands that failed.
+    """
+    failed = 0
+    write = sys.stdout.write
+    
+    for lineno, line in enumerate(lines, 1):
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
         
-        print("=== UCI Configured Hosts ===")
-        for host_info in hosts:
-            print(f"\nSection: {host_info['section']}")
-            print(f"  Host: {host_info['host']}")
-            print(f"  Username: {host_info['username'] or '(none)'}")
-            print(f"  Description: {host_info['description']}")
-            
-        print(f"\nTo use a configured host:")
-        print(f"  pyubus --uci-host {hosts[0]['section']} list")
-        print(f"Or edit configuration with:")
-        print(f"  uci show pyubus")
-        print(f"  uci set pyubus.@credentials[0].password='newpass'")
-        print(f"  uci commit pyubus")
+        # Params are the rest of the line, so JSON needs no quoting
+        words = line.split(None, 3)
+        try:
+            if words[0] == 'call' and len(words) >= 3:
+                params = words[3] if len(words) == 4 else None
+                if params and params[0] == params[-1] == "'":
+                    params = params[1:-1]
+                out = client.call_json(words[1], words[2], params)
+            elif words[0] == 'list' and len(words) <= 2:
+                objects = client.list(words[1] if len(words) == 2 else None)
+                out = json.dumps(sorted(objects), separators=(',', ':'))
+            else:
+                out = batch_error(f"line {lineno}: expected 'call <object> <method> [params]' or 'list [path]'")
+                failed += 1
+        except (UbusError, ValueError) as e:
+            out = batch_error(str(e), getattr(e, 'status', None))
+            failed += 1
         
-    except Exception as e:
-        print(f"Error reading UCI configuration: {e}", file=sys.stderr)
-        sys.exit(1)
+        write(out)
+        write('\n')
+        if flush:
+            sys.stdout.flush()
+    
+    return failed
 
 
 def main():
@@ -159,38 +157,21 @@ def main():
         formatter_class=argparse.RawDescriptionHelpFormatter,
         epilog="""
 Examples:
-  pyubus -H 192.168.1.1 -u root -p password list
-  pyubus -H router.local list system
-  pyubus -H 192.168.1.1 -u root -p password call system board
-  pyubus -H 192.168.1.1 call network.interface.lan status
-  pyubus --ssl -H router.local -u admin -p admin system-info
-  pyubus -H 192.168.1.1 network-info lan
+  pyubus list
+  pyubus list system -v
+  pyubus call system board
+  pyubus call network.interface.lan status
+  pyubus --socket /custom/ubus.sock system-info
+  pyubus network-info lan
+  pyubus batch < commands
         """
     )
     
     # Connection options
-    parser.add_argument('-H', '--host', required=True,
-                       help='OpenWRT device hostname or IP address')
-    parser.add_argument('-P', '--port', type=int,
-                       help='HTTP port (default: 80 or 443 for SSL)')
-    parser.add_argument('-u', '--username',
-                       help='Username for authentication')
-    parser.add_argument('-p', '--password',  
-                       help='Password for authentication')
-    parser.add_argument('-t', '--timeout', type=int, default=30,
+    parser.add_argument('-s', '--socket', default='/var/run/ubus.sock',
+                       help='ubus socket path (default: /var/run/ubus.sock)')
+    parser.add_argument('-t', '--timeout', type=float, default=30,
                        help='Request timeout in seconds (default: 30)')
-    parser.add_argument('--ssl', action='store_true',
-                       help='Use HTTPS')
-    parser.add_argument('--no-verify-ssl', action='store_true',
-                       help='Disable SSL certificate verification')
-    parser.add_argument('--ubus-path', default='/ubus',
-                       help='ubus HTTP endpoint path (default: /ubus)')
-    
-    if UCI_AVAILABLE:
-        parser.add_argument('--uci-host',
-                           help='Use UCI configured host section (OpenWrt only)')
-        parser.add_argument('--uci-config', action='store_true',
-                           help='Load defaults from UCI configuration (OpenWrt only)')
     
     # Commands
     subparsers = parser.add_subparsers(dest='command', help='Commands')
@@ -215,9 +196,12 @@ Examples:
     network_parser.add_argument('interface', nargs='?', 
                                help='Specific interface to show')
     
-    # uci-hosts command (OpenWrt only)
-    if UCI_AVAILABLE:
-        subparsers.add_parser('uci-hosts', help='List UCI configured hosts (OpenWrt only)')
+    # batch command
+    batch_parser = subparsers.add_parser('batch', help='Run call/list lines over one connection, one JSON reply line each')
+    batch_parser.add_argument('file', nargs='?', type=argparse.FileType('r'), default='-',
+                             help='File with one command per line (default: stdin)')
+    batch_parser.add_argument('--flush', action='store_true',
+                             help='Flush after every reply, for scripts reading replies as they come')
     
     # Parse arguments
     args = parser.parse_args()
@@ -226,54 +210,10 @@ Examples:
         parser.print_help()
         return
     
-    # Handle UCI configuration if available and requested
-    uci_config = {}
-    if UCI_AVAILABLE and (getattr(args, 'uci_config', False) or getattr(args, 'uci_host', None)):
-        try:
-            uci = UCIConfig()
-            uci_config = uci.get_main_config()
-            
-            if getattr(args, 'uci_host', None):
-                # Get credentials for specific host section
-                hosts = uci.list_configured_hosts()
-                for host_info in hosts:
-                    if host_info['section'] == args.uci_host:
-                        # Override args with UCI values
-                        args.host = host_info['host']
-                        args.username = host_info['username'] or args.username
-                        # Note: password should be retrieved from UCI separately for security
-                        creds = uci.get_credentials(host_info['host'])
-                        if creds.get('password'):
-                            args.password = creds['password']
-                        break
-                else:
-                    print(f"Error: UCI host section '{args.uci_host}' not found", file=sys.stderr)
-                    sys.exit(1)
-            
-        except Exception as e:
-            print(f"Warning: Could not load UCI configuration: {e}", file=sys.stderr)
-    
-    # Apply UCI defaults if not explicitly provided
-    if uci_config:
-        if not args.host and not getattr(args, 'uci_host', None):
-            args.host = uci_config.get('default_host', args.host)
-        if not args.port:
-            args.port = uci_config.get('default_port', args.port)
-        if args.timeout == 30:  # Only if using default
-            args.timeout = uci_config.get('default_timeout', args.timeout)
-    
     # Create client
     try:
-        client = UbusClient(
-            host=args.host,
-            port=args.port,
-            username=args.username,
-            password=args.password,
-            timeout=args.timeout,
-            ssl=args.ssl,
-            verify_ssl=not args.no_verify_ssl,
-            ubus_path=args.ubus_path
-        )
+        client = UbusClient(socket_path=args.socket, timeout=args.timeout)
+        client.connect()
         
         # Execute command
         if args.command == 'list':
@@ -284,14 +224,19 @@ Examples:
             system_info(client)
         elif args.command == 'network-info':
             network_info(client, getattr(args, 'interface', None))
-        elif args.command == 'uci-hosts':
-            list_uci_hosts()
+        elif args.command == 'batch':
+            failed = run_batch(client, args.file, args.flush)
+            client.close()
+            sys.exit(1 if failed else 0)
         
         client.close()
         
     except KeyboardInterrupt:
         print("\nAborted by user", file=sys.stderr)
         sys.exit(1)
+    except UbusError as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
     except Exception as e:
         print(f"Unexpected error: {e}", file=sys.stderr)
         sys.exit(1)
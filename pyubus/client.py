@@ -9,9 +9,7 @@ Architecture: Python → C Extension → libubus → ubusd
 Performance: Sub-millisecond response times with zero overhead
 """
 
-import json
-import time
-from typing import Dict, Any, Optional, Union
+from typing import Dict, Any, Iterator, List, Optional, Sequence, Tuple, Union
 
 # Import the native C extension
 try:
@@ -27,6 +25,7 @@ from .exceptions import (
     UbusAuthError,
     UbusPermissionError, 
     UbusTimeoutError,
+    UbusReplyLimitError,
     UbusMethodError
 )
 
@@ -47,46 +46,56 @@ class NativeUbusClient:
             print(f"Model: {system_info['model']}")
     """
     
-    def __init__(self, socket_path: str = "/var/run/ubus.sock", timeout: int = 30):
+    def __init__(self, socket_path: str = "/var/run/ubus.sock", timeout: float = 30, pool_size: int = 1,
+                 stats: bool = False, coalesce: bool = False, max_reply_size: int = 0,
+                 max_reply_depth: int = 0):
         """
         Initialize native ubus client
         
         Args:
             socket_path: Path to ubus socket (default: /var/run/ubus.sock)
-            timeout: Default timeout for operations in seconds
+            timeout: Default timeout for operations in seconds, may be fractional
+            pool_size: Number of ubus connections; more than one lets calls
+                       from several threads be in flight at the same time
+            stats: Time every call for stats() from the start
+            coalesce: Let identical calls made at the same time share one
+                      request; only for methods without side effects
+            max_reply_size: Largest reply in bytes accepted, larger ones raise
+                            UbusReplyLimitError before being decoded (0: no limit)
+            max_reply_depth: Deepest nesting of tables and arrays accepted in
+                             a reply, the reply itself being 1 (0: no limit)
         """
         if not _NATIVE_EXTENSION_AVAILABLE:
             raise UbusConnectionError(
                 "Native C extension not available. "
-                "Please ensure libubus-dev and json-c-dev are installed and rebuild PyUbus."
+                "Please ensure libubus-dev is installed and rebuild PyUbus."
             )
             
         self.socket_path = socket_path
-        self.timeout = timeout
-        self._context = None
-        self._connected = False
+        limits = dict(max_reply_size=max_reply_size, max_reply_depth=max_reply_depth)
+        if pool_size > 1:
+            self._native = ubus_native.UbusPool(pool_size, timeout=timeout, stats=stats, coalesce=coalesce,
+                                                **limits)
+        else:
+            self._native = ubus_native.UbusClient(timeout=timeout, stats=stats, coalesce=coalesce, **limits)
         
     def connect(self) -> None:
         """Connect to ubus daemon"""
-        if self._connected:
+        if self._native.connected:
             return
             
         try:
-            self._context = ubus_native.connect(self.socket_path)
-            self._connected = True
-        except Exception as e:
-            raise UbusConnectionError(f"Failed to connect to ubus at {self.socket_path}: {e}")
+            self._native.connect(self.socket_path)
+        except UbusError as e:
+            raise UbusConnectionError(f"Failed to connect to ubus at {self.socket_path}: {e}",
+                                      status=e.status) from e
     
     def disconnect(self) -> None:
         """Disconnect from ubus daemon"""
-        if self._context is not None:
-            try:
-                ubus_native.disconnect(self._context)
-            except Exception:
-                pass  # Ignore disconnect errors
-            finally:
-                self._context = None
-                self._connected = False
+        try:
+            self._native.disconnect()
+        except Exception:
+            pass  # Ignore disconnect errors
     
     def __enter__(self):
         """Context manager entry"""
@@ -97,32 +106,32 @@ class NativeUbusClient:
         """Context manager exit"""
         self.disconnect()
     
-    def list(self, path: Optional[str] = None) -> Dict[str, Any]:
+    def list(self, path: Optional[str] = None, signatures: bool = False) -> Dict[str, Any]:
         """
-        List available ubus objects and their methods
+        List available ubus objects
         
         Args:
-            path: Specific object path to list (optional)
+            path: Object path or shell-style pattern such as "network.interface.*"
+                  (optional, lists all objects by default)
+            signatures: Also decode the method signatures of each object
             
         Returns:
-            Dictionary of objects and their methods
+            Dictionary mapping object paths to {"id", "type_id"} and, with
+            signatures, "methods": {method: {param: BLOBMSG_TYPE_*}}
             
         Example:
             objects = client.list()
-            system_methods = client.list("system")
+            system_methods = client.list("system", signatures=True)["system"]["methods"]
         """
         self._ensure_connected()
         
         try:
-            if path:
-                result = ubus_native.list_object(self._context, path)
-            else:
-                result = ubus_native.list_all(self._context)
-            return result
-        except Exception as e:
+            return self._native.list(path, signatures=signatures)
+        except UbusError as e:
             self._handle_native_error(e)
     
-    def call(self, object_name: str, method: str, params: Optional[Dict[str, Any]] = None) -> Any:
+    def call(self, object_name: str, method: str, params: Optional[Dict[str, Any]] = None,
+             timeout: Optional[float] = None) -> Any:
         """
         Call a method on a ubus object
         
@@ -130,6 +139,7 @@ class NativeUbusClient:
             object_name: Name of the ubus object (e.g., "system")
             method: Method to call (e.g., "board") 
             params: Optional parameters dictionary
+            timeout: Timeout for this call in seconds (default: the client's)
             
         Returns:
             Method result data
@@ -140,18 +150,156 @@ class NativeUbusClient:
         """
         self._ensure_connected()
         
-        # Convert params to JSON string if provided
-        params_json = json.dumps(params) if params else None
+        try:
+            return self._native.call(object_name, method, params, timeout=timeout)
+        except UbusError as e:
+            self._handle_native_error(e, object_name, method)
+    
+    def call_json(self, object_name: str, method: str, params: Union[Dict[str, Any], str, None] = None,
+                  timeout: Optional[float] = None) -> str:
+        """
+        Call a method and return its reply as compact JSON text
+        
+        The reply is formatted in C straight from the ubus message, so no
+        Python objects are built for it. params may also be JSON text.
+        
+        Args:
+            object_name: Name of the ubus object (e.g., "system")
+            method: Method to call (e.g., "board")
+            params: Optional parameters dictionary or JSON object string
+            timeout: Timeout for this call in seconds (default: the client's)
+        
+        Example:
+            print(client.call_json("network.interface.lan", "status"))
+        """
+        self._ensure_connected()
+        
+        try:
+            return self._native.call_json(object_name, method, params, timeout=timeout)
+        except UbusError as e:
+            self._handle_native_error(e, object_name, method)
+    
+    def call_iter(self, object_name: str, method: str, params: Optional[Dict[str, Any]] = None,
+                  timeout: Optional[float] = None) -> Iterator[Tuple[str, Any]]:
+        """
+        Call a method and iterate over its reply as it arrives
+        
+        Yields the (name, value) pairs of the top-level reply fields one at a
+        time. Array fields are yielded element by element as repeated
+        (name, element) pairs, and replies sent as several messages are
+        handled one message at a time, so memory stays bounded by one element
+        instead of the whole reply.
+        
+        Args:
+            object_name: Name of the ubus object (e.g., "log")
+            method: Method to call (e.g., "read")
+            params: Optional parameters dictionary
+            timeout: Longest wait for each reply message in seconds
+                     (default: the client's)
+            
+        Example:
+            for _, entry in client.call_iter("log", "read", {"stream": False}):
+                print(entry["msg"])
+        """
+        self._ensure_connected()
         
         try:
-            result = ubus_native.call(self._context, object_name, method, params_json, self.timeout)
-            return result
-        except Exception as e:
+            yield from self._native.call_iter(object_name, method, params, timeout=timeout)
+        except UbusError as e:
             self._handle_native_error(e, object_name, method)
     
-    def invoke(self, object_name: str, method: str, params: Optional[Dict[str, Any]] = None) -> Any:
+    def call_many(self, calls: Sequence[Tuple], timeout: Optional[float] = None) -> List[Any]:
+        """
+        Call several methods in one batch
+        
+        All requests are sent before waiting for any reply, so the batch
+        costs about one round-trip instead of one per call.
+        
+        Args:
+            calls: Sequence of (object_name, method) or
+                   (object_name, method, params) tuples
+            timeout: Time budget for the whole batch in seconds (default:
+                     the client's); calls still unanswered then fail with
+                     UbusTimeoutError
+            
+        Returns:
+            List with one entry per call, in order: the method result, or
+            the UbusError instance the call failed with
+            
+        Example:
+            board, info = client.call_many([("system", "board"), ("system", "info")])
+        """
+        self._ensure_connected()
+        
+        try:
+            results = self._native.call_many(calls, timeout=timeout)
+        except UbusError as e:
+            self._handle_native_error(e)
+        
+        for i, (result, call) in enumerate(zip(results, calls)):
+            if isinstance(result, Exception):
+                results[i] = self._convert_native_error(result, call[0], call[1])
+        return results
+    
+    def read_file(self, path: str, into: Optional[Any] = None,
+                  timeout: Optional[float] = None) -> Union[bytes, int]:
+        """
+        Read a file through rpcd's file object
+        
+        The base64 reply is decoded in C straight into the result, without
+        a str or JSON step in between.
+        
+        Args:
+            path: Path of the file on the device
+            into: Optional writable buffer (bytearray, memoryview, ...) to
+                  decode into instead of returning new bytes
+            timeout: Timeout in seconds (default: the client's)
+            
+        Returns:
+            The file contents, or the number of bytes written into into
+            
+        Example:
+            backup = client.read_file("/etc/config/network")
+        """
+        self._ensure_connected()
+        
+        try:
+            return self._native.read_file(path, into=into, timeout=timeout)
+        except UbusError as e:
+            self._handle_native_error(e, "file", "read")
+    
+    def write_file(self, path: str, data: Any, mode: Optional[int] = None,
+                   chunk_size: Optional[int] = None, timeout: Optional[float] = None) -> int:
+        """
+        Write a file through rpcd's file object
+        
+        The data is sent as base64 chunks written with append, several of
+        them in flight at a time.
+        
+        Args:
+            path: Path of the file on the device
+            data: bytes, bytearray, memoryview or any other buffer
+            mode: Optional permission bits for a newly created file
+            chunk_size: Raw bytes per chunk (default: 48 KiB)
+            timeout: Timeout for each chunk in seconds (default: the client's)
+            
+        Returns:
+            Number of bytes written
+            
+        Example:
+            client.write_file("/tmp/backup.tar.gz", archive, mode=0o600)
+        """
+        self._ensure_connected()
+        
+        try:
+            return self._native.write_file(path, data, mode=mode, chunk_size=chunk_size, timeout=timeout)
+        except UbusError as e:
+            self._handle_native_error(e, "file", "write")
+    
+    def invoke(self, object_name: str, method: str, params: Optional[Dict[str, Any]] = None,
+               timeout: Optional[float] = None) -> Any:
         """Alias for call() method for compatibility"""
-        return self.call(object_name, method, params)
+        return self.call(object_name, method, params, timeout)
     
     # Convenience methods for common operations
     def get_system_info(self) -> Dict[str, Any]:
@@ -167,17 +315,14 @@ class NativeUbusClient:
         if interface:
             return self.call(f"network.interface.{interface}", "status")
         else:
-            # Get all interfaces
-            interfaces = {}
-            objects = self.list()
-            for obj_name in objects:
-                if obj_name.startswith("network.interface.") and obj_name != "network.interface":
-                    iface_name = obj_name.replace("network.interface.", "")
-                    try:
-                        interfaces[iface_name] = self.call(obj_name, "status")
-                    except UbusError:
-                        continue  # Skip interfaces that can't be queried
-            return interfaces
+            # Get all interfaces in one batch
+            obj_names = list(self.list("network.interface.*"))
+            results = self.call_many([(obj_name, "status") for obj_name in obj_names])
+            return {
+                obj_name[len("network.interface."):]: result
+                for obj_name, result in zip(obj_names, results)
+                if not isinstance(result, UbusError)  # Skip interfaces that can't be queried
+            }
     
     def get_wireless_status(self) -> Dict[str, Any]:
         """Get wireless status information"""
@@ -185,45 +330,131 @@ class NativeUbusClient:
             return self.call("network.wireless", "status")
         except UbusError:
             # Try alternative wireless objects
-            wireless_info = {}
-            objects = self.list()
-            for obj_name in objects:
-                if "wireless" in obj_name.lower():
-                    try:
-                        wireless_info[obj_name] = self.call(obj_name, "status")
-                    except UbusError:
-                        continue
-            return wireless_info
+            obj_names = list(self.list("*wireless*"))
+            results = self.call_many([(obj_name, "status") for obj_name in obj_names])
+            return {
+                obj_name: result
+                for obj_name, result in zip(obj_names, results)
+                if not isinstance(result, UbusError)
+            }
     
     def restart_service(self, service_name: str) -> Any:
         """Restart a system service"""
         return self.call("service", service_name, {"action": "restart"})
     
+    def stats(self) -> Dict[Tuple, Dict[str, Any]]:
+        """
+        Call statistics collected while stats_enabled is set
+        
+        Returns:
+            Dictionary mapping (object_name, method) to {"calls", "errors",
+            "bytes_received", "bytes_decoded", "decode_peak"} and one
+            latency summary per phase ("lookup", "encode", "ipc",
+            "decode", "total"), each with sum_us, mean_us, max_us, p50_us,
+            p90_us, p99_us and a "histogram" list of (upper_us, count)
+            
+        Example:
+            client.stats_enabled = True
+            client.call("system", "board")
+            print(client.stats()[("system", "board")]["total"]["p99_us"])
+        """
+        return self._native.stats()
+    
+    def reset_stats(self) -> None:
+        """Zero the call statistics"""
+        self._native.reset_stats()
+    
+    def memory_stats(self) -> Dict[str, int]:
+        """
+        Reply traffic counters, collected whether or not stats_enabled is set
+        
+        Returns:
+            {"bytes_received": bytes of replies and events received,
+             "bytes_decoded": bytes of replies turned into Python objects,
+             "decode_peak": estimated bytes allocated by the largest decode}
+        """
+        return {
+            "bytes_received": self._native.bytes_received,
+            "bytes_decoded": self._native.bytes_decoded,
+            "decode_peak": self._native.decode_peak,
+        }
+    
+    def set_cache_ttl(self, object_name: str, method: str, ttl: Optional[float]) -> None:
+        """
+        Cache the replies of an idempotent method
+        
+        Successful replies are kept for ttl seconds, keyed by object,
+        method and params, and served without a round-trip to ubusd.
+        Cached replies are dropped when the object is re-registered or the
+        connection is re-established.
+        
+        Args:
+            object_name: Name of the ubus object (e.g., "system")
+            method: Method to cache, or "*" for every method of the object
+            ttl: Seconds to keep a reply; None or 0 stops caching
+            
+        Example:
+            client.set_cache_ttl("system", "board", 60)
+        """
+        self._native.set_cache_ttl(object_name, method, ttl)
+    
+    def clear_cache(self) -> None:
+        """Drop every cached reply"""
+        self._native.clear_cache()
+    
+    def attach_shared_cache(self, path: str = "/dev/shm/pyubus", size: int = 1048576,
+                            replies: bool = False, watch: bool = True) -> None:
+        """
+        Share resolved object IDs with other processes through shared memory
+        
+        The segment is a file mapped by every process that attaches it,
+        created with size bytes by the first one. Object lookups missing
+        from the local cache are answered from it before asking ubusd, and
+        every lookup made is published to it.
+        
+        Args:
+            path: File backing the segment, normally under /dev/shm
+            size: Bytes of a new segment, all but 256 KiB hold replies
+            replies: Also share the replies of methods cached with
+                     set_cache_ttl(), up to about 4 KiB each
+            watch: Follow object add/remove events. Only the process
+                   keeping the segment current needs them, the others can
+                   pass False to save ubusd the work
+        
+        Example:
+            client.attach_shared_cache(replies=True, watch=False)
+        """
+        self._native.attach_shared_cache(path, size=size, replies=replies, watch=watch)
+    
+    def detach_shared_cache(self) -> None:
+        """Stop using the shared cache segment and watch object events again"""
+        self._native.detach_shared_cache()
+    
+    @property
+    def shared_hits(self) -> int:
+        """Object IDs and replies taken from the shared cache segment"""
+        return self._native.shared_hits
+    
     # Internal methods
     def _ensure_connected(self) -> None:
         """Ensure we're connected to ubus"""
-        if not self._connected:
+        if not self._native.connected:
             self.connect()
     
     def _handle_native_error(self, error: Exception, object_name: str = None, method: str = None) -> None:
+        """Raise the PyUbus exception matching a native error"""
+        converted = self._convert_native_error(error, object_name, method)
+        if converted is error:
+            raise error
+        raise converted from error
+    
+    def _convert_native_error(self, error: Exception, object_name: str = None, method: str = None) -> UbusError:
         """Convert native errors to appropriate PyUbus exceptions"""
-        error_str = str(error).lower()
-        
-        # Map common ubus errors to specific exceptions
-        if "not found" in error_str or "no such" in error_str:
-            if object_name and method:
-                raise UbusMethodError(f"Method '{method}' not found on object '{object_name}'")
-            else:
-                raise UbusMethodError(f"Object or method not found: {error}")
-        elif "permission" in error_str or "access denied" in error_str:
-            raise UbusPermissionError(f"Permission denied: {error}")
-        elif "timeout" in error_str:
-            raise UbusTimeoutError(f"Operation timed out: {error}")
-        elif "connection" in error_str or "socket" in error_str:
-            raise UbusConnectionError(f"Connection error: {error}")
-        else:
-            # Generic ubus error
-            raise UbusError(f"Native ubus error: {error}")
+        # The extension raises the UbusError subclass of the status, connection
+        # failures included
+        if isinstance(error, UbusError):
+            return error
+        return UbusError(f"Native ubus error: {error}")
     
     # Properties for compatibility
     @property
@@ -234,7 +465,52 @@ class NativeUbusClient:
     @property
     def is_connected(self) -> bool:
         """Check if client is connected"""
-        return self._connected
+        return self._native.connected
+    
+    @property
+    def timeout(self) -> float:
+        """Default timeout for calls in seconds"""
+        return self._native.timeout
+    
+    @timeout.setter
+    def timeout(self, value: float) -> None:
+        self._native.timeout = value
+    
+    @property
+    def stats_enabled(self) -> bool:
+        """Whether calls are timed for stats()"""
+        return self._native.stats_enabled
+    
+    @stats_enabled.setter
+    def stats_enabled(self, value: bool) -> None:
+        self._native.stats_enabled = bool(value)
+    
+    @property
+    def coalesce(self) -> bool:
+        """Whether identical calls in flight at the same time share one request"""
+        return self._native.coalesce
+    
+    @coalesce.setter
+    def coalesce(self, value: bool) -> None:
+        self._native.coalesce = bool(value)
+    
+    @property
+    def max_reply_size(self) -> int:
+        """Largest reply in bytes accepted, 0 for no limit"""
+        return self._native.max_reply_size
+    
+    @max_reply_size.setter
+    def max_reply_size(self, value: int) -> None:
+        self._native.max_reply_size = int(value)
+    
+    @property
+    def max_reply_depth(self) -> int:
+        """Deepest nesting accepted in a reply, 0 for no limit"""
+        return self._native.max_reply_depth
+    
+    @max_reply_depth.setter
+    def max_reply_depth(self, value: int) -> None:
+        self._native.max_reply_depth = int(value)
     
     def close(self) -> None:
         """Close connection (alias for disconnect)"""
@@ -2,36 +2,60 @@
 PyUbus exceptions module
 
 Defines custom exception classes for ubus-related errors.
+
+The classes are defined by the C extension, which raises them directly
+with the UBUS_STATUS_* code of the failure in ``status``. The Python
+definitions below are only used when the extension is not built.
 """
 
+try:
+    from ubus_native import (
+        UbusError,
+        UbusConnectionError,
+        UbusAuthError,
+        UbusPermissionError,
+        UbusTimeoutError,
+        UbusReplyLimitError,
+        UbusMethodError
+    )
+except ImportError:
+    class UbusError(RuntimeError):
+        """Base exception for all ubus-related errors"""
+        def __init__(self, *args, status=None):
+            super().__init__(*args)
+            self.status = status
+
+
+    class UbusConnectionError(UbusError):
+        """Raised when connection to ubus fails"""
+        pass
 
-class UbusError(Exception):
-    """Base exception for all ubus-related errors"""
-    pass
 
+    class UbusAuthError(UbusError):
+        """Raised when authentication fails"""
+        pass
 
-class UbusConnectionError(UbusError):
-    """Raised when connection to ubus fails"""
-    pass
 
+    class UbusPermissionError(UbusError):
+        """Raised when access is denied due to insufficient permissions"""
+        pass
 
-class UbusAuthError(UbusError):
-    """Raised when authentication fails"""
-    pass
 
+    class UbusTimeoutError(UbusError):
+        """Raised when a ubus call times out"""
+        pass
 
-class UbusPermissionError(UbusError):
-    """Raised when access is denied due to insufficient permissions"""
-    pass
 
+    class UbusReplyLimitError(UbusError):
+        """Raised when a reply exceeds max_reply_size or max_reply_depth"""
+        pass
 
-class UbusTimeoutError(UbusError):
-    """Raised when a ubus call times out"""
-    pass
 
+    class UbusMethodError(UbusError):
+        """Raised when a ubus method call fails"""
+        def __init__(self, message, code=None):
+            super().__init__(message, status=code)
 
-class UbusMethodError(UbusError):
-    """Raised when a ubus method call fails"""
-    def __init__(self, message, code=None):
-        super().__init__(message)
-        self.code = code 
\ No newline at end of file
+        @property
+        def code(self):
+            return self.status
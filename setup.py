@@ -10,8 +10,14 @@ Performance: Sub-millisecond response times, 30x faster than HTTP/JSON-RPC
 
 Requirements:
 - libubus-dev (Ubuntu/Debian) or libubus-devel (RPM)
-- json-c-dev (Ubuntu/Debian) or json-c-devel (RPM)
+- json-c-dev (Ubuntu/Debian) or json-c-devel (RPM), unless built with
+  PYUBUS_DISABLE=json
 - OpenWrt build system for native compilation
+
+Build options, read from the environment:
+- PYUBUS_DISABLE: comma separated features to leave out of the extension,
+  any of json, events, stats and cache
+- PYUBUS_OPTIMIZE: "size" (-Os with LTO) or "speed" (-O2), -O3 by default
 """
 
 import os
@@ -23,7 +29,35 @@ from setuptools import setup, find_packages, Extension
 with open("README.md", "r", encoding="utf-8") as fh:
     long_description = fh.read()
 
-def check_dependencies():
+# Optional parts of the C extension, see PYUBUS_WITH_* in ubus_module.c
+FEATURES = ('json', 'events', 'stats', 'cache')
+
+# (compile, link) flags of each PYUBUS_OPTIMIZE variant
+OPTIMIZE_FLAGS = {
+    'size': (['-Os', '-flto', '-ffunction-sections', '-fdata-sections'],
+             ['-Os', '-flto', '-Wl,--gc-sections']),
+    'speed': (['-O2'], []),
+    '': (['-O3'], []),
+}
+
+def build_options():
+    """Get the disabled features and the optimisation variant from the environment"""
+    disabled = {f.strip() for f in os.environ.get('PYUBUS_DISABLE', '').split(',') if f.strip()}
+    optimize = os.environ.get('PYUBUS_OPTIMIZE', '').strip()
+    
+    unknown = disabled - set(FEATURES)
+    if unknown:
+        print(f"ERROR: Unknown features in PYUBUS_DISABLE: {', '.join(sorted(unknown))}")
+        print(f"Known features: {', '.join(FEATURES)}")
+        sys.exit(1)
+    
+    if optimize not in OPTIMIZE_FLAGS:
+        print(f"ERROR: PYUBUS_OPTIMIZE must be 'size' or 'speed', not '{optimize}'")
+        sys.exit(1)
+    
+    return disabled, optimize
+
+def check_dependencies(disabled=()):
     """Check if required C dependencies are available"""
     missing = []
     
@@ -33,6 +67,9 @@ def check_dependencies():
     except (subprocess.CalledProcessError, FileNotFoundError):
         missing.append('libubus')
     
+    if 'json' in disabled:
+        return missing
+    
     try:
         subprocess.check_call(['pkg-config', '--exists', 'json-c'],
                             stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
@@ -82,7 +119,8 @@ def get_pkg_config_flags(library):
 print("PyUbus - Native C Extension for OpenWrt ubus")
 print("Checking dependencies...")
 
-missing_deps = check_dependencies()
+disabled_features, optimize = build_options()
+missing_deps = check_dependencies(disabled_features)
 if missing_deps:
     print(f"ERROR: Missing required dependencies: {', '.join(missing_deps)}")
     print("\nTo install dependencies:")
@@ -105,8 +143,11 @@ if not os.path.exists("pyubus/c_extension/ubus_module.c"):
 print("Building native C extension...")
 
 # Get libubus and json-c flags
+with_json = 'json' not in disabled_features
 libubus_flags = get_pkg_config_flags('libubus')
-json_flags = get_pkg_config_flags('json-c')
+json_flags = get_pkg_config_flags('json-c') if with_json else {
+    'libraries': [], 'include_dirs': [], 'library_dirs': []
+}
 
 # Combine flags
 libraries = libubus_flags['libraries'] + json_flags['libraries']
@@ -115,10 +156,18 @@ library_dirs = libubus_flags['library_dirs'] + json_flags['library_dirs']
 
 # Fallback values if pkg-config fails
 if not libraries:
-    libraries = ['ubus', 'json-c', 'blobmsg_json']
+    libraries = ['ubus', 'json-c', 'blobmsg_json'] if with_json else ['ubus']
 if not include_dirs:
     include_dirs = ['/usr/include']
 
+# blobmsg_format_json() for call_json() lives in its own library, which
+# pkg-config does not list for libubus
+if with_json and 'blobmsg_json' not in libraries:
+    libraries.append('blobmsg_json')
+
+compile_flags, link_flags = OPTIMIZE_FLAGS[optimize]
+define_macros = [(f'PYUBUS_WITH_{feature.upper()}', '0') for feature in sorted(disabled_features)]
+
 # Define the C extension module
 ubus_native_ext = Extension(
     'ubus_native',
@@ -126,20 +175,22 @@ ubus_native_ext = Extension(
     libraries=libraries,
     include_dirs=include_dirs,
     library_dirs=library_dirs,
+    define_macros=define_macros,
     extra_compile_args=[
         '-std=c99', 
         '-Wall', 
         '-Wextra',
-        '-O3',  # Optimize for performance
         '-DNDEBUG'  # Disable debug assertions
-    ],
-    extra_link_args=[],
+    ] + compile_flags,
+    extra_link_args=link_flags,
 )
 
 print(f"C extension configuration:")
 print(f"  Libraries: {libraries}")
 print(f"  Include dirs: {include_dirs}")
 print(f"  Library dirs: {library_dirs}")
+print(f"  Optimization: {' '.join(compile_flags)}")
+print(f"  Disabled features: {', '.join(sorted(disabled_features)) or 'none'}")
 
 setup(
     name="pyubus",
@@ -189,6 +240,7 @@ setup(
     entry_points={
         "console_scripts": [
             "pyubus=pyubus.cli:main",
+            "pyubus-bench=pyubus.bench:main",
         ],
     },
     include_package_data=True,